@@ -4,11 +4,20 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
-#include <optional>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 
 namespace ASTImpl
 {
@@ -70,307 +79,839 @@ namespace ASTImpl
         /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
-    class Expr
+    namespace
     {
-    public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream &out) const = 0;
-        virtual void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const std::function<const CellInterface::Value(Position)> &lambda) const = 0;
+        ExprPrecedence GetPrecedence(OpCode op)
+        {
+            switch (op)
+            {
+            case OpCode::Add:
+                return EP_ADD;
+            case OpCode::Subtract:
+                return EP_SUB;
+            case OpCode::Multiply:
+                return EP_MUL;
+            case OpCode::Divide:
+                return EP_DIV;
+            case OpCode::UnaryPlus:
+            case OpCode::UnaryMinus:
+                return EP_UNARY;
+            default:
+                return EP_ATOM;
+            }
+        }
+
+        char GetSign(OpCode op)
+        {
+            switch (op)
+            {
+            case OpCode::Add:
+            case OpCode::UnaryPlus:
+                return '+';
+            case OpCode::Subtract:
+            case OpCode::UnaryMinus:
+                return '-';
+            case OpCode::Multiply:
+                return '*';
+            case OpCode::Divide:
+                return '/';
+            default:
+                // have to do this because VC++ has a buggy warning
+                assert(false);
+                return '?';
+            }
+        }
+
+        bool IsBinary(OpCode op)
+        {
+            return op == OpCode::Add || op == OpCode::Subtract || op == OpCode::Multiply || op == OpCode::Divide;
+        }
+
+        struct Function
+        {
+            std::string_view name;
+            OpCode op;
+        };
+
+        constexpr Function FUNCTIONS[] = {
+            {"SUM", OpCode::Sum},
+            {"MIN", OpCode::Min},
+            {"MAX", OpCode::Max},
+            {"AVERAGE", OpCode::Average},
+            {"COUNT", OpCode::Count},
+            {"PRODUCT", OpCode::Product},
+        };
 
-        // higher is tighter
-        virtual ExprPrecedence GetPrecedence() const = 0;
+        // Returns OpCode::PushNumber if name is not a function.
+        OpCode FindFunction(std::string_view name)
+        {
+            for (const auto &function : FUNCTIONS)
+            {
+                if (function.name == name)
+                {
+                    return function.op;
+                }
+            }
+            return OpCode::PushNumber;
+        }
 
-        void PrintFormula(std::ostream &out, ExprPrecedence parent_precedence,
-                          bool right_child = false) const
+        std::string_view GetFunctionName(OpCode op)
         {
-            auto precedence = GetPrecedence();
-            auto mask = right_child ? PR_RIGHT : PR_LEFT;
-            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-            if (parens_needed)
+            for (const auto &function : FUNCTIONS)
             {
-                out << '(';
+                if (function.op == op)
+                {
+                    return function.name;
+                }
             }
+            assert(false);
+            return "?";
+        }
+
+        // The number of stack entries a function call takes.
+        std::size_t GetCallArguments(std::uint32_t arg)
+        {
+            return std::size_t{GetCallValues(arg)} + GetCallRanges(arg);
+        }
 
-            DoPrintFormula(out, precedence);
+        // a subexpression restored from the postfix program while printing
+        struct PrintedExpr
+        {
+            std::string text;
+            ExprPrecedence precedence;
+        };
 
-            if (parens_needed)
+        std::string PrintChild(const PrintedExpr &child, ExprPrecedence parent_precedence, PrecedenceRule mask)
+        {
+            if (PRECEDENCE_RULES[parent_precedence][child.precedence] & mask)
             {
-                out << ')';
+                return '(' + child.text + ')';
             }
+            return child.text;
         }
-    };
 
-    namespace
-    {
-        class BinaryOpExpr final : public Expr
+        std::string PrintNumber(double value)
         {
-        public:
-            enum Type : char
+            std::ostringstream out;
+            out << value;
+            return out.str();
+        }
+
+        Position Shift(Position offset, Position anchor)
+        {
+            return {anchor.row + offset.row, anchor.col + offset.col};
+        }
+
+        Range Shift(Range offset, Position anchor)
+        {
+            return {Shift(offset.from, anchor), Shift(offset.to, anchor)};
+        }
+
+        // Unlike Range::ToString, keeps both ends of a one-cell range: the
+        // text has to parse back into a range.
+        std::string PrintRange(Range range)
+        {
+            return range.from.ToString() + ':' + range.to.ToString();
+        }
+
+        void CombineHash(std::size_t &hash, std::size_t value)
+        {
+            hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        }
+
+        std::uint64_t GetBits(double value)
+        {
+            std::uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        double CellToNumber(const SheetInterface &sheet, Position pos)
+        {
+            if (!pos.IsValid())
             {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            return sheet.GetNumber(pos);
+        }
 
-        public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-                : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs))
+        // Folds the numbers into LANES independent accumulators: neighbouring
+        // elements don't depend on each other, so the loop is compiled into
+        // vector instructions, LANES numbers at a time.
+        template <typename Combine>
+        double Fold(const double *numbers, std::size_t count, double identity, Combine combine)
+        {
+            static const std::size_t LANES = 4;
+            double lanes[LANES] = {identity, identity, identity, identity};
+            std::size_t i = 0;
+            for (; i + LANES <= count; i += LANES)
+            {
+                for (std::size_t lane = 0; lane < LANES; ++lane)
+                {
+                    lanes[lane] = combine(lanes[lane], numbers[i + lane]);
+                }
+            }
+            for (; i < count; ++i)
             {
+                lanes[0] = combine(lanes[0], numbers[i]);
             }
+            return combine(combine(lanes[0], lanes[1]), combine(lanes[2], lanes[3]));
+        }
 
-            void Print(std::ostream &out) const override
+        // The running result of an aggregate function over its arguments;
+        // the numbers of a range argument arrive in blocks gathered by the
+        // sheet.
+        class Aggregator
+        {
+        public:
+            explicit Aggregator(OpCode op)
+                : op_(op)
             {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
+                switch (op_)
+                {
+                case OpCode::Min:
+                    value_ = std::numeric_limits<double>::infinity();
+                    break;
+                case OpCode::Max:
+                    value_ = -std::numeric_limits<double>::infinity();
+                    break;
+                case OpCode::Product:
+                    value_ = 1;
+                    break;
+                default:
+                    value_ = 0;
+                }
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override
+            void Add(const double *numbers, std::size_t count)
             {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                switch (op_)
+                {
+                case OpCode::Sum:
+                case OpCode::Average:
+                    value_ += Fold(numbers, count, 0.0, [](double lhs, double rhs)
+                                   { return lhs + rhs; });
+                    break;
+                case OpCode::Min:
+                    value_ = std::min(value_, Fold(numbers, count, value_, [](double lhs, double rhs)
+                                                   { return rhs < lhs ? rhs : lhs; }));
+                    break;
+                case OpCode::Max:
+                    value_ = std::max(value_, Fold(numbers, count, value_, [](double lhs, double rhs)
+                                                   { return lhs < rhs ? rhs : lhs; }));
+                    break;
+                case OpCode::Product:
+                    value_ *= Fold(numbers, count, 1.0, [](double lhs, double rhs)
+                                   { return lhs * rhs; });
+                    break;
+                default:
+                    break;
+                }
+                count_ += count;
             }
 
-            ExprPrecedence GetPrecedence() const override
+            // As in common spreadsheets, MIN, MAX and PRODUCT of no values
+            // are zero and AVERAGE of no values is a division by zero.
+            double GetResult() const
             {
-                switch (type_)
+                switch (op_)
                 {
-                case Add:
-                    return EP_ADD;
-                case Subtract:
-                    return EP_SUB;
-                case Multiply:
-                    return EP_MUL;
-                case Divide:
-                    return EP_DIV;
+                case OpCode::Count:
+                    return static_cast<double>(count_);
+                case OpCode::Average:
+                    if (count_ == 0)
+                    {
+                        throw FormulaError(FormulaError::Category::Div0);
+                    }
+                    return value_ / static_cast<double>(count_);
+                case OpCode::Min:
+                case OpCode::Max:
+                case OpCode::Product:
+                    return count_ == 0 ? 0.0 : value_;
                 default:
-                    // have to do this because VC++ has a buggy warning
-                    assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
+                    return value_;
+                }
+            }
+
+        private:
+            OpCode op_;
+            double value_;
+            std::size_t count_ = 0;
+        };
+
+        double Aggregate(OpCode op, const double *values, std::size_t value_count, const Range *ranges,
+                         std::size_t range_count, const SheetInterface &sheet, Position anchor)
+        {
+            Aggregator aggregator(op);
+            aggregator.Add(values, value_count);
+            for (std::size_t i = 0; i < range_count; ++i)
+            {
+                const Range range = Shift(ranges[i], anchor);
+                if (!range.from.IsValid() || !range.to.IsValid())
+                {
+                    throw FormulaError(FormulaError::Category::Ref);
                 }
+                sheet.GatherNumbers(range, [&aggregator](const double *numbers, std::size_t count)
+                                    { aggregator.Add(numbers, count); });
+            }
+            return aggregator.GetResult();
+        }
+
+        double Apply(OpCode op, double lhs, double rhs)
+        {
+            switch (op)
+            {
+            case OpCode::Add:
+                return lhs + rhs;
+            case OpCode::Subtract:
+                return lhs - rhs;
+            case OpCode::Multiply:
+                return lhs * rhs;
+            default:
+                return lhs / rhs;
             }
+        }
+
+        bool IsSame(double lhs, double rhs)
+        {
+            return GetBits(lhs) == GetBits(rhs);
+        }
 
-            double Evaluate(const std::function<const CellInterface::Value(Position)> &lambda) const override
+        // x op constant == x for every x, -0, infinities and NaN included.
+        // x + 0 is not: -0 + 0 is +0.
+        bool IsRightIdentity(OpCode op, double constant)
+        {
+            return ((op == OpCode::Multiply || op == OpCode::Divide) && constant == 1)
+                || (op == OpCode::Subtract && IsSame(constant, 0.0)) || (op == OpCode::Add && IsSame(constant, -0.0));
+        }
+
+        bool IsLeftIdentity(OpCode op, double constant)
+        {
+            return (op == OpCode::Multiply && constant == 1) || (op == OpCode::Add && IsSame(constant, -0.0));
+        }
+
+        // Simplifies a well-formed program into code, keeping the result
+        // bitwise and the errors the same:
+        //  - operations and functions (without ranges) on constants are
+        //    evaluated, except a division by zero, which has to fail when
+        //    the formula is executed;
+        //  - unary plus is dropped and double negation cancels;
+        //  - identities x*1, 1*x, x/1, x-0, x+(-0) and -0+x become x.
+        // Operands that can fail are never dropped, so the first error of
+        // the execution stays the same. Returns false if nothing changed.
+        bool Simplify(const std::pmr::vector<Instruction> &program, const std::pmr::vector<double> &numbers,
+                      std::pmr::vector<Instruction> &code, std::pmr::vector<double> &code_numbers)
+        {
+            // a value on the stack and the code computing it
+            struct Operand
+            {
+                std::size_t start;
+                bool constant;
+                double value;
+                // the code ends with UnaryMinus
+                bool negated;
+            };
+            std::vector<Operand> stack;
+            std::vector<double> values;
+            // a constant is one PushNumber; its number is stored once the
+            // constant becomes a part of a non-constant expression
+            auto push_constant = [&](std::size_t start, double value)
+            {
+                code.resize(start);
+                code.push_back({OpCode::PushNumber, 0});
+                stack.push_back({start, true, value, false});
+            };
+            auto store = [&](const Operand &operand)
             {
-                using namespace std::string_literals;
-                if (type_ == Add)
+                if (operand.constant)
                 {
-                    return lhs_->Evaluate(lambda) + rhs_->Evaluate(lambda);
+                    code[operand.start].arg = static_cast<std::uint32_t>(code_numbers.size());
+                    code_numbers.push_back(operand.value);
                 }
-                else if (type_ == Subtract)
+            };
+
+            code.clear();
+            code_numbers.clear();
+            for (const auto &instruction : program)
+            {
+                switch (instruction.op)
                 {
-                    return lhs_->Evaluate(lambda) - rhs_->Evaluate(lambda);
+                case OpCode::PushNumber:
+                    push_constant(code.size(), numbers[instruction.arg]);
+                    break;
+                case OpCode::LoadCell:
+                case OpCode::LoadRange:
+                    stack.push_back({code.size(), false, 0, false});
+                    code.push_back(instruction);
+                    break;
+                case OpCode::UnaryPlus:
+                    break;
+                case OpCode::UnaryMinus:
+                {
+                    Operand &operand = stack.back();
+                    if (operand.constant)
+                    {
+                        operand.value = -operand.value;
+                    }
+                    else if (operand.negated)
+                    {
+                        code.pop_back();
+                        operand.negated = false;
+                    }
+                    else
+                    {
+                        code.push_back(instruction);
+                        operand.negated = true;
+                    }
+                    break;
                 }
-                else if (type_ == Multiply)
+                case OpCode::Add:
+                case OpCode::Subtract:
+                case OpCode::Multiply:
+                case OpCode::Divide:
                 {
-                    return lhs_->Evaluate(lambda) * rhs_->Evaluate(lambda);
+                    const Operand rhs = stack.back();
+                    stack.pop_back();
+                    Operand &lhs = stack.back();
+                    if (lhs.constant && rhs.constant && !(instruction.op == OpCode::Divide && rhs.value == 0))
+                    {
+                        lhs.value = Apply(instruction.op, lhs.value, rhs.value);
+                        code.resize(lhs.start + 1);
+                    }
+                    else if (rhs.constant && IsRightIdentity(instruction.op, rhs.value))
+                    {
+                        code.resize(rhs.start);
+                    }
+                    else if (lhs.constant && IsLeftIdentity(instruction.op, lhs.value))
+                    {
+                        code.erase(code.begin() + lhs.start);
+                        lhs = {lhs.start, false, 0, rhs.negated};
+                    }
+                    else
+                    {
+                        store(lhs);
+                        store(rhs);
+                        code.push_back(instruction);
+                        lhs = {lhs.start, false, 0, false};
+                    }
+                    break;
                 }
-                else
+                default:
                 {
-                    if (rhs_->Evaluate(lambda) != 0)
+                    assert(IsFunction(instruction.op));
+                    const std::size_t arguments = GetCallArguments(instruction.arg);
+                    const std::size_t first = stack.size() - arguments;
+                    const bool constant = GetCallRanges(instruction.arg) == 0
+                        && std::all_of(stack.begin() + first, stack.end(), [](const Operand &operand)
+                                       { return operand.constant; });
+                    const std::size_t start = stack[first].start;
+                    if (constant)
                     {
-                        return lhs_->Evaluate(lambda) / rhs_->Evaluate(lambda);
+                        // a call without ranges has at least one value, so
+                        // the result can't be an error
+                        values.clear();
+                        for (auto it = stack.begin() + first; it != stack.end(); ++it)
+                        {
+                            values.push_back(it->value);
+                        }
+                        Aggregator aggregator(instruction.op);
+                        aggregator.Add(values.data(), values.size());
+                        stack.resize(first);
+                        push_constant(start, aggregator.GetResult());
                     }
                     else
                     {
-                        FormulaError::Category category(FormulaError::Category::Div0);
-                        throw FormulaError(category);
+                        std::for_each(stack.begin() + first, stack.end(), store);
+                        stack.resize(first);
+                        stack.push_back({start, false, 0, false});
+                        code.push_back(instruction);
                     }
+                    break;
+                }
                 }
             }
+            assert(stack.size() == 1);
+            store(stack.back());
+            if (code.size() == program.size())
+            {
+                code.clear();
+                code_numbers.clear();
+                return false;
+            }
+            return true;
+        }
 
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
-        };
-
-        class UnaryOpExpr final : public Expr
+        // Collects the subexpressions of a program (see
+        // FormulaAST::GetSubexpressions).
+        void FindSubexpressions(const std::pmr::vector<Instruction> &program, std::pmr::vector<Subexpression> &found)
         {
-        public:
-            enum Type : char
+            struct Operand
             {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
+                std::uint32_t begin;
+                std::uint32_t range_count;
+                bool reads_sheet;
             };
+            std::vector<Operand> stack;
+            found.clear();
+            for (std::size_t i = 0; i < program.size(); ++i)
+            {
+                const auto &instruction = program[i];
+                const auto index = static_cast<std::uint32_t>(i);
+                if (instruction.op == OpCode::PushNumber)
+                {
+                    stack.push_back({index, 0, false});
+                    continue;
+                }
+                if (instruction.op == OpCode::LoadCell || instruction.op == OpCode::LoadRange)
+                {
+                    stack.push_back({index, 0, true});
+                    continue;
+                }
+                std::size_t arguments = 1;
+                if (IsBinary(instruction.op))
+                {
+                    arguments = 2;
+                }
+                else if (IsFunction(instruction.op))
+                {
+                    arguments = GetCallArguments(instruction.arg);
+                }
+                Operand node{stack[stack.size() - arguments].begin, 0, false};
+                for (auto it = stack.end() - arguments; it != stack.end(); ++it)
+                {
+                    node.range_count += it->range_count;
+                    node.reads_sheet = node.reads_sheet || it->reads_sheet;
+                }
+                const std::uint32_t own_ranges = IsFunction(instruction.op) ? GetCallRanges(instruction.arg) : 0;
+                node.range_count += own_ranges;
+                stack.resize(stack.size() - arguments);
+                stack.push_back(node);
 
-        public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-                : type_(type), operand_(std::move(operand))
+                const std::size_t size = i + 1 - node.begin;
+                if (node.reads_sheet && size < program.size() && (size >= MIN_SHARED_SIZE || own_ranges != 0))
+                {
+                    found.push_back({node.begin, index + 1, node.range_count});
+                }
+            }
+            // post-order puts an enclosing subtree after the ones inside it
+            std::sort(found.begin(), found.end(), [](const Subexpression &lhs, const Subexpression &rhs)
+                      { return lhs.begin != rhs.begin ? lhs.begin < rhs.begin : lhs.end > rhs.end; });
+        }
+
+        // The catalogue of specialized evaluators: formulas of one or two
+        // operands, a cell or a number each, and at most one operation.
+        // Each is a template instance with the operation and the kinds of
+        // operands fixed, so it reads its operands and computes the result
+        // directly, in the order the program would.
+        enum class OperandKind
+        {
+            Cell,
+            Number,
+        };
+
+        template <OperandKind kind>
+        double LoadOperand(const FormulaAST &ast, std::uint32_t arg, const SheetInterface &sheet, Position anchor)
+        {
+            if constexpr (kind == OperandKind::Cell)
+            {
+                return CellToNumber(sheet, Shift(ast.GetCells()[arg], anchor));
+            }
+            else
             {
+                return ast.GetExecutedNumbers()[arg];
             }
+        }
+
+        // =A1, =2, =-A1
+        template <OperandKind kind, bool negate>
+        double EvaluateOperand(const FormulaAST &ast, const SheetInterface &sheet, Position anchor)
+        {
+            const double value = LoadOperand<kind>(ast, ast.GetExecutedProgram()[0].arg, sheet, anchor);
+            return negate ? -value : value;
+        }
 
-            void Print(std::ostream &out) const override
+        // =A1+B1, =A1*2, =1/A1
+        template <OpCode op, OperandKind lhs_kind, OperandKind rhs_kind>
+        double EvaluateBinary(const FormulaAST &ast, const SheetInterface &sheet, Position anchor)
+        {
+            const auto &program = ast.GetExecutedProgram();
+            const double lhs = LoadOperand<lhs_kind>(ast, program[0].arg, sheet, anchor);
+            const double rhs = LoadOperand<rhs_kind>(ast, program[1].arg, sheet, anchor);
+            if constexpr (op == OpCode::Add)
+            {
+                return lhs + rhs;
+            }
+            else if constexpr (op == OpCode::Subtract)
+            {
+                return lhs - rhs;
+            }
+            else if constexpr (op == OpCode::Multiply)
+            {
+                return lhs * rhs;
+            }
+            else
             {
-                out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
-                out << ')';
+                if (rhs == 0)
+                {
+                    throw FormulaError(FormulaError::Category::Div0);
+                }
+                return lhs / rhs;
             }
+        }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override
+        template <OperandKind lhs_kind, OperandKind rhs_kind>
+        Evaluator FindBinaryEvaluator(OpCode op)
+        {
+            switch (op)
             {
-                out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+            case OpCode::Add:
+                return &EvaluateBinary<OpCode::Add, lhs_kind, rhs_kind>;
+            case OpCode::Subtract:
+                return &EvaluateBinary<OpCode::Subtract, lhs_kind, rhs_kind>;
+            case OpCode::Multiply:
+                return &EvaluateBinary<OpCode::Multiply, lhs_kind, rhs_kind>;
+            case OpCode::Divide:
+                return &EvaluateBinary<OpCode::Divide, lhs_kind, rhs_kind>;
+            default:
+                return nullptr;
             }
+        }
 
-            ExprPrecedence GetPrecedence() const override
+        bool IsOperand(const Instruction &instruction)
+        {
+            return instruction.op == OpCode::LoadCell || instruction.op == OpCode::PushNumber;
+        }
+
+        // Returns the evaluator of a program of a shape from the catalogue,
+        // nullptr for any other. Constant operations are left out: Simplify
+        // folds them, except division by zero.
+        Evaluator FindEvaluator(const std::pmr::vector<Instruction> &program)
+        {
+            if (program.empty() || !IsOperand(program[0]))
             {
-                return EP_UNARY;
+                return nullptr;
+            }
+            const bool is_cell = program[0].op == OpCode::LoadCell;
+            if (program.size() == 1)
+            {
+                return is_cell ? &EvaluateOperand<OperandKind::Cell, false> : &EvaluateOperand<OperandKind::Number, false>;
+            }
+            if (program.size() == 2 && is_cell && program[1].op == OpCode::UnaryMinus)
+            {
+                return &EvaluateOperand<OperandKind::Cell, true>;
+            }
+            if (program.size() != 3 || !IsOperand(program[1]))
+            {
+                return nullptr;
+            }
+            const bool rhs_is_cell = program[1].op == OpCode::LoadCell;
+            if (is_cell && rhs_is_cell)
+            {
+                return FindBinaryEvaluator<OperandKind::Cell, OperandKind::Cell>(program[2].op);
+            }
+            if (is_cell)
+            {
+                return FindBinaryEvaluator<OperandKind::Cell, OperandKind::Number>(program[2].op);
+            }
+            if (rhs_is_cell)
+            {
+                return FindBinaryEvaluator<OperandKind::Number, OperandKind::Cell>(program[2].op);
             }
+            return nullptr;
+        }
 
-            double Evaluate(const std::function<const CellInterface::Value(Position)> &lambda) const override
+        // Reads the cells of column pos.col from pos.row down into numbers,
+        // marking the ones off the sheet as failed.
+        void LoadColumn(const SheetInterface &sheet, Position pos, std::size_t count, double *numbers, bool *failed)
+        {
+            // rows [begin, end) are on the sheet
+            const auto rows = static_cast<std::ptrdiff_t>(count);
+            std::ptrdiff_t begin = 0;
+            std::ptrdiff_t end = 0;
+            if (pos.col >= 0 && pos.col < Position::MAX_COLS)
             {
-                if (type_ == UnaryPlus)
-                {
-                    return operand_->Evaluate(lambda);
-                }
-                else
+                begin = std::clamp<std::ptrdiff_t>(-pos.row, 0, rows);
+                end = std::clamp<std::ptrdiff_t>(Position::MAX_ROWS - pos.row, begin, rows);
+            }
+            for (std::ptrdiff_t i = 0; i < rows; ++i)
+            {
+                if (i < begin || i >= end)
                 {
-                    return -1 * operand_->Evaluate(lambda);
+                    numbers[i] = 0.0;
+                    failed[i] = true;
                 }
             }
+            if (begin < end)
+            {
+                sheet.ReadColumn(Position{pos.row + static_cast<int>(begin), pos.col}, end - begin, numbers + begin,
+                                 failed + begin);
+            }
+        }
 
-        private:
-            Type type_;
-            std::unique_ptr<Expr> operand_;
-        };
+        // lhs[i] = operation(lhs[i], rhs[i]); neighbouring rows don't depend
+        // on each other, so the loop is compiled into vector instructions.
+        template <typename Operation>
+        void ApplyToColumns(double *lhs, const double *rhs, std::size_t count, Operation operation)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                lhs[i] = operation(lhs[i], rhs[i]);
+            }
+        }
 
-        class CellExpr final : public Expr
+        // Collects the postfix program; both parsers feed it operands and
+        // operations in the order the stack machine executes them.
+        class ProgramBuilder
         {
         public:
-            explicit CellExpr(const Position *cell)
-                : cell_(cell)
+            explicit ProgramBuilder(std::pmr::memory_resource *resource)
+                : program_(resource), numbers_(resource), cells_(resource), ranges_(resource)
             {
             }
 
-            void Print(std::ostream &out) const override
+            void AddNumber(double value)
             {
-                out << cell_->ToString();
+                numbers_.push_back(value);
+                Push(OpCode::PushNumber, numbers_.size() - 1);
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override
+            void AddCell(Position cell)
             {
-                Print(out);
+                cells_.push_back(cell);
+                Push(OpCode::LoadCell, cells_.size() - 1);
             }
 
-            ExprPrecedence GetPrecedence() const override
+            // The ends of the range may be given in any order.
+            void AddRange(Position first, Position second)
             {
-                return EP_ATOM;
+                Range range{{std::min(first.row, second.row), std::min(first.col, second.col)},
+                            {std::max(first.row, second.row), std::max(first.col, second.col)}};
+                pending_ranges_.push_back({range, program_.size(), depth_ + 1});
+                Push(OpCode::LoadRange, 0);
             }
 
-            double Evaluate(const std::function<const CellInterface::Value(Position)> &lambda) const override
+            // A call of the function op on the last arguments entries of
+            // the stack; its range arguments are moved to ranges_ in the
+            // order the call reads them.
+            void AddCall(OpCode op, std::size_t arguments)
             {
-                if (cell_->row < 0 || cell_->col < 0 || cell_->row >= Position::MAX_ROWS || cell_->col >= Position::MAX_COLS)
+                assert(arguments >= 1 && depth_ >= arguments);
+                auto first = pending_ranges_.end();
+                while (first != pending_ranges_.begin() && std::prev(first)->depth > depth_ - arguments)
                 {
-                    FormulaError::Category category(FormulaError::Category::Ref);
-                    throw FormulaError(category);
+                    --first;
                 }
-                auto value = lambda(*cell_);
-                if (std::holds_alternative<double>(value))
+                const std::size_t ranges = pending_ranges_.end() - first;
+                const std::size_t values = arguments - ranges;
+                if (values > MAX_CALL_ARGUMENTS || ranges > MAX_CALL_ARGUMENTS)
                 {
-                    return std::get<double>(value);
+                    throw ParsingError("Too many function arguments");
                 }
-                else if (std::holds_alternative<std::string>(value))
+                for (auto it = first; it != pending_ranges_.end(); ++it)
                 {
-                    if (std::get<std::string>(value).empty())
-                    {
-                        return 0.0;
-                    }
-                    try
-                    {
-                        return std::stod(std::get<std::string>(value));
-                    }
-                    catch (std::exception &ex)
-                    {
-                        FormulaError::Category category(FormulaError::Category::Value);
-                        throw FormulaError(category);
-                    }
+                    program_[it->instruction].arg = static_cast<std::uint32_t>(ranges_.size());
+                    ranges_.push_back(it->range);
+                }
+                pending_ranges_.erase(first, pending_ranges_.end());
+                depth_ -= arguments - 1;
+                program_.push_back({op, MakeCallArg(static_cast<std::uint32_t>(values), static_cast<std::uint32_t>(ranges))});
+            }
+
+            void AddOperation(OpCode op)
+            {
+                if (IsBinary(op))
+                {
+                    assert(depth_ >= 2);
+                    --depth_;
                 }
                 else
                 {
-                    FormulaError::Category category(FormulaError::Category::Value);
-                    throw FormulaError(category);
+                    assert(depth_ >= 1);
                 }
+                program_.push_back({op, 0});
             }
 
-        private:
-            const Position *cell_;
-        };
-
-        class NumberExpr final : public Expr
-        {
-        public:
-            explicit NumberExpr(double value)
-                : value_(value)
+            FormulaAST Build()
             {
-            }
+                assert(depth_ == 1 && pending_ranges_.empty());
+
+                // LoadCell arguments are occurrence indices so far; remap
+                // them into the sorted list of unique cells
+                std::vector<Position> occurrences(cells_.begin(), cells_.end());
+                std::sort(cells_.begin(), cells_.end());
+                cells_.erase(std::unique(cells_.begin(), cells_.end()), cells_.end());
+                for (auto &instruction : program_)
+                {
+                    if (instruction.op == OpCode::LoadCell)
+                    {
+                        auto it = std::lower_bound(cells_.begin(), cells_.end(), occurrences[instruction.arg]);
+                        instruction.arg = static_cast<std::uint32_t>(it - cells_.begin());
+                    }
+                }
 
-            void Print(std::ostream &out) const override
-            {
-                out << value_;
+                FormulaAST ast(std::move(program_), std::move(numbers_), std::move(cells_), std::move(ranges_), max_depth_);
+                ast.Optimize();
+                return ast;
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override
+        private:
+            void Push(OpCode op, std::size_t arg)
             {
-                out << value_;
+                program_.push_back({op, static_cast<std::uint32_t>(arg)});
+                max_depth_ = std::max(max_depth_, ++depth_);
             }
 
-            ExprPrecedence GetPrecedence() const override
-            {
-                return EP_ATOM;
-            }
+            std::pmr::vector<Instruction> program_;
+            std::pmr::vector<double> numbers_;
+            std::pmr::vector<Position> cells_;
+            std::pmr::vector<Range> ranges_;
+            std::size_t depth_ = 0;
+            std::size_t max_depth_ = 0;
 
-            double Evaluate(const std::function<const CellInterface::Value(Position)> &lambda) const override
+            // a range argument whose function is not parsed yet
+            struct PendingRange
             {
-                return value_;
-            }
-
-        private:
-            double value_;
+                Range range;
+                // its LoadRange instruction
+                std::size_t instruction;
+                // the stack depth with the range on it
+                std::size_t depth;
+            };
+            std::vector<PendingRange> pending_ranges_;
         };
 
-        class ParseASTListener final : public FormulaBaseListener
+        Position ParseCell(std::string_view text)
         {
-        public:
-            std::unique_ptr<Expr> MoveRoot()
+            auto value = Position::FromString(text);
+            if (!value.IsValid())
             {
-                assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
-
-                return root;
+                throw FormulaException("Invalid position: " + std::string(text));
             }
+            return value;
+        }
 
-            std::forward_list<Position> MoveCells()
+        // The parse tree is walked in post-order, so the instructions are
+        // emitted in exactly the order the stack machine executes them.
+        class ParseASTListener final : public FormulaBaseListener
+        {
+        public:
+            explicit ParseASTListener(ProgramBuilder &builder)
+                : builder_(builder)
             {
-                return std::move(cells_);
             }
 
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext *ctx) override
             {
-                assert(args_.size() >= 1);
-
-                auto operand = std::move(args_.back());
-
-                UnaryOpExpr::Type type;
                 if (ctx->SUB())
                 {
-                    type = UnaryOpExpr::UnaryMinus;
+                    builder_.AddOperation(OpCode::UnaryMinus);
                 }
                 else
                 {
                     assert(ctx->ADD() != nullptr);
-                    type = UnaryOpExpr::UnaryPlus;
+                    builder_.AddOperation(OpCode::UnaryPlus);
                 }
-
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
             }
 
             void exitLiteral(FormulaParser::LiteralContext *ctx) override
@@ -384,54 +925,44 @@ namespace ASTImpl
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
+                builder_.AddNumber(value);
             }
 
             void exitCell(FormulaParser::CellContext *ctx) override
             {
-                auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
-                if (!value.IsValid())
-                {
-                    throw FormulaException("Invalid position: " + value_str);
-                }
-
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
+                builder_.AddCell(ParseCell(ctx->CELL()->getSymbol()->getText()));
             }
 
-            void exitBinaryOp(FormulaParser::BinaryOpContext *ctx) override
+            void exitRangeArg(FormulaParser::RangeArgContext *ctx) override
             {
-                assert(args_.size() >= 2);
+                builder_.AddRange(ParseCell(ctx->CELL(0)->getSymbol()->getText()),
+                                  ParseCell(ctx->CELL(1)->getSymbol()->getText()));
+            }
 
-                auto rhs = std::move(args_.back());
-                args_.pop_back();
-
-                auto lhs = std::move(args_.back());
+            void exitCall(FormulaParser::CallContext *ctx) override
+            {
+                builder_.AddCall(FindFunction(ctx->FUNCTION()->getSymbol()->getText()), ctx->arg().size());
+            }
 
-                BinaryOpExpr::Type type;
+            void exitBinaryOp(FormulaParser::BinaryOpContext *ctx) override
+            {
                 if (ctx->ADD())
                 {
-                    type = BinaryOpExpr::Add;
+                    builder_.AddOperation(OpCode::Add);
                 }
                 else if (ctx->SUB())
                 {
-                    type = BinaryOpExpr::Subtract;
+                    builder_.AddOperation(OpCode::Subtract);
                 }
                 else if (ctx->MUL())
                 {
-                    type = BinaryOpExpr::Multiply;
+                    builder_.AddOperation(OpCode::Multiply);
                 }
                 else
                 {
                     assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
+                    builder_.AddOperation(OpCode::Divide);
                 }
-
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
             }
 
             void visitErrorNode(antlr4::tree::ErrorNode *node) override
@@ -440,8 +971,7 @@ namespace ASTImpl
             }
 
         private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            ProgramBuilder &builder_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener
@@ -456,41 +986,383 @@ namespace ASTImpl
             }
         };
 
-    } // namespace
-} // namespace ASTImpl
+        // Recursive-descent parser for the grammar in Formula.g4. It lexes
+        // on the fly straight from the input and builds no tokens or parse
+        // tree; the only allocations are the program arrays themselves.
+        //
+        //   sum     : product (('+' | '-') product)*
+        //   product : unary (('*' | '/') unary)*
+        //   unary   : ('+' | '-') unary | primary
+        //   primary : NUMBER | CELL | FUNCTION '(' arg (',' arg)* ')' | '(' sum ')'
+        //   arg     : CELL ':' CELL | sum
+        class ExpressionParser
+        {
+        public:
+            ExpressionParser(std::string_view text, ProgramBuilder &builder)
+                : text_(text), builder_(builder)
+            {
+            }
 
-FormulaAST ParseFormulaAST(std::istream &in)
-{
-    using namespace antlr4;
+            void Parse()
+            {
+                Next();
+                ParseSum();
+                if (token_ != Token::End)
+                {
+                    Fail();
+                }
+            }
+
+        private:
+            enum class Token
+            {
+                Number,
+                Cell,
+                Function,
+                Add,
+                Sub,
+                Mul,
+                Div,
+                LeftParen,
+                RightParen,
+                Comma,
+                Colon,
+                End,
+            };
+
+            static bool IsDigit(char c)
+            {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool IsLetter(char c)
+            {
+                return c >= 'A' && c <= 'Z';
+            }
+
+            [[noreturn]] void Fail() const
+            {
+                throw ParsingError("Error when parsing at position " + std::to_string(token_start_));
+            }
+
+            std::size_t SkipDigits(std::size_t pos) const
+            {
+                while (pos < text_.size() && IsDigit(text_[pos]))
+                {
+                    ++pos;
+                }
+                return pos;
+            }
+
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            std::size_t ScanNumber(std::size_t pos) const
+            {
+                std::size_t end = SkipDigits(pos);
+                if (end + 1 < text_.size() && text_[end] == '.' && IsDigit(text_[end + 1]))
+                {
+                    end = SkipDigits(end + 1);
+                }
+                else if (end == pos)
+                {
+                    Fail();
+                }
+                if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E'))
+                {
+                    std::size_t exponent = end + 1;
+                    if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-'))
+                    {
+                        ++exponent;
+                    }
+                    if (exponent < text_.size() && IsDigit(text_[exponent]))
+                    {
+                        end = SkipDigits(exponent);
+                    }
+                }
+                return end;
+            }
+
+            void Next()
+            {
+                while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r'))
+                {
+                    ++pos_;
+                }
+                token_start_ = pos_;
+                if (pos_ == text_.size())
+                {
+                    token_ = Token::End;
+                    return;
+                }
+
+                char c = text_[pos_];
+                std::size_t end = pos_ + 1;
+                switch (c)
+                {
+                case '+':
+                    token_ = Token::Add;
+                    break;
+                case '-':
+                    token_ = Token::Sub;
+                    break;
+                case '*':
+                    token_ = Token::Mul;
+                    break;
+                case '/':
+                    token_ = Token::Div;
+                    break;
+                case '(':
+                    token_ = Token::LeftParen;
+                    break;
+                case ')':
+                    token_ = Token::RightParen;
+                    break;
+                case ',':
+                    token_ = Token::Comma;
+                    break;
+                case ':':
+                    token_ = Token::Colon;
+                    break;
+                default:
+                    if (IsLetter(c))
+                    {
+                        // CELL: [A-Z]+[0-9]+, or else a FUNCTION name
+                        while (end < text_.size() && IsLetter(text_[end]))
+                        {
+                            ++end;
+                        }
+                        std::size_t digits = end;
+                        end = SkipDigits(end);
+                        if (end != digits)
+                        {
+                            token_ = Token::Cell;
+                        }
+                        else if (FindFunction(text_.substr(pos_, end - pos_)) != OpCode::PushNumber)
+                        {
+                            token_ = Token::Function;
+                        }
+                        else
+                        {
+                            Fail();
+                        }
+                    }
+                    else if (IsDigit(c) || c == '.')
+                    {
+                        end = ScanNumber(pos_);
+                        token_ = Token::Number;
+                    }
+                    else
+                    {
+                        Fail();
+                    }
+                }
+                token_text_ = text_.substr(pos_, end - pos_);
+                pos_ = end;
+            }
+
+            // The token after the current one; nothing is consumed.
+            Token PeekNext()
+            {
+                const std::size_t pos = pos_;
+                const std::size_t token_start = token_start_;
+                const Token token = token_;
+                const std::string_view token_text = token_text_;
+                Next();
+                const Token next = token_;
+                pos_ = pos;
+                token_start_ = token_start;
+                token_ = token;
+                token_text_ = token_text;
+                return next;
+            }
+
+            double ParseNumber(std::string_view text) const
+            {
+                double value = 0;
+                auto [ptr, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (error == std::errc::result_out_of_range)
+                {
+                    // istream (and so the grammar's reference parser) accepts
+                    // underflow as zero and rejects only overflow
+                    value = std::strtod(std::string(text).c_str(), nullptr);
+                    if (std::isinf(value))
+                    {
+                        throw ParsingError("Invalid number: " + std::string(text));
+                    }
+                }
+                else if (error != std::errc() || ptr != text.data() + text.size())
+                {
+                    throw ParsingError("Invalid number: " + std::string(text));
+                }
+                return value;
+            }
+
+            void ParseSum()
+            {
+                ParseProduct();
+                while (token_ == Token::Add || token_ == Token::Sub)
+                {
+                    OpCode op = token_ == Token::Add ? OpCode::Add : OpCode::Subtract;
+                    Next();
+                    ParseProduct();
+                    builder_.AddOperation(op);
+                }
+            }
+
+            void ParseProduct()
+            {
+                ParseUnary();
+                while (token_ == Token::Mul || token_ == Token::Div)
+                {
+                    OpCode op = token_ == Token::Mul ? OpCode::Multiply : OpCode::Divide;
+                    Next();
+                    ParseUnary();
+                    builder_.AddOperation(op);
+                }
+            }
 
-    ANTLRInputStream input(in);
+            void ParseUnary()
+            {
+                if (token_ == Token::Add || token_ == Token::Sub)
+                {
+                    OpCode op = token_ == Token::Add ? OpCode::UnaryPlus : OpCode::UnaryMinus;
+                    Next();
+                    ParseUnary();
+                    builder_.AddOperation(op);
+                }
+                else
+                {
+                    ParsePrimary();
+                }
+            }
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+            void ParsePrimary()
+            {
+                switch (token_)
+                {
+                case Token::Number:
+                    builder_.AddNumber(ParseNumber(token_text_));
+                    Next();
+                    break;
+                case Token::Cell:
+                    builder_.AddCell(ParseCell(token_text_));
+                    Next();
+                    break;
+                case Token::Function:
+                    ParseCall();
+                    break;
+                case Token::LeftParen:
+                    Next();
+                    ParseSum();
+                    Expect(Token::RightParen);
+                    break;
+                default:
+                    Fail();
+                }
+            }
 
-    CommonTokenStream tokens(&lexer);
+            void ParseCall()
+            {
+                const OpCode op = FindFunction(token_text_);
+                Next();
+                Expect(Token::LeftParen);
+                std::size_t arguments = 0;
+                do
+                {
+                    if (arguments++ != 0)
+                    {
+                        Next();
+                    }
+                    if (token_ == Token::Cell && PeekNext() == Token::Colon)
+                    {
+                        const Position first = ParseCell(token_text_);
+                        Next();
+                        Next();
+                        if (token_ != Token::Cell)
+                        {
+                            Fail();
+                        }
+                        builder_.AddRange(first, ParseCell(token_text_));
+                        Next();
+                    }
+                    else
+                    {
+                        ParseSum();
+                    }
+                } while (token_ == Token::Comma);
+                Expect(Token::RightParen);
+                builder_.AddCall(op, arguments);
+            }
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+            void Expect(Token token)
+            {
+                if (token_ != token)
+                {
+                    Fail();
+                }
+                Next();
+            }
 
-    tree::ParseTree *tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+            std::string_view text_;
+            ProgramBuilder &builder_;
+            std::size_t pos_ = 0;
+            std::size_t token_start_ = 0;
+            Token token_ = Token::End;
+            std::string_view token_text_;
+        };
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    } // namespace
+} // namespace ASTImpl
+
+FormulaAST ParseFormulaAST(std::istream &in, std::pmr::memory_resource *resource)
+{
+    std::string text(std::istreambuf_iterator<char>(in), {});
+    ASTImpl::ProgramBuilder builder(resource);
+    ASTImpl::ExpressionParser(text, builder).Parse();
+    return builder.Build();
+}
+
+FormulaAST ParseFormulaAST(std::string_view in_str, std::pmr::memory_resource *resource)
+{
+    using namespace std::string_literals;
+    try
+    {
+        ASTImpl::ProgramBuilder builder(resource);
+        ASTImpl::ExpressionParser(in_str, builder).Parse();
+        return builder.Build();
+    }
+    catch (const std::exception &exc)
+    {
+        std::throw_with_nested(FormulaException("Formula Exception"s));
+    }
 }
 
-FormulaAST ParseFormulaAST(const std::string &in_str)
+FormulaAST ParseFormulaASTWithAntlr(const std::string &in_str, std::pmr::memory_resource *resource)
 {
+    using namespace antlr4;
     using namespace std::string_literals;
     std::istringstream in(in_str);
     try
     {
-        return ParseFormulaAST(in);
+        ANTLRInputStream input(in);
+
+        FormulaLexer lexer(&input);
+        ASTImpl::BailErrorListener error_listener;
+        lexer.removeErrorListeners();
+        lexer.addErrorListener(&error_listener);
+
+        CommonTokenStream tokens(&lexer);
+
+        FormulaParser parser(&tokens);
+        auto error_handler = std::make_shared<BailErrorStrategy>();
+        parser.setErrorHandler(error_handler);
+        parser.removeErrorListeners();
+
+        tree::ParseTree *tree = parser.main();
+        ASTImpl::ProgramBuilder builder(resource);
+        ASTImpl::ParseASTListener listener(builder);
+        tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+        return builder.Build();
     }
     catch (const std::exception &exc)
     {
@@ -498,33 +1370,657 @@ FormulaAST ParseFormulaAST(const std::string &in_str)
     }
 }
 
-void FormulaAST::PrintCells(std::ostream &out) const
+void FormulaAST::PrintCells(std::ostream &out, Position anchor) const
 {
     for (auto cell : cells_)
     {
-        out << cell.ToString() << ' ';
+        out << ASTImpl::Shift(cell, anchor).ToString() << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream &out, Position anchor) const
+{
+    using namespace ASTImpl;
+
+    std::vector<std::string> stack;
+    for (const auto &instruction : program_)
+    {
+        if (instruction.op == OpCode::PushNumber)
+        {
+            stack.push_back(PrintNumber(numbers_[instruction.arg]));
+        }
+        else if (instruction.op == OpCode::LoadCell)
+        {
+            stack.push_back(Shift(cells_[instruction.arg], anchor).ToString());
+        }
+        else if (instruction.op == OpCode::LoadRange)
+        {
+            stack.push_back(PrintRange(Shift(ranges_[instruction.arg], anchor)));
+        }
+        else if (IsFunction(instruction.op))
+        {
+            auto first = stack.end() - GetCallArguments(instruction.arg);
+            std::string call = '(' + std::string(GetFunctionName(instruction.op));
+            for (auto it = first; it != stack.end(); ++it)
+            {
+                call += ' ' + *it;
+            }
+            stack.erase(first, stack.end());
+            stack.push_back(call + ')');
+        }
+        else if (IsBinary(instruction.op))
+        {
+            auto rhs = std::move(stack.back());
+            stack.pop_back();
+            stack.back() = '(' + std::string(1, GetSign(instruction.op)) + ' ' + stack.back() + ' ' + rhs + ')';
+        }
+        else
+        {
+            stack.back() = '(' + std::string(1, GetSign(instruction.op)) + ' ' + stack.back() + ')';
+        }
+    }
+    out << stack.back();
+}
+
+void FormulaAST::PrintFormula(std::ostream &out, Position anchor) const
+{
+    using namespace ASTImpl;
+
+    std::vector<PrintedExpr> stack;
+    for (const auto &instruction : program_)
+    {
+        if (instruction.op == OpCode::PushNumber)
+        {
+            stack.push_back({PrintNumber(numbers_[instruction.arg]), EP_ATOM});
+        }
+        else if (instruction.op == OpCode::LoadCell)
+        {
+            stack.push_back({Shift(cells_[instruction.arg], anchor).ToString(), EP_ATOM});
+        }
+        else if (instruction.op == OpCode::LoadRange)
+        {
+            stack.push_back({PrintRange(Shift(ranges_[instruction.arg], anchor)), EP_ATOM});
+        }
+        else if (IsFunction(instruction.op))
+        {
+            // the arguments are separated by commas and never need parentheses
+            auto first = stack.end() - GetCallArguments(instruction.arg);
+            std::string call = std::string(GetFunctionName(instruction.op)) + '(';
+            for (auto it = first; it != stack.end(); ++it)
+            {
+                call += (it == first ? "" : ",") + it->text;
+            }
+            stack.erase(first, stack.end());
+            stack.push_back({call + ')', EP_ATOM});
+        }
+        else if (IsBinary(instruction.op))
+        {
+            auto precedence = GetPrecedence(instruction.op);
+            auto rhs = std::move(stack.back());
+            stack.pop_back();
+            auto &lhs = stack.back();
+            lhs.text = PrintChild(lhs, precedence, PR_LEFT) + GetSign(instruction.op) + PrintChild(rhs, precedence, PR_RIGHT);
+            lhs.precedence = precedence;
+        }
+        else
+        {
+            auto &operand = stack.back();
+            operand.text = GetSign(instruction.op) + PrintChild(operand, EP_UNARY, PR_LEFT);
+            operand.precedence = EP_UNARY;
+        }
+    }
+    out << stack.back().text;
+}
+
+double FormulaAST::Execute(const SheetInterface &sheet, Position anchor) const
+{
+    return Execute(sheet, anchor, nullptr);
+}
+
+double FormulaAST::Execute(const SheetInterface &sheet, Position anchor, SharedValue *const *shared) const
+{
+    using namespace ASTImpl;
+
+    if (evaluator_ != nullptr)
+    {
+        return evaluator_(*this, sheet, anchor);
+    }
+
+    // typical formulas fit into the local buffer; deeper ones
+    // fall back to the heap
+    static const std::size_t LOCAL_STACK_SIZE = 32;
+    double local_stack[LOCAL_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double *stack = local_stack;
+    if (stack_depth_ > LOCAL_STACK_SIZE)
+    {
+        heap_stack.resize(stack_depth_);
+        stack = heap_stack.data();
+    }
+
+    // Shared subexpressions: the next one to look up and the ones being
+    // computed, innermost last. Values of subexpressions nested deeper
+    // than MAX_PENDING are not stored.
+    static const std::size_t NO_SUBEXPRESSION = ~std::size_t{0};
+    static const std::size_t MAX_PENDING = 8;
+    struct Pending
+    {
+        std::size_t end;
+        SharedValue *value;
+    };
+    Pending pending[MAX_PENDING];
+    std::size_t pending_count = 0;
+    std::size_t next_shared = shared == nullptr ? subexpressions_.size() : 0;
+    auto next_begin = [this, &next_shared]
+    {
+        return next_shared < subexpressions_.size() ? std::size_t{subexpressions_[next_shared].begin} : NO_SUBEXPRESSION;
+    };
+
+    const auto &program = GetExecutedProgram();
+    const auto &numbers = GetExecutedNumbers();
+    std::size_t top = 0;
+    // the first range argument not read yet
+    std::size_t next_range = 0;
+    for (std::size_t i = 0; i < program.size(); ++i)
+    {
+        while (i == next_begin())
+        {
+            const auto &subexpression = subexpressions_[next_shared];
+            SharedValue *value = shared[next_shared++];
+            double stored;
+            if (value->GetUsers() < 2)
+            {
+                continue;
+            }
+            if (value->TryGet(stored))
+            {
+                stack[top++] = stored;
+                next_range += subexpression.range_count;
+                i = subexpression.end;
+                while (next_shared < subexpressions_.size() && subexpressions_[next_shared].begin < i)
+                {
+                    ++next_shared;
+                }
+            }
+            else if (pending_count < MAX_PENDING)
+            {
+                pending[pending_count++] = {subexpression.end, value};
+            }
+        }
+        const auto &instruction = program[i];
+        switch (instruction.op)
+        {
+        case OpCode::PushNumber:
+            stack[top++] = numbers[instruction.arg];
+            break;
+        case OpCode::LoadCell:
+            stack[top++] = CellToNumber(sheet, Shift(cells_[instruction.arg], anchor));
+            break;
+        case OpCode::LoadRange:
+            break;
+        case OpCode::Sum:
+        case OpCode::Min:
+        case OpCode::Max:
+        case OpCode::Average:
+        case OpCode::Count:
+        case OpCode::Product:
+        {
+            const std::size_t values = GetCallValues(instruction.arg);
+            const std::size_t ranges = GetCallRanges(instruction.arg);
+            top -= values;
+            stack[top] = Aggregate(instruction.op, stack + top, values, ranges_.data() + next_range, ranges, sheet, anchor);
+            ++top;
+            next_range += ranges;
+            break;
+        }
+        case OpCode::Add:
+            --top;
+            stack[top - 1] += stack[top];
+            break;
+        case OpCode::Subtract:
+            --top;
+            stack[top - 1] -= stack[top];
+            break;
+        case OpCode::Multiply:
+            --top;
+            stack[top - 1] *= stack[top];
+            break;
+        case OpCode::Divide:
+            --top;
+            if (stack[top] == 0)
+            {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            stack[top - 1] /= stack[top];
+            break;
+        case OpCode::UnaryPlus:
+            break;
+        case OpCode::UnaryMinus:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        }
+        for (; pending_count != 0 && pending[pending_count - 1].end == i + 1; --pending_count)
+        {
+            pending[pending_count - 1].value->TryStore(stack[top - 1]);
+        }
+    }
+    assert(top == 1);
+    return stack[0];
+}
+
+void FormulaAST::ExecuteColumn(const SheetInterface &sheet, Position from, std::size_t count, double *results,
+                               bool *failed) const
+{
+    using namespace ASTImpl;
+
+    assert(column_executable_);
+    // Rows are computed in chunks: the stack of columns of one chunk
+    // stays in the cache.
+    static const std::size_t CHUNK_SIZE = 256;
+    std::vector<double> stack(stack_depth_ * CHUNK_SIZE);
+    const auto &program = GetExecutedProgram();
+    const auto &numbers = GetExecutedNumbers();
+    std::fill(failed, failed + count, false);
+    for (std::size_t first = 0; first < count; first += CHUNK_SIZE)
+    {
+        const std::size_t size = std::min(CHUNK_SIZE, count - first);
+        const Position anchor{from.row + static_cast<int>(first), from.col};
+        bool *chunk_failed = failed + first;
+        // the column past the top of the stack
+        double *top = stack.data();
+        for (const auto &instruction : program)
+        {
+            switch (instruction.op)
+            {
+            case OpCode::PushNumber:
+                std::fill(top, top + size, numbers[instruction.arg]);
+                top += CHUNK_SIZE;
+                break;
+            case OpCode::LoadCell:
+                LoadColumn(sheet, Shift(cells_[instruction.arg], anchor), size, top, chunk_failed);
+                top += CHUNK_SIZE;
+                break;
+            case OpCode::Add:
+                top -= CHUNK_SIZE;
+                ApplyToColumns(top - CHUNK_SIZE, top, size, [](double lhs, double rhs)
+                               { return lhs + rhs; });
+                break;
+            case OpCode::Subtract:
+                top -= CHUNK_SIZE;
+                ApplyToColumns(top - CHUNK_SIZE, top, size, [](double lhs, double rhs)
+                               { return lhs - rhs; });
+                break;
+            case OpCode::Multiply:
+                top -= CHUNK_SIZE;
+                ApplyToColumns(top - CHUNK_SIZE, top, size, [](double lhs, double rhs)
+                               { return lhs * rhs; });
+                break;
+            case OpCode::Divide:
+                top -= CHUNK_SIZE;
+                for (std::size_t i = 0; i < size; ++i)
+                {
+                    chunk_failed[i] |= top[i] == 0;
+                }
+                // failed rows divide by one instead of zero
+                ApplyToColumns(top - CHUNK_SIZE, top, size, [](double lhs, double rhs)
+                               { return lhs / (rhs == 0 ? 1.0 : rhs); });
+                break;
+            case OpCode::UnaryPlus:
+                break;
+            case OpCode::UnaryMinus:
+                std::transform(top - CHUNK_SIZE, top - CHUNK_SIZE + size, top - CHUNK_SIZE, std::negate<double>());
+                break;
+            default:
+                // functions are not column executable
+                assert(false);
+                break;
+            }
+        }
+        std::copy(stack.data(), stack.data() + size, results + first);
+    }
+}
+
+FormulaAST::FormulaAST(std::pmr::vector<ASTImpl::Instruction> program,
+                       std::pmr::vector<double> numbers,
+                       std::pmr::vector<Position> cells,
+                       std::pmr::vector<Range> ranges,
+                       std::size_t stack_depth)
+    : program_(std::move(program)), numbers_(std::move(numbers)), cells_(std::move(cells)), ranges_(std::move(ranges)),
+      stack_depth_(stack_depth), code_(program_.get_allocator()), code_numbers_(program_.get_allocator()),
+      subexpressions_(program_.get_allocator())
+{
+}
+
+void FormulaAST::Optimize()
+{
+    ASTImpl::Simplify(program_, numbers_, code_, code_numbers_);
+    ASTImpl::FindSubexpressions(GetExecutedProgram(), subexpressions_);
+    evaluator_ = ASTImpl::FindEvaluator(GetExecutedProgram());
+    const auto &program = GetExecutedProgram();
+    column_executable_ = std::none_of(program.begin(), program.end(), [](const ASTImpl::Instruction &instruction)
+                                      { return ASTImpl::IsFunction(instruction.op) || instruction.op == ASTImpl::OpCode::LoadRange; });
+}
+
+void FormulaAST::AppendSubexpressionKey(std::size_t index, Position anchor, std::string &key) const
+{
+    using namespace ASTImpl;
+
+    auto append = [&key](const auto &value)
+    {
+        key.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    };
+    auto append_position = [&append, anchor](Position offset)
+    {
+        const Position pos = Shift(offset, anchor);
+        append(pos.row);
+        append(pos.col);
+    };
+    const auto &program = GetExecutedProgram();
+    const auto &numbers = GetExecutedNumbers();
+    const auto &subexpression = subexpressions_[index];
+    for (std::size_t i = subexpression.begin; i < subexpression.end; ++i)
+    {
+        const auto &instruction = program[i];
+        key.push_back(static_cast<char>(instruction.op));
+        switch (instruction.op)
+        {
+        case OpCode::PushNumber:
+            append(GetBits(numbers[instruction.arg]));
+            break;
+        case OpCode::LoadCell:
+            append_position(cells_[instruction.arg]);
+            break;
+        case OpCode::LoadRange:
+            append_position(ranges_[instruction.arg].from);
+            append_position(ranges_[instruction.arg].to);
+            break;
+        default:
+            if (IsFunction(instruction.op))
+            {
+                append(instruction.arg);
+            }
+        }
+    }
+}
+
+FormulaAST::~FormulaAST() = default;
+
+bool FormulaAST::IsWellFormed() const
+{
+    using namespace ASTImpl;
+
+    if (stack_depth_ > program_.size())
+    {
+        return false;
+    }
+    // for each stack entry, the index of its range or NO_RANGE
+    static const std::uint32_t NO_RANGE = ~std::uint32_t{0};
+    std::vector<std::uint32_t> stack;
+    std::size_t next_range = 0;
+    for (const auto &instruction : program_)
+    {
+        switch (instruction.op)
+        {
+        case OpCode::PushNumber:
+        case OpCode::LoadCell:
+            if (instruction.arg >= (instruction.op == OpCode::PushNumber ? numbers_.size() : cells_.size()))
+            {
+                return false;
+            }
+            stack.push_back(NO_RANGE);
+            break;
+        case OpCode::LoadRange:
+            if (instruction.arg >= ranges_.size())
+            {
+                return false;
+            }
+            stack.push_back(instruction.arg);
+            break;
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+            if (stack.size() < 2 || stack.back() != NO_RANGE || stack[stack.size() - 2] != NO_RANGE)
+            {
+                return false;
+            }
+            stack.pop_back();
+            break;
+        case OpCode::UnaryPlus:
+        case OpCode::UnaryMinus:
+            if (stack.empty() || stack.back() != NO_RANGE)
+            {
+                return false;
+            }
+            break;
+        case OpCode::Sum:
+        case OpCode::Min:
+        case OpCode::Max:
+        case OpCode::Average:
+        case OpCode::Count:
+        case OpCode::Product:
+        {
+            const std::size_t arguments = GetCallArguments(instruction.arg);
+            if (arguments == 0 || arguments > stack.size())
+            {
+                return false;
+            }
+            // the call reads the next ranges, which must be its own
+            // range arguments in order
+            std::size_t ranges = 0;
+            for (auto it = stack.end() - arguments; it != stack.end(); ++it)
+            {
+                if (*it != NO_RANGE && *it != next_range + ranges++)
+                {
+                    return false;
+                }
+            }
+            if (ranges != GetCallRanges(instruction.arg))
+            {
+                return false;
+            }
+            next_range += ranges;
+            stack.resize(stack.size() - arguments);
+            stack.push_back(NO_RANGE);
+            break;
+        }
+        default:
+            return false;
+        }
+        if (stack.size() > stack_depth_)
+        {
+            return false;
+        }
+    }
+    auto is_ordered = [](Range range)
+    { return range.from.row <= range.to.row && range.from.col <= range.to.col; };
+    return stack.size() == 1 && stack[0] == NO_RANGE && next_range == ranges_.size()
+        && std::all_of(ranges_.begin(), ranges_.end(), is_ordered)
+        && std::adjacent_find(cells_.begin(), cells_.end(), [](Position lhs, Position rhs)
+                              { return !(lhs < rhs); }) == cells_.end();
+}
+
+bool FormulaAST::HasSameShape(const FormulaAST &other) const
+{
+    using namespace ASTImpl;
+
+    auto same_instruction = [](const Instruction &lhs, const Instruction &rhs)
+    { return lhs.op == rhs.op && lhs.arg == rhs.arg; };
+    // numbers are compared bitwise: 0 and -0 print differently
+    auto same_number = [](double lhs, double rhs)
+    { return GetBits(lhs) == GetBits(rhs); };
+    return std::equal(program_.begin(), program_.end(), other.program_.begin(), other.program_.end(), same_instruction)
+        && std::equal(numbers_.begin(), numbers_.end(), other.numbers_.begin(), other.numbers_.end(), same_number)
+        && cells_ == other.cells_ && ranges_ == other.ranges_;
+}
+
+std::size_t FormulaAST::GetShapeHash() const
+{
+    using namespace ASTImpl;
+
+    std::size_t hash = program_.size();
+    for (const auto &instruction : program_)
+    {
+        CombineHash(hash, static_cast<std::size_t>(instruction.op) << 24 ^ instruction.arg);
+    }
+    for (double number : numbers_)
+    {
+        CombineHash(hash, std::hash<std::uint64_t>{}(GetBits(number)));
+    }
+    for (const auto &cell : cells_)
+    {
+        CombineHash(hash, static_cast<std::size_t>(cell.row) * Position::MAX_COLS + cell.col);
+    }
+    for (const auto &range : ranges_)
+    {
+        CombineHash(hash, static_cast<std::size_t>(range.from.row) * Position::MAX_COLS + range.from.col);
+        CombineHash(hash, static_cast<std::size_t>(range.to.row) * Position::MAX_COLS + range.to.col);
+    }
+    return hash;
+}
+
+FormulaAST FormulaAST::Rebase(Position anchor, std::pmr::memory_resource *resource) const
+{
+    std::pmr::vector<Position> cells(resource);
+    cells.reserve(cells_.size());
+    for (const auto &cell : cells_)
+    {
+        cells.push_back({cell.row - anchor.row, cell.col - anchor.col});
+    }
+    std::pmr::vector<Range> ranges(resource);
+    ranges.reserve(ranges_.size());
+    for (const auto &range : ranges_)
+    {
+        ranges.push_back({{range.from.row - anchor.row, range.from.col - anchor.col},
+                          {range.to.row - anchor.row, range.to.col - anchor.col}});
+    }
+    FormulaAST result(std::pmr::vector<ASTImpl::Instruction>(program_, resource),
+                      std::pmr::vector<double>(numbers_, resource),
+                      std::move(cells),
+                      std::move(ranges),
+                      stack_depth_);
+    result.code_.assign(code_.begin(), code_.end());
+    result.code_numbers_.assign(code_numbers_.begin(), code_numbers_.end());
+    result.subexpressions_.assign(subexpressions_.begin(), subexpressions_.end());
+    result.evaluator_ = evaluator_;
+    result.column_executable_ = column_executable_;
+    return result;
+}
+
+FormulaShapeCache::FormulaShapeCache(std::pmr::memory_resource *resource)
+    : resource_(resource), sweep_size_(MIN_SWEEP_SIZE)
+{
+}
+
+std::shared_ptr<const FormulaAST> FormulaShapeCache::Parse(const std::string &in_str, Position anchor)
+{
+    // the formula is parsed into a local buffer; only a new shape is
+    // copied into the resource
+    std::byte buffer[SCRATCH_SIZE];
+    std::pmr::monotonic_buffer_resource scratch(buffer, sizeof(buffer), resource_);
+    return Intern(ParseFormulaAST(in_str, &scratch).Rebase(anchor, &scratch));
+}
+
+std::shared_ptr<const FormulaAST> FormulaShapeCache::Intern(const FormulaAST &shape)
+{
+    std::size_t hash = shape.GetShapeHash();
+    auto [begin, end] = entries_.equal_range(hash);
+    for (auto it = begin; it != end; ++it)
+    {
+        auto existing = it->second.lock();
+        if (existing != nullptr && existing->HasSameShape(shape))
+        {
+            return existing;
+        }
+    }
+
+    if (entries_.size() >= sweep_size_)
+    {
+        RemoveExpired();
+        sweep_size_ = std::max(2 * entries_.size(), std::size_t{MIN_SWEEP_SIZE});
     }
+    std::shared_ptr<const FormulaAST> result = std::allocate_shared<FormulaAST>(
+        std::pmr::polymorphic_allocator<FormulaAST>(resource_), shape.Rebase(Position{0, 0}, resource_));
+    entries_.emplace(hash, result);
+    return result;
 }
 
-void FormulaAST::Print(std::ostream &out) const
+std::size_t FormulaShapeCache::GetSize() const
 {
-    root_expr_->Print(out);
+    return std::count_if(entries_.begin(), entries_.end(), [](const auto &entry)
+                         { return !entry.second.expired(); });
 }
 
-void FormulaAST::PrintFormula(std::ostream &out) const
+void FormulaShapeCache::RemoveExpired()
 {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    for (auto it = entries_.begin(); it != entries_.end();)
+    {
+        if (it->second.expired())
+        {
+            it = entries_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
 }
 
-double FormulaAST::Execute(const std::function<const CellInterface::Value(Position)> &lambda) const
+bool SharedValue::TryGet(double &value) const
 {
-    return root_expr_->Evaluate(lambda);
+    if (state_.load(std::memory_order_acquire) != READY)
+    {
+        return false;
+    }
+    value = value_;
+    return true;
+}
+
+void SharedValue::TryStore(double value)
+{
+    int expected = EMPTY;
+    if (state_.compare_exchange_strong(expected, WRITING, std::memory_order_acquire))
+    {
+        value_ = value;
+        state_.store(READY, std::memory_order_release);
+    }
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr)), cells_(std::move(cells))
+void SharedValue::Invalidate()
 {
-    cells_.sort(); // to avoid sorting in GetReferencedCells
+    state_.store(EMPTY, std::memory_order_relaxed);
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+std::size_t SharedValue::GetUsers() const
+{
+    return users_;
+}
+
+SharedValue *SubexpressionTable::Acquire(const std::string &key)
+{
+    auto it = values_.try_emplace(key).first;
+    it->second.key_ = &it->first;
+    // A value nobody shared is not kept valid by invalidation.
+    if (it->second.users_++ < 2)
+    {
+        it->second.Invalidate();
+    }
+    return &it->second;
+}
+
+void SubexpressionTable::Release(SharedValue *value)
+{
+    if (--value->users_ == 0)
+    {
+        values_.erase(values_.find(*value->key_));
+        return;
+    }
+    // The released formula may have been the only cached user: the others
+    // are not reached by invalidation until they are computed again.
+    value->Invalidate();
+}
+
+std::size_t SubexpressionTable::GetSize() const
+{
+    return values_.size();
+}
@@ -1,17 +1,100 @@
 #pragma once
 
-#include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
 
-#include <forward_list>
-#include <functional>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
 #include <stdexcept>
-#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class FormulaAST;
 
 namespace ASTImpl
 {
-    class Expr;
-}
+    // The formula is compiled into its postfix form: a flat array of
+    // instructions that is executed on a stack of doubles.
+    enum class OpCode : std::uint8_t
+    {
+        PushNumber, // pushes numbers_[arg]
+        LoadCell,   // pushes the numeric value of cells_[arg]
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,
+        UnaryMinus,
+        // Names the range argument ranges_[arg] of the enclosing function.
+        // It counts as a stack entry for the stack depth and printing, but
+        // puts nothing on the value stack: the function reads its ranges
+        // straight from the sheet.
+        LoadRange,
+        // Aggregate functions. arg packs the number of value arguments
+        // (taken from the stack) and range arguments (the next unread
+        // entries of ranges_, see MakeCallArg); the result is pushed.
+        Sum,
+        Min,
+        Max,
+        Average,
+        Count,
+        Product,
+    };
+
+    struct Instruction
+    {
+        OpCode op;
+        std::uint32_t arg = 0;
+    };
+
+    // the limit on either kind of arguments of one function call
+    inline constexpr std::uint32_t MAX_CALL_ARGUMENTS = 0xFFFF;
+
+    // smaller subexpressions without ranges are cheaper to compute than to
+    // share
+    inline constexpr std::size_t MIN_SHARED_SIZE = 5;
+
+    constexpr std::uint32_t MakeCallArg(std::uint32_t values, std::uint32_t ranges)
+    {
+        return values << 16 | ranges;
+    }
+
+    constexpr std::uint32_t GetCallValues(std::uint32_t arg)
+    {
+        return arg >> 16;
+    }
+
+    constexpr std::uint32_t GetCallRanges(std::uint32_t arg)
+    {
+        return arg & MAX_CALL_ARGUMENTS;
+    }
+
+    constexpr bool IsFunction(OpCode op)
+    {
+        return op >= OpCode::Sum && op <= OpCode::Product;
+    }
+
+    // A subtree of the executed program worth sharing between formulas:
+    // instructions [begin, end) push one value, and their functions read
+    // range_count ranges.
+    struct Subexpression
+    {
+        std::uint32_t begin;
+        std::uint32_t end;
+        std::uint32_t range_count;
+    };
+
+    // Computes a formula of one small shape from the catalogue in
+    // FormulaAST.cpp (=A1+B1, =A1*2, =-A1...) without the stack machine.
+    using Evaluator = double (*)(const FormulaAST &ast, const SheetInterface &sheet, Position anchor);
+} // namespace ASTImpl
+
+class SharedValue;
 
 class ParsingError : public std::runtime_error
 {
@@ -21,35 +104,248 @@ class ParsingError : public std::runtime_error
 class FormulaAST
 {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    explicit FormulaAST(std::pmr::vector<ASTImpl::Instruction> program,
+                        std::pmr::vector<double> numbers,
+                        std::pmr::vector<Position> cells,
+                        std::pmr::vector<Range> ranges,
+                        std::size_t stack_depth);
     FormulaAST(FormulaAST &&) = default;
     FormulaAST &operator=(FormulaAST &&) = default;
     ~FormulaAST();
 
-    double Execute(const std::function<const CellInterface::Value(Position)> &lambda) const;
-    void PrintCells(std::ostream &out) const;
-    void Print(std::ostream &out) const;
-    void PrintFormula(std::ostream &out) const;
+    // References are stored relative to the anchor: the cell a reference
+    // points to is anchor + offset. A formula parsed with the default
+    // anchor keeps absolute positions.
 
-    std::forward_list<Position> &GetCells()
+    // Throws FormulaError if a referenced cell can't be used as a number
+    // or on division by zero (AVERAGE of no values included). Runs the
+    // specialized evaluator or the simplified program if Optimize made one.
+    double Execute(const SheetInterface &sheet, Position anchor = Position{0, 0}) const;
+    // The same, but the values of GetSubexpressions()[i] are taken from
+    // and stored to shared[i] when other formulas share it.
+    double Execute(const SheetInterface &sheet, Position anchor, SharedValue *const *shared) const;
+    // Executes the formula written in count cells of a column, anchored at
+    // from, from + {1, 0}..., into results, running each operation over a
+    // whole column of values at a time. Rows this can't compute (a
+    // reference off the sheet or to a cell that is not a number, division
+    // by zero) are marked in failed and have to be executed one by one;
+    // their results are unspecified. Requires CanExecuteColumn().
+    void ExecuteColumn(const SheetInterface &sheet, Position from, std::size_t count, double *results,
+                       bool *failed) const;
+    void PrintCells(std::ostream &out, Position anchor = Position{0, 0}) const;
+    void Print(std::ostream &out, Position anchor = Position{0, 0}) const;
+    void PrintFormula(std::ostream &out, Position anchor = Position{0, 0}) const;
+
+    // Offsets of the referenced cells relative to the anchor.
+    const std::pmr::vector<Position> &GetCells() const
     {
         return cells_;
     }
 
-    const std::forward_list<Position> &GetCells() const
+    // Range arguments relative to the anchor, in the order the functions
+    // read them.
+    const std::pmr::vector<Range> &GetRanges() const
     {
-        return cells_;
+        return ranges_;
+    }
+
+    const std::pmr::vector<ASTImpl::Instruction> &GetProgram() const
+    {
+        return program_;
+    }
+
+    const std::pmr::vector<double> &GetNumbers() const
+    {
+        return numbers_;
+    }
+
+    std::size_t GetStackDepth() const
+    {
+        return stack_depth_;
+    }
+
+    // Folds constants and drops identity operations (see Simplify in
+    // FormulaAST.cpp) into a separate program that Execute runs, finds
+    // its subexpressions and binds a specialized evaluator if the result
+    // has a small shape. The program as written is kept: it is printed,
+    // saved and compared by shape. Requires a well-formed formula.
+    void Optimize();
+
+    // Whether Optimize found the formula fit for ExecuteColumn: it calls
+    // no functions.
+    bool CanExecuteColumn() const
+    {
+        return column_executable_;
+    }
+
+    // Whether Execute runs a specialized evaluator instead of the program.
+    bool IsSpecialized() const
+    {
+        return evaluator_ != nullptr;
+    }
+
+    // Proper subtrees of the executed program that read the sheet and are
+    // costly enough to share: at least MIN_SHARED_SIZE instructions or a
+    // function of ranges. Sorted by begin, enclosing ones first.
+    const std::pmr::vector<ASTImpl::Subexpression> &GetSubexpressions() const
+    {
+        return subexpressions_;
+    }
+
+    // Appends to key the text of GetSubexpressions()[index] with absolute
+    // references: subexpressions with equal keys compute the same value.
+    void AppendSubexpressionKey(std::size_t index, Position anchor, std::string &key) const;
+
+    // The program Execute runs and its numbers.
+    const std::pmr::vector<ASTImpl::Instruction> &GetExecutedProgram() const
+    {
+        return code_.empty() ? program_ : code_;
+    }
+
+    const std::pmr::vector<double> &GetExecutedNumbers() const
+    {
+        return code_.empty() ? numbers_ : code_numbers_;
     }
 
+    // Checks a program that did not come from the parser (e.g. a loaded
+    // snapshot): the opcodes and arguments are in range, the stack never
+    // underflows or exceeds stack_depth (itself at most the program size)
+    // and ends with one value, every function reads exactly the ranges
+    // named by its arguments, and the cells are sorted and unique.
+    bool IsWellFormed() const;
+
+    // Two formulas have the same shape if they differ only by their anchor,
+    // i.e. =A1*B1 written in C1 and =A2*B2 written in C2.
+    bool HasSameShape(const FormulaAST &other) const;
+    std::size_t GetShapeHash() const;
+
+    // Returns the same formula with references made relative to anchor.
+    FormulaAST Rebase(Position anchor, std::pmr::memory_resource *resource) const;
+
+private:
+    // all arrays are allocated from the resource
+    // passed to ParseFormulaAST (the owning sheet's pool)
+    std::pmr::vector<ASTImpl::Instruction> program_;
+    std::pmr::vector<double> numbers_;
+
+    // referenced cells (offsets from the anchor), sorted and without
+    // duplicates; LoadCell instructions index into this array. A shift
+    // by the anchor keeps the order.
+    std::pmr::vector<Position> cells_;
+
+    // range arguments (offsets from the anchor, from <= to), grouped by
+    // function in execution order: each function call reads the next
+    // GetCallRanges(arg) of them
+    std::pmr::vector<Range> ranges_;
+
+    // the maximum number of values on the stack during execution
+    std::size_t stack_depth_;
+
+    // the simplified program with its own numbers, empty if Optimize
+    // could not simplify the formula; it needs no deeper stack
+    std::pmr::vector<ASTImpl::Instruction> code_;
+    std::pmr::vector<double> code_numbers_;
+
+    std::pmr::vector<ASTImpl::Subexpression> subexpressions_;
+
+    // set by Optimize for small shapes, which have no subexpressions
+    ASTImpl::Evaluator evaluator_ = nullptr;
+    bool column_executable_ = false;
+};
+
+FormulaAST ParseFormulaAST(std::istream &in,
+                           std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+FormulaAST ParseFormulaAST(std::string_view in_str,
+                           std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+// Parses with the ANTLR-generated parser for Formula.g4. Slow; kept as the
+// reference the hand-written parser above is tested against.
+FormulaAST ParseFormulaASTWithAntlr(const std::string &in_str,
+                                    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+// The value of a subexpression shared by the formulas that compute it over
+// the same cells (see SubexpressionTable). A formula stores it once
+// computed; any formula using it invalidates it when its own value is
+// invalidated, which happens whenever one of the cells changes because
+// every user references them. That holds while a user with a cached value
+// remains, so the table also invalidates the value when a user is released.
+// Reads and stores may race between threads evaluating a level;
+// invalidation happens between evaluations.
+class SharedValue
+{
+public:
+    // The value stored since the last Invalidate, if any.
+    bool TryGet(double &value) const;
+    // Stores value unless another formula did.
+    void TryStore(double value);
+    void Invalidate();
+
+    // The number of formulas using the value: one formula gains nothing
+    // from storing it.
+    std::size_t GetUsers() const;
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    friend class SubexpressionTable;
+
+    enum State
+    {
+        EMPTY,
+        WRITING,
+        READY,
+    };
+
+    std::atomic<int> state_{EMPTY};
+    double value_ = 0;
+    std::size_t users_ = 0;
+    // the key in the table
+    const std::string *key_ = nullptr;
+};
 
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+// Hash-conses the subexpressions of a sheet's formulas by their key (see
+// FormulaAST::AppendSubexpressionKey), so a subexpression repeated over the
+// same cells in many formulas is computed once per recalculation.
+class SubexpressionTable
+{
+public:
+    SharedValue *Acquire(const std::string &key);
+    void Release(SharedValue *value);
+
+    // The number of distinct subexpressions in use.
+    std::size_t GetSize() const;
+
+private:
+    std::unordered_map<std::string, SharedValue> values_;
 };
 
-FormulaAST ParseFormulaAST(std::istream &in);
-FormulaAST ParseFormulaAST(const std::string &in_str);
+// Interns compiled formulas by shape, so a column of copied-down formulas
+// shares one FormulaAST and every cell keeps only its anchor. Entries are
+// held weakly: a shape lives while some formula uses it.
+class FormulaShapeCache
+{
+public:
+    explicit FormulaShapeCache(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+    // Parses in_str written in the cell at anchor and returns its shape.
+    // Throws FormulaException if the formula is syntactically incorrect.
+    std::shared_ptr<const FormulaAST> Parse(const std::string &in_str, Position anchor);
+
+    // Returns the cached formula of the same shape, adding a copy of shape
+    // to the cache if there is none.
+    std::shared_ptr<const FormulaAST> Intern(const FormulaAST &shape);
+
+    // The number of shapes currently in use.
+    std::size_t GetSize() const;
+
+private:
+    static const std::size_t SCRATCH_SIZE = 1024;
+    static const std::size_t MIN_SWEEP_SIZE = 64;
+
+    using Entries = std::unordered_multimap<std::size_t, std::weak_ptr<const FormulaAST>>;
+
+    void RemoveExpired();
+
+    std::pmr::memory_resource *resource_;
+    Entries entries_;
+    // entries_ is swept of expired shapes when it grows to this size
+    std::size_t sweep_size_;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+
+// Удаляет объект, размещённый в memory_resource: вызывает деструктор и
+// возвращает память тому же ресурсу. Размер и выравнивание запоминаются при
+// создании объекта, поэтому владеть им можно и через указатель на базовый
+// класс.
+template <typename T>
+class PoolDeleter
+{
+public:
+    PoolDeleter() = default;
+
+    PoolDeleter(std::pmr::memory_resource *resource, std::size_t size, std::size_t align)
+        : resource_(resource), size_(size), align_(align)
+    {
+    }
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+    PoolDeleter(const PoolDeleter<U> &other)
+        : resource_(other.GetResource()), size_(other.GetSize()), align_(other.GetAlign())
+    {
+    }
+
+    void operator()(T *ptr) const
+    {
+        void *memory = ptr;
+        if constexpr (std::is_polymorphic_v<T>)
+        {
+            memory = dynamic_cast<void *>(ptr);
+        }
+        ptr->~T();
+        resource_->deallocate(memory, size_, align_);
+    }
+
+    std::pmr::memory_resource *GetResource() const
+    {
+        return resource_;
+    }
+
+    std::size_t GetSize() const
+    {
+        return size_;
+    }
+
+    std::size_t GetAlign() const
+    {
+        return align_;
+    }
+
+private:
+    std::pmr::memory_resource *resource_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t align_ = 0;
+};
+
+template <typename T>
+using PoolPtr = std::unique_ptr<T, PoolDeleter<T>>;
+
+// Аналог std::make_unique, берущий память у переданного ресурса.
+template <typename T, typename... Args>
+PoolPtr<T> MakePooled(std::pmr::memory_resource *resource, Args &&...args)
+{
+    void *memory = resource->allocate(sizeof(T), alignof(T));
+    try
+    {
+        T *object = new (memory) T(std::forward<Args>(args)...);
+        return PoolPtr<T>(object, PoolDeleter<T>(resource, sizeof(T), alignof(T)));
+    }
+    catch (...)
+    {
+        resource->deallocate(memory, sizeof(T), alignof(T));
+        throw;
+    }
+}
@@ -1,12 +1,47 @@
 #include "cell.h"
 
+#include "sheet.h"
+
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <type_traits>
+#include <variant>
 
-Cell::Cell(SheetInterface &sheet)
-    : sheet_(sheet)
+namespace
+{
+    // Разбирает текст так же, как std::stod: пробелы в начале пропускаются,
+    // хвост после числа игнорируется. Короткий текст копируется в буфер на
+    // стеке, чтобы не выделять память. Возвращает false, если текст не
+    // число.
+    bool TextToNumber(std::string_view text, double &number)
+    {
+        static const std::size_t LOCAL_SIZE = 64;
+        char local[LOCAL_SIZE];
+        std::string heap;
+        const char *str = local;
+        if (text.size() < LOCAL_SIZE)
+        {
+            std::copy(text.begin(), text.end(), local);
+            local[text.size()] = '\0';
+        }
+        else
+        {
+            heap.assign(text);
+            str = heap.c_str();
+        }
+        char *end;
+        errno = 0;
+        number = std::strtod(str, &end);
+        return end != str && errno != ERANGE;
+    }
+} // namespace
+
+Cell::Cell(Sheet &sheet, std::pmr::memory_resource *resource)
+    : sheet_(sheet), resource_(resource)
 {
 }
 
@@ -15,91 +50,186 @@ Cell::~Cell()
     Clear();
 }
 
-void Cell::Set(std::string text)
+void Cell::Set(std::string text, Position pos)
 {
     if (text[0] == '=' && text.size() != 1)
     {
         text = text.substr(1);
-        impl_ = std::make_unique<FormulaImpl>(std::move(text), sheet_);
-        const auto &referenced = impl_->GetReferencedCells();
-        for (const auto &cell : referenced)
-        {
-            referenced_.insert(cell);
-        }
+        impl_ = MakePooled<FormulaImpl>(resource_, std::move(text), pos, sheet_.GetFormulaShapes(), sheet_,
+                                        sheet_.GetSubexpressions(), resource_);
     }
     else
     {
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+        impl_ = MakePooled<TextImpl>(resource_, std::move(text), resource_);
     }
 }
 
+void Cell::SetFormula(PoolPtr<FormulaInterface> formula, std::optional<Value> value)
+{
+    impl_ = MakePooled<FormulaImpl>(resource_, std::move(formula), sheet_, sheet_.GetSubexpressions(), std::move(value),
+                                    resource_);
+}
+
+void Cell::Swap(Cell &other)
+{
+    std::swap(impl_, other.impl_);
+}
+
 void Cell::Clear()
 {
     impl_ = nullptr;
 }
 
+bool Cell::IsEmpty() const
+{
+    return impl_ == nullptr;
+}
+
 Cell::Value Cell::GetValue() const
 {
-    return impl_->GetValue();
+    return std::visit([](const auto &value) -> Value
+                      {
+                          if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::string_view>)
+                          {
+                              return std::string(value);
+                          }
+                          else
+                          {
+                              return value;
+                          } },
+                      GetValueRef());
+}
+
+Cell::ValueRef Cell::GetValueRef() const
+{
+    if (impl_ == nullptr)
+    {
+        return std::string_view();
+    }
+    if (!impl_->IsCached())
+    {
+        sheet_.ComputeDirty({this});
+    }
+    return impl_->GetValueRef();
+}
+
+double Cell::GetNumber() const
+{
+    if (impl_ == nullptr)
+    {
+        return 0.0;
+    }
+    if (!impl_->IsCached())
+    {
+        sheet_.ComputeDirty({this});
+    }
+    return impl_->GetNumber();
 }
 
 std::string Cell::GetText() const
 {
+    if (impl_ == nullptr)
+    {
+        return std::string();
+    }
     return impl_->GetText();
 }
 
 std::vector<Position> Cell::GetReferencedCells() const
 {
+    if (impl_ == nullptr)
+    {
+        return std::vector<Position>();
+    }
     return impl_->GetReferencedCells();
 }
 
-std::unordered_set<Position, Cell::PositionHasher> Cell::GetReferenced() const
+const FormulaInterface *Cell::GetFormula() const
 {
-    return referenced_;
+    if (impl_ == nullptr)
+    {
+        return nullptr;
+    }
+    return impl_->GetFormula();
 }
 
-std::unordered_set<Position, Cell::PositionHasher> Cell::GetCellsThatRefer() const
+void Cell::ClearCache()
 {
-    return cells_that_refer_;
+    if (impl_ != nullptr)
+    {
+        impl_->ClearCache();
+    }
 }
 
-void Cell::RemoveOldDependence(Position pos)
+bool Cell::IsCached() const
 {
-    referenced_.erase(pos);
+    return impl_ == nullptr || impl_->IsCached();
 }
 
-void Cell::AddNewDependence(Position pos)
+void Cell::UpdateCache() const
 {
-    cells_that_refer_.insert(pos);
+    if (impl_ != nullptr)
+    {
+        impl_->GetValueRef();
+    }
 }
 
-void Cell::ClearCache()
+void Cell::SetCachedValue(double value) const
 {
-    impl_->ClearCache();
+    if (impl_ != nullptr)
+    {
+        impl_->SetCachedValue(value);
+    }
 }
 
-bool Cell::IsReferenced() const
+std::int64_t Cell::GetOrder() const
 {
-    return !referenced_.empty();
+    return order_;
 }
 
-Cell::TextImpl::TextImpl(std::string str)
-    : value_(std::move(str))
+void Cell::SetOrder(std::int64_t order)
 {
+    order_ = order;
 }
 
-Cell::Value Cell::TextImpl::GetValue() const
+const FormulaInterface *Cell::Impl::GetFormula() const
 {
-    if (value_[0] == '\'')
+    return nullptr;
+}
+
+void Cell::Impl::SetCachedValue(double) const
+{
+}
+
+Cell::TextImpl::TextImpl(std::string str, std::pmr::memory_resource *resource)
+    : value_(str, resource)
+{
+    const std::string_view text = std::get<std::string_view>(GetValueRef());
+    is_number_ = text.empty() || TextToNumber(text, number_);
+}
+
+Cell::ValueRef Cell::TextImpl::GetValueRef() const
+{
+    std::string_view value = value_;
+    if (!value.empty() && value[0] == ESCAPE_SIGN)
+    {
+        value.remove_prefix(1);
+    }
+    return value;
+}
+
+double Cell::TextImpl::GetNumber() const
+{
+    if (!is_number_)
     {
-        return value_.substr(1);
+        throw FormulaError(FormulaError::Category::Value);
     }
-    return value_;
+    return number_;
 }
 
 std::string Cell::TextImpl::GetText() const
 {
-    return value_;
+    return std::string(value_);
 }
 
 std::vector<Position> Cell::TextImpl::GetReferencedCells() const
@@ -111,20 +241,54 @@ void Cell::TextImpl::ClearCache()
 {
 }
 
-Cell::FormulaImpl::FormulaImpl(std::string str, SheetInterface &sheet)
-    : ast_(ParseFormula(std::move(str))), sheet_(sheet)
+bool Cell::TextImpl::IsCached() const
+{
+    return true;
+}
+
+Cell::FormulaImpl::FormulaImpl(std::string str, Position pos, FormulaShapeCache &shapes, SheetInterface &sheet,
+                               SubexpressionTable &subexpressions, std::pmr::memory_resource *resource)
+    : ast_(ParseFormula(std::move(str), pos, shapes, resource)), sheet_(sheet), subexpressions_(subexpressions),
+      shared_(resource)
+{
+    AcquireSubexpressions();
+}
+
+Cell::FormulaImpl::FormulaImpl(PoolPtr<FormulaInterface> formula, SheetInterface &sheet,
+                               SubexpressionTable &subexpressions, std::optional<Value> value,
+                               std::pmr::memory_resource *resource)
+    : ast_(std::move(formula)), sheet_(sheet), cache_value_(std::move(value)), subexpressions_(subexpressions),
+      shared_(resource)
 {
+    AcquireSubexpressions();
 }
 
-Cell::Value Cell::FormulaImpl::GetValue() const
+Cell::FormulaImpl::~FormulaImpl()
 {
-    if (cache_value_.has_value())
+    for (SharedValue *value : shared_)
     {
-        return cache_value_.value();
+        subexpressions_.Release(value);
     }
-    else
+}
+
+void Cell::FormulaImpl::AcquireSubexpressions()
+{
+    const auto &shape = *ast_->GetShape();
+    shared_.reserve(shape.GetSubexpressions().size());
+    std::string key;
+    for (std::size_t i = 0; i < shape.GetSubexpressions().size(); ++i)
     {
-        FormulaInterface::Value value = ast_->Evaluate(sheet_);
+        key.clear();
+        shape.AppendSubexpressionKey(i, ast_->GetAnchor(), key);
+        shared_.push_back(subexpressions_.Acquire(key));
+    }
+}
+
+Cell::ValueRef Cell::FormulaImpl::GetValueRef() const
+{
+    if (!cache_value_.has_value())
+    {
+        FormulaInterface::Value value = ast_->Evaluate(sheet_, shared_.data());
         if (std::holds_alternative<double>(value))
         {
             cache_value_ = std::get<double>(value);
@@ -133,8 +297,22 @@ Cell::Value Cell::FormulaImpl::GetValue() const
         {
             cache_value_ = std::get<FormulaError>(value);
         }
-        return cache_value_.value();
     }
+    if (const double *number = std::get_if<double>(&*cache_value_))
+    {
+        return *number;
+    }
+    return std::get<FormulaError>(*cache_value_);
+}
+
+double Cell::FormulaImpl::GetNumber() const
+{
+    const ValueRef value = GetValueRef();
+    if (const double *number = std::get_if<double>(&value))
+    {
+        return *number;
+    }
+    throw FormulaError(FormulaError::Category::Value);
 }
 
 std::string Cell::FormulaImpl::GetText() const
@@ -150,4 +328,24 @@ std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const
 void Cell::FormulaImpl::ClearCache()
 {
     cache_value_.reset();
-}
\ No newline at end of file
+    // общее значение устарело у всех формул, если устарело у одной
+    for (SharedValue *value : shared_)
+    {
+        value->Invalidate();
+    }
+}
+
+bool Cell::FormulaImpl::IsCached() const
+{
+    return cache_value_.has_value();
+}
+
+const FormulaInterface *Cell::FormulaImpl::GetFormula() const
+{
+    return ast_.get();
+}
+
+void Cell::FormulaImpl::SetCachedValue(double value) const
+{
+    cache_value_ = value;
+}
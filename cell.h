@@ -1,13 +1,17 @@
 #pragma once
 
+#include "arena.h"
 #include "common.h"
 #include "formula.h"
 
+#include <cstdint>
 #include <functional>
-#include <unordered_set>
+#include <memory_resource>
 #include <optional>
 
 class Sheet;
+class SharedValue;
+class SubexpressionTable;
 
 static const int PRIME_NUMBER = 37;
 
@@ -15,7 +19,10 @@ class Cell : public CellInterface
 {
 
 public:
-    Cell(SheetInterface &sheet);
+    // Реализация ячейки и объект формулы размещаются в resource, а
+    // скомпилированная программа формулы — в пуле таблицы (она общая для
+    // формул одной формы).
+    Cell(Sheet &sheet, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
 
     ~Cell();
 
@@ -27,27 +34,59 @@ public:
         }
     };
 
-    void Set(std::string text);
+    // pos — позиция ячейки в таблице. Ссылки формулы хранятся относительно
+    // неё, поэтому формулы одной формы разделяют одну скомпилированную
+    // программу (см. Sheet::GetFormulaShapes).
+    void Set(std::string text, Position pos = Position{0, 0});
 
+    // Задаёт ячейке уже скомпилированную формулу и, если оно известно,
+    // её значение.
+    void SetFormula(PoolPtr<FormulaInterface> formula, std::optional<Value> value = std::nullopt);
+
+    // Обменивается с other содержимым. Позиция в порядке не обменивается.
+    void Swap(Cell &other);
+
+    // Делает ячейку пустой. Пустая ячейка не видна через Sheet::GetCell.
     void Clear();
 
+    bool IsEmpty() const;
+
+    // Если значение формулы не вычислено, сначала вычисляет (через
+    // Sheet::ComputeDirty) все непосчитанные ячейки, от которых она зависит.
     Value GetValue() const override;
 
+    // Как GetValue, но текст не копируется, а кэшированное значение формулы
+    // возвращается без копирования optional.
+    ValueRef GetValueRef() const override;
+
+    // Значение так, как его читают формулы (см. SheetInterface::GetNumber).
+    // Текст разбирается на число один раз, когда он записан в ячейку.
+    double GetNumber() const;
+
     std::string GetText() const override;
 
     std::vector<Position> GetReferencedCells() const override;
 
-    std::unordered_set<Position, PositionHasher> GetReferenced() const;
+    // Формула ячейки или nullptr, если в ячейке не формула.
+    const FormulaInterface *GetFormula() const;
 
-    std::unordered_set<Position, PositionHasher> GetCellsThatRefer() const;
+    void ClearCache();
 
-    void RemoveOldDependence(Position pos);
+    bool IsCached() const;
 
-    void AddNewDependence(Position pos);
+    // Вычисляет и кэширует значение, считая, что все ячейки, на которые
+    // ссылается формула, уже вычислены.
+    void UpdateCache() const;
 
-    void ClearCache();
+    // Кэширует значение формулы, вычисленное вне ячейки (см.
+    // FormulaAST::ExecuteColumn).
+    void SetCachedValue(double value) const;
+
+    // Позиция ячейки в топологическом порядке таблицы: ячейка стоит
+    // позже всех ячеек, на которые ссылается.
+    std::int64_t GetOrder() const;
 
-    bool IsReferenced() const;
+    void SetOrder(std::int64_t order);
 
 private:
     class Impl
@@ -55,21 +94,31 @@ private:
     public:
         virtual ~Impl() = default;
 
-        virtual Value GetValue() const = 0;
+        virtual ValueRef GetValueRef() const = 0;
+
+        virtual double GetNumber() const = 0;
 
         virtual std::string GetText() const = 0;
 
         virtual std::vector<Position> GetReferencedCells() const = 0;
 
         virtual void ClearCache() = 0;
+
+        virtual bool IsCached() const = 0;
+
+        virtual const FormulaInterface *GetFormula() const;
+
+        virtual void SetCachedValue(double value) const;
     };
 
     class TextImpl : public Impl
     {
     public:
-        TextImpl(std::string str);
+        TextImpl(std::string str, std::pmr::memory_resource *resource);
+
+        ValueRef GetValueRef() const override;
 
-        Value GetValue() const override;
+        double GetNumber() const override;
 
         std::string GetText() const override;
 
@@ -77,16 +126,29 @@ private:
 
         void ClearCache() override;
 
+        bool IsCached() const override;
+
     private:
-        std::string value_;
+        std::pmr::string value_;
+        // число текста; текст, который не число, читается как ошибка
+        double number_ = 0.0;
+        bool is_number_ = true;
     };
 
     class FormulaImpl : public Impl
     {
     public:
-        FormulaImpl(std::string str, SheetInterface &sheet);
+        FormulaImpl(std::string str, Position pos, FormulaShapeCache &shapes, SheetInterface &sheet,
+                    SubexpressionTable &subexpressions, std::pmr::memory_resource *resource);
+
+        FormulaImpl(PoolPtr<FormulaInterface> formula, SheetInterface &sheet, SubexpressionTable &subexpressions,
+                    std::optional<Value> value, std::pmr::memory_resource *resource);
+
+        ~FormulaImpl();
 
-        Value GetValue() const override;
+        ValueRef GetValueRef() const override;
+
+        double GetNumber() const override;
 
         std::string GetText() const override;
 
@@ -94,14 +156,26 @@ private:
 
         void ClearCache() override;
 
+        bool IsCached() const override;
+
+        const FormulaInterface *GetFormula() const override;
+
+        void SetCachedValue(double value) const override;
+
     private:
-        std::unique_ptr<FormulaInterface> ast_;
+        // Находит в таблице подвыражения формулы, общие с другими формулами.
+        void AcquireSubexpressions();
+
+        PoolPtr<FormulaInterface> ast_;
         const SheetInterface &sheet_;
         mutable std::optional<Value> cache_value_;
+        SubexpressionTable &subexpressions_;
+        // значения подвыражений FormulaAST::GetSubexpressions формулы
+        std::pmr::vector<SharedValue *> shared_;
     };
 
-    std::unique_ptr<Impl> impl_;
-    SheetInterface &sheet_;
-    std::unordered_set<Position, PositionHasher> referenced_;
-    std::unordered_set<Position, PositionHasher> cells_that_refer_;
+    PoolPtr<Impl> impl_;
+    Sheet &sheet_;
+    std::pmr::memory_resource *resource_;
+    std::int64_t order_ = 0;
 };
\ No newline at end of file
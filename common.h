@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -35,6 +37,31 @@ struct Size
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область ячеек с углами from (левый верхний) и to (правый
+// нижний) включительно.
+struct Range
+{
+    Position from;
+    Position to;
+
+    bool operator==(Range rhs) const;
+
+    bool IsValid() const;
+    // "A1:B2"; для одной ячейки — как у Position
+    std::string ToString() const;
+
+    static Range FromString(std::string_view str);
+
+    static const Range NONE;
+};
+
+// Порядок обхода ячеек: по строкам или по столбцам.
+enum class CellOrder
+{
+    RowMajor,
+    ColumnMajor,
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError
 {
@@ -92,6 +119,9 @@ public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // То же без копирования: текст представлен string_view, который
+    // действителен, пока ячейка не изменена.
+    using ValueRef = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -99,6 +129,8 @@ public:
     // В случае текстовой ячейки это её текст (без экранирующих символов). В
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
+    // Возвращает то же значение, что GetValue, ничего не копируя.
+    virtual ValueRef GetValueRef() const = 0;
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
@@ -139,6 +171,28 @@ public:
     virtual const CellInterface *GetCell(Position pos) const = 0;
     virtual CellInterface *GetCell(Position pos) = 0;
 
+    // Возвращает значение ячейки так, как его читают формулы: пустая ячейка
+    // равна нулю, текст разбирается как число. Если значение не число,
+    // бросает FormulaError категории Value. Неверная позиция —
+    // InvalidPositionException.
+    virtual double GetNumber(Position pos) const = 0;
+
+    // Передаёт числа непустых ячеек области range (построчно) в
+    // consume блоками по нескольку сотен, чтобы агрегатные функции формул
+    // обрабатывали их векторно, а не по одной ячейке. Ячейки читаются как
+    // в GetNumber; пустые пропускаются. Некорректная область —
+    // InvalidPositionException.
+    virtual void GatherNumbers(Range range,
+                               const std::function<void(const double *numbers, std::size_t count)> &consume) const = 0;
+
+    // Читает в numbers count ячеек столбца, начиная с from и вниз, так же,
+    // как GetNumber: формула, скопированная вниз по столбцу, вычисляется
+    // так сразу для многих строк. Для ячеек, которые не читаются как
+    // число, в failed записывается true, а их числа не определены;
+    // остальные элементы failed не меняются. Неверная позиция —
+    // InvalidPositionException.
+    virtual void ReadColumn(Position from, std::size_t count, double *numbers, bool *failed) const = 0;
+
     // Очищает ячейку.
     // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
     // объект с пустым текстом.
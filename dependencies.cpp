@@ -0,0 +1,97 @@
+#include "dependencies.h"
+
+#include <algorithm>
+
+DependencyIndex::DependencyIndex(std::pmr::memory_resource *resource)
+    : areas_(resource)
+{
+}
+
+void DependencyIndex::Add(Range range, Position watcher)
+{
+    ForEachPart(range, [this, watcher](Range part, int row_level, int col_level)
+                {
+                    areas_[GetKey(row_level, col_level, part.from)].push_back({part, watcher});
+                    if (level_sizes_[row_level][col_level]++ == 0)
+                    {
+                        occupied_levels_.emplace_back(row_level, col_level);
+                    }
+                    ++size_; });
+}
+
+void DependencyIndex::Remove(Range range, Position watcher)
+{
+    ForEachPart(range, [this, watcher](Range part, int row_level, int col_level)
+                {
+                    auto area = areas_.find(GetKey(row_level, col_level, part.from));
+                    if (area == areas_.end())
+                    {
+                        return;
+                    }
+                    auto &entries = area->second;
+                    auto it = std::find_if(entries.begin(), entries.end(), [part, watcher](const Entry &entry)
+                                           { return entry.range == part && entry.watcher == watcher; });
+                    if (it == entries.end())
+                    {
+                        return;
+                    }
+                    *it = entries.back();
+                    entries.pop_back();
+                    if (entries.empty())
+                    {
+                        areas_.erase(area);
+                    }
+                    if (--level_sizes_[row_level][col_level] == 0)
+                    {
+                        occupied_levels_.erase(std::find(occupied_levels_.begin(), occupied_levels_.end(),
+                                                         std::pair{row_level, col_level}));
+                    }
+                    --size_; });
+}
+
+std::size_t DependencyIndex::GetSize() const
+{
+    return size_;
+}
+
+int DependencyIndex::GetLevel(int first, int last)
+{
+    int level = 0;
+    for (int diff = first ^ last; diff != 0; diff >>= 1)
+    {
+        ++level;
+    }
+    return level;
+}
+
+std::uint64_t DependencyIndex::GetKey(int row_level, int col_level, Position pos)
+{
+    const std::uint64_t levels = row_level * LEVELS + col_level;
+    return levels << 32 | std::uint64_t(pos.row >> row_level) << 16 | std::uint64_t(pos.col >> col_level);
+}
+
+template <typename Func>
+void DependencyIndex::Split(int first, int last, Func func)
+{
+    const int level = GetLevel(first, last);
+    if (level == 0 || last - first + 1 > 1 << (level - 1))
+    {
+        func(first, last);
+        return;
+    }
+    // Части примыкают к середине отрезка, и каждая занимает больше половины
+    // своего, меньшего отрезка.
+    const int middle = last >> (level - 1) << (level - 1);
+    func(first, middle - 1);
+    func(middle, last);
+}
+
+template <typename Func>
+void DependencyIndex::ForEachPart(Range range, Func func)
+{
+    Split(range.from.row, range.to.row, [&](int first_row, int last_row)
+          {
+              const int row_level = GetLevel(first_row, last_row);
+              Split(range.from.col, range.to.col, [&](int first_col, int last_col)
+                    { func(Range{{first_row, first_col}, {last_row, last_col}}, row_level, GetLevel(first_col, last_col)); }); });
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Индекс ссылок формул: по позиции ячейки находит формулы, которые на неё
+// ссылаются, не раскрывая диапазоны в отдельные ячейки. Диапазон любого
+// размера занимает не больше четырёх записей, а ячейкам, на которые только
+// ссылаются, не нужно существовать в таблице.
+//
+// Каждая ось делится на вложенные выровненные отрезки длины 2^level. Часть
+// диапазона хранится в области наименьших отрезков, содержащих её по обеим
+// осям. Диапазон, занимающий не больше половины своего отрезка, делится по
+// его середине на две части (по каждой оси), поэтому любая часть занимает
+// больше половины своей области. Запрос просматривает по одной области на
+// каждой паре уровней, где есть записи.
+class DependencyIndex
+{
+public:
+    explicit DependencyIndex(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+    // Формула в позиции watcher ссылается на ячейки range (корректной
+    // области). Одна и та же ссылка может быть добавлена несколько раз.
+    void Add(Range range, Position watcher);
+
+    // Удаляет одну ссылку, добавленную Add с теми же аргументами.
+    void Remove(Range range, Position watcher);
+
+    // Вызывает func(watcher) для каждой ссылки, содержащей pos. Формула,
+    // несколько ссылок которой содержат pos, встречается несколько раз.
+    // func не должна менять индекс.
+    template <typename Func>
+    void ForEachWatcher(Position pos, Func func) const;
+
+    // Число хранимых частей ссылок.
+    std::size_t GetSize() const;
+
+private:
+    // 2^(LEVELS - 1) == Position::MAX_ROWS == Position::MAX_COLS
+    static const int LEVELS = 15;
+
+    struct Entry
+    {
+        Range range;
+        Position watcher;
+    };
+
+    // Уровень наименьшего выровненного отрезка, содержащего [first, last].
+    static int GetLevel(int first, int last);
+
+    static std::uint64_t GetKey(int row_level, int col_level, Position pos);
+
+    // Вызывает func(first, last) для одной или двух частей отрезка.
+    template <typename Func>
+    static void Split(int first, int last, Func func);
+
+    template <typename Func>
+    void ForEachPart(Range range, Func func);
+
+    std::pmr::unordered_map<std::uint64_t, std::pmr::vector<Entry>> areas_;
+    // Число частей на каждой паре уровней и пары, где они есть.
+    std::array<std::array<std::size_t, LEVELS>, LEVELS> level_sizes_{};
+    std::vector<std::pair<int, int>> occupied_levels_;
+    std::size_t size_ = 0;
+};
+
+template <typename Func>
+void DependencyIndex::ForEachWatcher(Position pos, Func func) const
+{
+    for (const auto &[row_level, col_level] : occupied_levels_)
+    {
+        auto it = areas_.find(GetKey(row_level, col_level, pos));
+        if (it == areas_.end())
+        {
+            continue;
+        }
+        for (const auto &entry : it->second)
+        {
+            if (entry.range.from.row <= pos.row && pos.row <= entry.range.to.row
+                && entry.range.from.col <= pos.col && pos.col <= entry.range.to.col)
+            {
+                func(entry.watcher);
+            }
+        }
+    }
+}
@@ -11,8 +11,7 @@ using namespace std::literals;
 
 std::ostream &operator<<(std::ostream &output, FormulaError fe)
 {
-    std::string str = std::string{fe.ToString()};
-    return output << str;
+    return output << fe.ToString();
 }
 
 FormulaError::Category FormulaError::GetCategory() const
@@ -27,21 +26,18 @@ bool FormulaError::operator==(FormulaError rhs) const
 
 std::string_view FormulaError::ToString() const
 {
-    using namespace std::string_literals;
-    std::string result;
     if (category_ == FormulaError::Category::Ref)
     {
-        result = "#REF!"s;
+        return "#REF!"sv;
     }
     else if (category_ == FormulaError::Category::Value)
     {
-        result = "#VALUE!"s;
+        return "#VALUE!"sv;
     }
     else
     {
-        result = "#DIV/0!"s;
+        return "#DIV/0!"sv;
     }
-    return result;
 }
 
 namespace
@@ -49,30 +45,33 @@ namespace
     class Formula : public FormulaInterface
     {
     public:
-        explicit Formula(std::string expression)
-            : ast_(ParseFormulaAST(expression))
+        explicit Formula(std::string expression, std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+            : ast_(std::allocate_shared<FormulaAST>(std::pmr::polymorphic_allocator<FormulaAST>(resource),
+                                                    ParseFormulaAST(expression, resource))),
+              anchor_{0, 0}
+        {
+        }
+
+        Formula(const std::string &expression, Position anchor, FormulaShapeCache &shapes)
+            : ast_(shapes.Parse(expression, anchor)), anchor_(anchor)
+        {
+        }
+
+        Formula(std::shared_ptr<const FormulaAST> shape, Position anchor)
+            : ast_(std::move(shape)), anchor_(anchor)
         {
         }
 
         Value Evaluate(const SheetInterface &sheet) const override
         {
-            auto lambda = [&sheet](Position pos)
-            {
-                auto cell = sheet.GetCell(pos);
-                CellInterface::Value value;
-                if (cell == nullptr)
-                {
-                    value = 0.0;
-                }
-                else
-                {
-                    value = cell->GetValue();
-                }
-                return value;
-            };
+            return Evaluate(sheet, nullptr);
+        }
+
+        Value Evaluate(const SheetInterface &sheet, SharedValue *const *shared) const override
+        {
             try
             {
-                return ast_.Execute(lambda);
+                return ast_->Execute(sheet, anchor_, shared);
             }
             catch (const FormulaError &e)
             {
@@ -84,32 +83,52 @@ namespace
         GetExpression() const override
         {
             std::ostringstream str;
-            ast_.PrintFormula(str);
+            ast_->PrintFormula(str, anchor_);
             return str.str();
         }
 
         std::vector<Position> GetReferencedCells() const override
         {
-            const auto &cells = ast_.GetCells();
-            std::vector<Position> result;
-            std::set<Position> unique_cells;
-            for (const auto &cell : cells)
+            std::vector<Position> cells;
+            cells.reserve(ast_->GetCells().size());
+            for (const auto &offset : ast_->GetCells())
             {
-                if (unique_cells.count(cell))
-                {
-                    continue;
-                }
-                else
+                cells.push_back({anchor_.row + offset.row, anchor_.col + offset.col});
+            }
+            if (ast_->GetRanges().empty())
+            {
+                return cells;
+            }
+            // каждая ячейка диапазонов — отдельная ссылка
+            for (const auto &offset : ast_->GetRanges())
+            {
+                for (int row = anchor_.row + offset.from.row; row <= anchor_.row + offset.to.row; ++row)
                 {
-                    unique_cells.insert(cell);
-                    result.push_back(cell);
+                    for (int col = anchor_.col + offset.from.col; col <= anchor_.col + offset.to.col; ++col)
+                    {
+                        cells.push_back({row, col});
+                    }
                 }
             }
-            return result;
+            std::sort(cells.begin(), cells.end());
+            cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+            return cells;
+        }
+
+        const std::shared_ptr<const FormulaAST> &GetShape() const override
+        {
+            return ast_;
+        }
+
+        Position GetAnchor() const override
+        {
+            return anchor_;
         }
 
     private:
-        FormulaAST ast_;
+        // разделяется всеми формулами той же формы
+        std::shared_ptr<const FormulaAST> ast_;
+        Position anchor_;
     };
 } // namespace
 
@@ -117,4 +136,20 @@ std::unique_ptr<FormulaInterface>
 ParseFormula(std::string expression)
 {
     return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+}
+
+PoolPtr<FormulaInterface> ParseFormula(std::string expression, std::pmr::memory_resource *resource)
+{
+    return MakePooled<Formula>(resource, std::move(expression), resource);
+}
+PoolPtr<FormulaInterface> ParseFormula(std::string expression, Position anchor, FormulaShapeCache &shapes,
+                                       std::pmr::memory_resource *resource)
+{
+    return MakePooled<Formula>(resource, expression, anchor, shapes);
+}
+
+PoolPtr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> shape, Position anchor,
+                                      std::pmr::memory_resource *resource)
+{
+    return MakePooled<Formula>(resource, std::move(shape), anchor);
+}
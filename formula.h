@@ -1,14 +1,25 @@
 #pragma once
 
+#include "arena.h"
 #include "common.h"
 
 #include <memory>
+#include <memory_resource>
 #include <vector>
 
+class FormulaAST;
+class FormulaShapeCache;
+class SharedValue;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, MIN, MAX, AVERAGE, COUNT и PRODUCT от чисел и
+// диапазонов ячеек: SUM(A1:B100,C1*2). Пустые ячейки диапазона пропускаются,
+// остальные читаются так же, как отдельные ссылки. COUNT считает значения,
+// MIN, MAX и PRODUCT без значений равны нулю, AVERAGE без значений — деление
+// на ноль.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -25,6 +36,11 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface &sheet) const = 0;
 
+    // То же, но значения подвыражений, общих с другими формулами таблицы,
+    // берутся из shared и сохраняются в него (см.
+    // FormulaAST::GetSubexpressions).
+    virtual Value Evaluate(const SheetInterface &sheet, SharedValue *const *shared) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
@@ -33,8 +49,27 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Скомпилированная программа формулы (общая для формул одной формы) и
+    // ячейка, относительно которой записаны её ссылки.
+    virtual const std::shared_ptr<const FormulaAST> &GetShape() const = 0;
+
+    virtual Position GetAnchor() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// То же, но объект формулы и её дерево размещаются в resource.
+PoolPtr<FormulaInterface> ParseFormula(std::string expression, std::pmr::memory_resource *resource);
+
+// То же, но для формулы, записанной в ячейке anchor: ссылки хранятся
+// относительно anchor, и формулы одной формы (например, =A1*B1 в C1 и
+// =A2*B2 в C2) разделяют одну скомпилированную программу из shapes.
+PoolPtr<FormulaInterface> ParseFormula(std::string expression, Position anchor, FormulaShapeCache &shapes,
+                                       std::pmr::memory_resource *resource);
+
+// Создаёт формулу из уже скомпилированной программы без разбора текста.
+PoolPtr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> shape, Position anchor,
+                                      std::pmr::memory_resource *resource);
@@ -0,0 +1,195 @@
+#include "sheet.h"
+
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <memory_resource>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace
+{
+    static const std::size_t NO_SHAPE = static_cast<std::size_t>(-1);
+
+    // Меньшие куски входа не делятся между потоками.
+    static const std::size_t MIN_CHUNK_SIZE = 64 * 1024;
+
+    // Непустое поле входа: текст ячейки или номер разобранной формулы.
+    struct ImportedField
+    {
+        Position pos;
+        std::string_view text;
+        std::size_t shape = NO_SHAPE;
+    };
+
+    // Часть входа из целых строк, которую разбирает один поток. Формулы
+    // разбираются в память куска и попадают в пул таблицы уже в основном
+    // потоке, через FormulaShapeCache.
+    struct ImportChunk
+    {
+        std::string_view data;
+        int first_row = 0;
+        int rows = 0;
+        std::pmr::monotonic_buffer_resource resource;
+        std::vector<FormulaAST> shapes;
+        std::vector<ImportedField> fields;
+        std::exception_ptr error;
+    };
+
+    template <typename Func>
+    void RunInParallel(std::size_t count, Func func)
+    {
+        std::vector<std::thread> workers;
+        for (std::size_t i = 1; i < count; ++i)
+        {
+            workers.emplace_back(func, i);
+        }
+        func(0);
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    int CountRows(std::string_view data)
+    {
+        int rows = static_cast<int>(std::count(data.begin(), data.end(), '\n'));
+        if (!data.empty() && data.back() != '\n')
+        {
+            ++rows;
+        }
+        return rows;
+    }
+
+    void ParseChunk(ImportChunk &chunk, char delimiter)
+    {
+        try
+        {
+            int row = chunk.first_row;
+            std::string_view rest = chunk.data;
+            while (!rest.empty())
+            {
+                std::size_t line_end = rest.find('\n');
+                std::string_view line = rest.substr(0, line_end);
+                rest.remove_prefix(line_end == std::string_view::npos ? rest.size() : line_end + 1);
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.remove_suffix(1);
+                }
+                for (int col = 0;; ++col)
+                {
+                    std::size_t field_end = line.find(delimiter);
+                    std::string_view field = line.substr(0, field_end);
+                    if (!field.empty())
+                    {
+                        Position pos{row, col};
+                        if (!pos.IsValid())
+                        {
+                            throw InvalidPositionException("Invalid Position Exception"s);
+                        }
+                        ImportedField imported{pos, field};
+                        if (field.size() > 1 && field[0] == '=')
+                        {
+                            imported.shape = chunk.shapes.size();
+                            chunk.shapes.push_back(
+                                ParseFormulaAST(field.substr(1), &chunk.resource).Rebase(pos, &chunk.resource));
+                        }
+                        chunk.fields.push_back(imported);
+                    }
+                    if (field_end == std::string_view::npos)
+                    {
+                        break;
+                    }
+                    line.remove_prefix(field_end + 1);
+                }
+                ++row;
+            }
+        }
+        catch (...)
+        {
+            chunk.error = std::current_exception();
+        }
+    }
+} // namespace
+
+void Sheet::Import(std::string_view data, char delimiter, unsigned threads)
+{
+    CheckWritable();
+
+    // Куски входа кончаются на границах строк.
+    const std::size_t chunk_count = std::clamp<std::size_t>(data.size() / MIN_CHUNK_SIZE, 1, std::max(threads, 1u));
+    std::vector<ImportChunk> chunks(chunk_count);
+    std::size_t begin = 0;
+    for (std::size_t i = 0; i < chunk_count; ++i)
+    {
+        std::size_t end = std::max(begin, data.size() / chunk_count * (i + 1));
+        if (i + 1 == chunk_count)
+        {
+            end = data.size();
+        }
+        else if (end > 0 && data[end - 1] != '\n')
+        {
+            std::size_t line_end = data.find('\n', end);
+            end = line_end == std::string_view::npos ? data.size() : line_end + 1;
+        }
+        chunks[i].data = data.substr(begin, end - begin);
+        begin = end;
+    }
+
+    RunInParallel(chunk_count, [&chunks](std::size_t i)
+                  { chunks[i].rows = CountRows(chunks[i].data); });
+    for (std::size_t i = 1; i < chunk_count; ++i)
+    {
+        chunks[i].first_row = chunks[i - 1].first_row + chunks[i - 1].rows;
+    }
+    RunInParallel(chunk_count, [&chunks, delimiter](std::size_t i)
+                  { ParseChunk(chunks[i], delimiter); });
+    for (const auto &chunk : chunks)
+    {
+        if (chunk.error)
+        {
+            std::rethrow_exception(chunk.error);
+        }
+    }
+
+    // Ячейки в новых позициях сразу создаются в хранилище, для занятых
+    // позиций новое содержимое готовится во временных ячейках.
+    std::deque<Cell> staged_cells;
+    std::unordered_map<Position, Cell *, Cell::PositionHasher> staged;
+    std::vector<Position> edited;
+    std::vector<Position> created;
+    for (auto &chunk : chunks)
+    {
+        for (const auto &field : chunk.fields)
+        {
+            Cell *cell = cells_.Get(field.pos);
+            if (cell == nullptr)
+            {
+                cell = cells_.Emplace(field.pos, *this, &pool_);
+                created.push_back(field.pos);
+            }
+            else
+            {
+                cell = &staged_cells.emplace_back(*this, &pool_);
+            }
+            if (field.shape == NO_SHAPE)
+            {
+                cell->Set(std::string(field.text), field.pos);
+            }
+            else
+            {
+                cell->SetFormula(MakeFormula(formula_shapes_.Intern(chunk.shapes[field.shape]), field.pos, &pool_));
+            }
+            staged.emplace(field.pos, cell);
+            edited.push_back(field.pos);
+        }
+        chunk.shapes.clear();
+        chunk.resource.release();
+    }
+
+    ApplyEdits(staged, edited, std::move(created), true);
+}
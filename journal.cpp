@@ -0,0 +1,447 @@
+#include "journal.h"
+
+#include "sheet.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <sstream>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define JOURNAL_USE_FSYNC
+#endif
+
+using namespace std::literals;
+
+namespace
+{
+    struct RecordHeader
+    {
+        std::uint32_t size;
+        std::uint32_t checksum;
+    };
+
+    struct EditHeader
+    {
+        std::uint32_t kind;
+        std::int32_t row;
+        std::int32_t col;
+        std::uint32_t text_size;
+    };
+
+    static const std::size_t FILE_HEADER_SIZE = sizeof(JOURNAL_MAGIC) + 2 * sizeof(std::uint32_t);
+    // JOURNAL_BYTE_ORDER, записанный машиной с другим порядком байт
+    static const std::uint32_t SWAPPED_BYTE_ORDER = 0x04030201;
+    static const std::size_t RECORD_PREFIX_SIZE = sizeof(std::uint64_t) + sizeof(std::uint32_t);
+
+    template <typename Record>
+    void AppendRecord(std::string &output, const Record &record)
+    {
+        output.append(reinterpret_cast<const char *>(&record), sizeof(record));
+    }
+
+    template <typename Record>
+    Record ReadRecord(std::string_view data, std::size_t offset)
+    {
+        Record record;
+        std::memcpy(&record, data.data() + offset, sizeof(record));
+        return record;
+    }
+
+    // FNV-1a
+    std::uint32_t Checksum(std::string_view data)
+    {
+        std::uint32_t hash = 2166136261u;
+        for (char c : data)
+        {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return hash;
+    }
+
+    std::string MakeFileHeader()
+    {
+        std::string header(std::begin(JOURNAL_MAGIC), std::end(JOURNAL_MAGIC));
+        AppendRecord(header, JOURNAL_BYTE_ORDER);
+        AppendRecord(header, JOURNAL_VERSION);
+        return header;
+    }
+
+    void CheckFileHeader(std::string_view data)
+    {
+        if (data.size() < FILE_HEADER_SIZE || !std::equal(std::begin(JOURNAL_MAGIC), std::end(JOURNAL_MAGIC), data.begin()))
+        {
+            throw JournalException("Not a sheet journal"s);
+        }
+        const auto byte_order = ReadRecord<std::uint32_t>(data, sizeof(JOURNAL_MAGIC));
+        if (byte_order == SWAPPED_BYTE_ORDER)
+        {
+            throw JournalException("Journal was written with a different byte order"s);
+        }
+        if (byte_order != JOURNAL_BYTE_ORDER
+            || ReadRecord<std::uint32_t>(data, sizeof(JOURNAL_MAGIC) + sizeof(std::uint32_t)) != JOURNAL_VERSION)
+        {
+            throw JournalException("Unsupported journal version"s);
+        }
+    }
+
+    // Разбирает записи журнала data (без заголовка файла) и вызывает
+    // func(sequence, edits, record) для каждой целой записи. Возвращает
+    // длину целой части: за ней — недописанный или повреждённый хвост.
+    template <typename Func>
+    std::size_t ScanRecords(std::string_view data, Func func)
+    {
+        std::vector<JournalEdit> edits;
+        std::size_t offset = 0;
+        while (data.size() - offset >= sizeof(RecordHeader))
+        {
+            const auto header = ReadRecord<RecordHeader>(data, offset);
+            if (header.size < RECORD_PREFIX_SIZE || header.size > data.size() - offset - sizeof(RecordHeader))
+            {
+                break;
+            }
+            const std::string_view payload = data.substr(offset + sizeof(RecordHeader), header.size);
+            if (Checksum(payload) != header.checksum)
+            {
+                break;
+            }
+            const auto sequence = ReadRecord<std::uint64_t>(payload, 0);
+            const auto count = ReadRecord<std::uint32_t>(payload, sizeof(sequence));
+            edits.clear();
+            std::size_t position = RECORD_PREFIX_SIZE;
+            bool valid = true;
+            for (std::uint32_t i = 0; valid && i < count; ++i)
+            {
+                if (payload.size() - position < sizeof(EditHeader))
+                {
+                    valid = false;
+                    break;
+                }
+                const auto edit = ReadRecord<EditHeader>(payload, position);
+                position += sizeof(EditHeader);
+                if (edit.kind > JournalEdit::CLEAR || edit.text_size > payload.size() - position)
+                {
+                    valid = false;
+                    break;
+                }
+                edits.push_back({static_cast<JournalEdit::Kind>(edit.kind), Position{edit.row, edit.col},
+                                 payload.substr(position, edit.text_size)});
+                position += edit.text_size;
+            }
+            if (!valid || position != payload.size())
+            {
+                break;
+            }
+            const std::size_t record_size = sizeof(RecordHeader) + header.size;
+            func(sequence, edits, data.substr(offset, record_size));
+            offset += record_size;
+        }
+        return offset;
+    }
+
+    void SyncFile(std::FILE *file, const std::string &path)
+    {
+        if (std::fflush(file) != 0)
+        {
+            throw JournalException("Cannot write "s + path);
+        }
+#ifdef JOURNAL_USE_FSYNC
+        if (fsync(fileno(file)) != 0)
+        {
+            throw JournalException("Cannot sync "s + path);
+        }
+#endif
+    }
+} // namespace
+
+Journal::Journal(std::string path, std::size_t group_size)
+    : path_(std::move(path)), group_size_(std::max<std::size_t>(group_size, 1))
+{
+    std::error_code error;
+    const auto size = std::filesystem::file_size(path_, error);
+    if (error || size == 0)
+    {
+        WriteFileAtomically(path_, MakeFileHeader());
+    }
+    else
+    {
+        // Хвост, который не успел записаться целиком, отрезается, чтобы
+        // новые записи шли сразу за последней целой.
+        std::size_t valid_size;
+        {
+            MappedFile file(path_);
+            const std::string_view data = file.GetData();
+            CheckFileHeader(data);
+            valid_size = FILE_HEADER_SIZE + ScanRecords(data.substr(FILE_HEADER_SIZE), [](auto &&...) {});
+        }
+        if (valid_size != size)
+        {
+            std::filesystem::resize_file(path_, valid_size);
+        }
+    }
+    OpenForAppend();
+}
+
+Journal::~Journal()
+{
+    if (compaction_.joinable())
+    {
+        compaction_.join();
+    }
+    try
+    {
+        Flush();
+    }
+    catch (const JournalException &)
+    {
+    }
+    if (file_ != nullptr)
+    {
+        std::fclose(file_);
+    }
+}
+
+void Journal::BeginRecord(std::uint64_t sequence)
+{
+    record_.clear();
+    record_edits_ = 0;
+    AppendRecord(record_, RecordHeader{});
+    AppendRecord(record_, sequence);
+    AppendRecord(record_, record_edits_);
+}
+
+void Journal::AddSet(Position pos, std::string_view text)
+{
+    AppendRecord(record_, EditHeader{JournalEdit::SET, pos.row, pos.col, static_cast<std::uint32_t>(text.size())});
+    record_.append(text);
+    ++record_edits_;
+}
+
+void Journal::AddClear(Position pos)
+{
+    AppendRecord(record_, EditHeader{JournalEdit::CLEAR, pos.row, pos.col, 0});
+    ++record_edits_;
+}
+
+void Journal::EndRecord()
+{
+    std::memcpy(record_.data() + sizeof(RecordHeader) + sizeof(std::uint64_t), &record_edits_, sizeof(record_edits_));
+    RecordHeader header;
+    header.size = static_cast<std::uint32_t>(record_.size() - sizeof(RecordHeader));
+    header.checksum = Checksum(std::string_view(record_).substr(sizeof(RecordHeader)));
+    std::memcpy(record_.data(), &header, sizeof(header));
+
+    std::lock_guard guard(mutex_);
+    pending_ += record_;
+    if (++pending_records_ >= group_size_)
+    {
+        FlushLocked();
+    }
+}
+
+void Journal::Flush()
+{
+    std::lock_guard guard(mutex_);
+    FlushLocked();
+}
+
+void Journal::FlushLocked()
+{
+    if (pending_records_ == 0)
+    {
+        return;
+    }
+    if (file_ == nullptr)
+    {
+        throw JournalException("Cannot write "s + path_);
+    }
+    if (std::fwrite(pending_.data(), 1, pending_.size(), file_) != pending_.size())
+    {
+        throw JournalException("Cannot write "s + path_);
+    }
+    SyncFile(file_, path_);
+    pending_.clear();
+    pending_records_ = 0;
+}
+
+void Journal::OpenForAppend()
+{
+    file_ = std::fopen(path_.c_str(), "ab");
+    if (file_ == nullptr)
+    {
+        throw JournalException("Cannot open "s + path_);
+    }
+}
+
+void Journal::Compact(std::string snapshot_path, std::string snapshot, std::uint64_t sequence)
+{
+    WaitForCompaction();
+    compaction_ = std::thread([this, snapshot_path = std::move(snapshot_path), snapshot = std::move(snapshot), sequence]()
+                              {
+        try
+        {
+            // Снимок пишется без блокировки: запись в журнал не ждёт его.
+            // Журнал сокращается только после того, как снимок на диске.
+            WriteFileAtomically(snapshot_path, snapshot);
+
+            std::lock_guard guard(mutex_);
+            FlushLocked();
+            std::string rest = MakeFileHeader();
+            {
+                MappedFile file(path_);
+                const std::string_view data = file.GetData();
+                CheckFileHeader(data);
+                ScanRecords(data.substr(FILE_HEADER_SIZE),
+                            [&rest, sequence](std::uint64_t record_sequence, const auto &, std::string_view record)
+                            {
+                                if (record_sequence > sequence)
+                                {
+                                    rest += record;
+                                } });
+            }
+            std::fclose(file_);
+            file_ = nullptr;
+            WriteFileAtomically(path_, rest);
+            OpenForAppend();
+        }
+        catch (...)
+        {
+            compaction_error_ = std::current_exception();
+        } });
+}
+
+void Journal::WaitForCompaction()
+{
+    if (compaction_.joinable())
+    {
+        compaction_.join();
+    }
+    if (compaction_error_)
+    {
+        std::rethrow_exception(std::exchange(compaction_error_, nullptr));
+    }
+}
+
+void Journal::Replay(const std::string &path,
+                     const std::function<void(std::uint64_t, const std::vector<JournalEdit> &)> &func)
+{
+    std::error_code error;
+    if (std::filesystem::file_size(path, error) == 0 || error)
+    {
+        return;
+    }
+    MappedFile file(path);
+    const std::string_view data = file.GetData();
+    CheckFileHeader(data);
+    ScanRecords(data.substr(FILE_HEADER_SIZE), [&func](std::uint64_t sequence, const auto &edits, std::string_view)
+                { func(sequence, edits); });
+}
+
+void Sheet::SetJournal(Journal *journal)
+{
+    journal_ = journal;
+}
+
+void Sheet::LogEdit(const std::vector<Position> &positions, bool clear)
+{
+    ++journal_sequence_;
+    if (journal_ == nullptr)
+    {
+        return;
+    }
+    journal_->BeginRecord(journal_sequence_);
+    for (const auto &pos : positions)
+    {
+        if (clear)
+        {
+            journal_->AddClear(pos);
+        }
+        else
+        {
+            journal_->AddSet(pos, cells_.Get(pos)->GetText());
+        }
+    }
+    journal_->EndRecord();
+}
+
+void Sheet::Compact(const std::string &snapshot_path)
+{
+    std::ostringstream snapshot;
+    Save(snapshot);
+    if (journal_ != nullptr)
+    {
+        journal_->Compact(snapshot_path, snapshot.str(), journal_sequence_);
+    }
+    else
+    {
+        WriteFileAtomically(snapshot_path, snapshot.str());
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::Recover(const std::string &snapshot_path, const std::string &journal_path)
+{
+    auto sheet = std::filesystem::exists(snapshot_path) ? LoadFile(snapshot_path) : std::make_unique<Sheet>();
+    std::vector<std::pair<Position, std::string>> cells;
+    Journal::Replay(journal_path, [&sheet, &cells](std::uint64_t sequence, const std::vector<JournalEdit> &edits)
+                    {
+        if (sequence <= sheet->journal_sequence_)
+        {
+            return;
+        }
+        for (const auto &edit : edits)
+        {
+            if (edit.kind == JournalEdit::SET)
+            {
+                cells.emplace_back(edit.pos, std::string(edit.text));
+                continue;
+            }
+            if (!cells.empty())
+            {
+                sheet->SetCells(std::move(cells));
+                cells.clear();
+            }
+            sheet->ClearCell(edit.pos);
+        }
+        if (!cells.empty())
+        {
+            sheet->SetCells(std::move(cells));
+            cells.clear();
+        }
+        sheet->journal_sequence_ = sequence; });
+    return sheet;
+}
+
+void WriteFileAtomically(const std::string &path, std::string_view data)
+{
+    const std::string temporary = path + ".tmp"s;
+    std::FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+    {
+        throw JournalException("Cannot open "s + temporary);
+    }
+    const bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    try
+    {
+        if (!written)
+        {
+            throw JournalException("Cannot write "s + temporary);
+        }
+        SyncFile(file, temporary);
+    }
+    catch (...)
+    {
+        std::fclose(file);
+        throw;
+    }
+    std::fclose(file);
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+    {
+        throw JournalException("Cannot replace "s + path);
+    }
+}
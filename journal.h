@@ -0,0 +1,121 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Журнал изменений таблицы (write-ahead log): файл, в конец которого
+// дописываются записи об успешных изменениях (Sheet::SetJournal). Запись —
+// одна правка таблицы целиком (SetCell, SetCells, ClearCell, Import) со своим
+// порядковым номером, поэтому после сбоя пакет правок либо восстанавливается
+// полностью, либо не восстанавливается вовсе.
+//
+// Формат: заголовок JOURNAL_MAGIC, метка порядка байт JOURNAL_BYTE_ORDER
+// (uint32) и версия (uint32), затем записи
+//
+//   uint32 размер данных, uint32 контрольная сумма данных,
+//   данные: uint64 номер, uint32 число правок, правки:
+//     uint32 вид (JournalEdit::Kind), int32 строка, int32 столбец,
+//     uint32 длина текста, текст
+//
+// в порядке байт записавшей журнал машины; журнал с другим порядком байт
+// не читается. Недописанный хвост после сбоя отбрасывается при чтении.
+
+static const char JOURNAL_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'W', 'A', 'L'};
+static const std::uint32_t JOURNAL_VERSION = 2;
+// Записывается в заголовок в порядке байт машины.
+static const std::uint32_t JOURNAL_BYTE_ORDER = 0x01020304;
+
+struct JournalEdit
+{
+    enum Kind : std::uint32_t
+    {
+        SET,
+        CLEAR,
+    };
+
+    Kind kind;
+    Position pos;
+    // текст ячейки для SET; указывает в буфер, из которого читается журнал
+    std::string_view text;
+};
+
+// Исключение, выбрасываемое при ошибке ввода-вывода журнала или при
+// чтении файла, который не является журналом
+class JournalException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class Journal
+{
+public:
+    // Открывает журнал в path для дозаписи, создавая его при необходимости и
+    // отбрасывая недописанный хвост. Записи накапливаются и пишутся на диск
+    // (с fsync) группами по group_size — групповая фиксация.
+    explicit Journal(std::string path, std::size_t group_size = 64);
+
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    // Дожидается сжатия и сбрасывает накопленные записи.
+    ~Journal();
+
+    // Запись собирается из правок между BeginRecord и EndRecord.
+    void BeginRecord(std::uint64_t sequence);
+    void AddSet(Position pos, std::string_view text);
+    void AddClear(Position pos);
+    void EndRecord();
+
+    // Пишет накопленные записи на диск и дожидается fsync.
+    void Flush();
+
+    // В фоновом потоке атомарно заменяет файл snapshot_path данными
+    // snapshot — снимком таблицы, в который вошли записи с номерами до
+    // sequence включительно, — и затем удаляет эти записи из журнала.
+    // Запись в журнал во время сжатия продолжается.
+    void Compact(std::string snapshot_path, std::string snapshot, std::uint64_t sequence);
+
+    // Дожидается окончания сжатия; бросает исключение, если оно не удалось.
+    void WaitForCompaction();
+
+    // Вызывает func(sequence, edits) для каждой целой записи журнала в path
+    // по порядку. Отсутствующий файл считается пустым журналом.
+    static void Replay(const std::string &path,
+                       const std::function<void(std::uint64_t, const std::vector<JournalEdit> &)> &func);
+
+private:
+    void FlushLocked();
+
+    void OpenForAppend();
+
+    std::string path_;
+    std::size_t group_size_;
+    std::FILE *file_ = nullptr;
+
+    // собираемая запись и записи, ещё не отданные на диск
+    std::string record_;
+    std::uint32_t record_edits_ = 0;
+    std::string pending_;
+    std::size_t pending_records_ = 0;
+
+    // защищает file_ и pending_ от фонового сжатия
+    std::mutex mutex_;
+    std::thread compaction_;
+    std::exception_ptr compaction_error_;
+};
+
+// Записывает data в файл path так, что после сбоя в нём оказывается либо
+// прежнее, либо новое содержимое целиком.
+void WriteFileAtomically(const std::string &path, std::string_view data);
@@ -1,10 +1,25 @@
 #include "common.h"
 #include "FormulaAST.h"
 #include "cell.h"
+#include "dependencies.h"
+#include "journal.h"
 #include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <numeric>
+#include <set>
 #include <string>
 #include <string_view>
 
@@ -18,6 +33,11 @@ inline Position operator"" _pos(const char *str, std::size_t)
     return Position::FromString(str);
 }
 
+inline std::ostream &operator<<(std::ostream &output, Range range)
+{
+    return output << range.from << ":" << range.to;
+}
+
 inline std::ostream &operator<<(std::ostream &output, Size size)
 {
     return output << "(" << size.rows << ", " << size.cols << ")";
@@ -88,7 +108,8 @@ namespace
 
     void TestCells()
     {
-        auto &sheet = dynamic_cast<Sheet &>(*CreateSheet());
+        auto sheet_holder = CreateSheet();
+        auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
 
         auto simple_text = CreateCell(sheet, "simple_text");
         ASSERT_EQUAL(simple_text->GetText(), "simple_text");
@@ -496,10 +517,2200 @@ namespace
         }
     }
 
-} // namespace
+    void TestStorageBlocks()
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{63, 63}, "a");
+        sheet->SetCell(Position{64, 64}, "b");
+        sheet->SetCell(Position{0, 64}, "=1+1");
+        sheet->SetCell(Position{1000, 1000}, "far");
+        ASSERT_EQUAL(sheet->GetCell(Position{63, 63})->GetText(), "a");
+        ASSERT_EQUAL(sheet->GetCell(Position{64, 64})->GetText(), "b");
+        ASSERT_EQUAL(sheet->GetCell(Position{1000, 1000})->GetText(), "far");
+        ASSERT(sheet->GetCell(Position{64, 63}) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1001, 1001}));
+
+        sheet->ClearCell(Position{1000, 1000});
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{65, 65}));
+        sheet->ClearCell(Position{64, 64});
+        ASSERT(sheet->GetCell(Position{64, 64}) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{64, 65}));
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        std::string expected = std::string(64, '\t') + "2\t\n";
+        for (int i = 1; i < 63; ++i)
+        {
+            expected += std::string(65, '\t') + "\n";
+        }
+        expected += std::string(63, '\t') + "a\t\n";
+        ASSERT_EQUAL(values.str(), expected);
+
+        auto corner = CreateSheet();
+        corner->SetCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "last");
+        ASSERT_EQUAL(corner->GetCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1})->GetText(), "last");
+        ASSERT(corner->GetCell(Position{Position::MAX_ROWS - 2, Position::MAX_COLS - 1}) == nullptr);
+        ASSERT_EQUAL(corner->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    }
+
+    class CountingResource : public std::pmr::memory_resource
+    {
+    public:
+        int outstanding = 0;
+        int total = 0;
+
+    private:
+        void *do_allocate(std::size_t bytes, std::size_t alignment) override
+        {
+            ++outstanding;
+            ++total;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+        {
+            --outstanding;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    void TestPoolAllocation()
+    {
+        auto sheet = CreateSheet();
+        CountingResource resource;
+        {
+            Cell cell(dynamic_cast<Sheet &>(*sheet), &resource);
+            cell.Set("=(A1+B2)*C3-4");
+            ASSERT(resource.total >= 2);
+            ASSERT_EQUAL(cell.GetText(), "=(A1+B2)*C3-4");
+            cell.Set("some long text that does not fit into the small buffer");
+            ASSERT_EQUAL(std::get<std::string>(cell.GetValue()), "some long text that does not fit into the small buffer");
+        }
+        ASSERT_EQUAL(resource.outstanding, 0);
+    }
+
+    void TestFormulaProgram()
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "3");
+        sheet->SetCell("B1"_pos, "4");
+
+        auto check = [&sheet](std::string expression, std::string printed, double value)
+        {
+            auto formula = ParseFormula(expression);
+            ASSERT_EQUAL(formula->GetExpression(), printed);
+            ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), value);
+        };
+        check("(1+2)*3", "(1+2)*3", 9);
+        check("1+(2*3)", "1+2*3", 7);
+        check("(1-2)-3", "1-2-3", -4);
+        check("1-(2-3)", "1-(2-3)", 2);
+        check("-(A1*B1)", "-A1*B1", -12);
+        check("+(A1-B1)/2", "+(A1-B1)/2", -0.5);
+        check("-(-(-A1))", "---A1", -3);
+        check("2.5*(2+3.5/7)", "2.5*(2+3.5/7)", 6.25);
+
+        ASSERT_EQUAL(ParseFormula("B1+A1+B1*A1")->GetReferencedCells(), (std::vector<Position>{"A1"_pos, "B1"_pos}));
+
+        // deeper than the interpreter's local stack
+        std::string deep = "1";
+        for (int i = 0; i < 100; ++i)
+        {
+            deep = "A1-(" + deep + ")";
+        }
+        ASSERT_EQUAL(std::get<double>(ParseFormula(deep)->Evaluate(*sheet)), 1);
+    }
+
+    void TestRecalculation()
+    {
+        {
+            // лестница ромбов: без отметки посещённых ячеек инвалидация
+            // экспоненциальна по числу уровней
+            auto sheet = CreateSheet();
+            sheet->SetCell("A1"_pos, "1");
+            for (int row = 1; row < 40; ++row)
+            {
+                sheet->SetCell(Position{row, 1}, "=" + Position{row - 1, 0}.ToString());
+                sheet->SetCell(Position{row, 2}, "=" + Position{row - 1, 0}.ToString());
+                sheet->SetCell(Position{row, 0}, "=" + Position{row, 1}.ToString() + "+" + Position{row, 2}.ToString() + "-" + Position{row - 1, 0}.ToString());
+            }
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{39, 0})->GetValue()), 1);
+            sheet->SetCell("A1"_pos, "2");
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{39, 0})->GetValue()), 2);
+            sheet->SetCell("A1"_pos, "3");
+            dynamic_cast<Sheet &>(*sheet).Recalculate();
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{39, 0})->GetValue()), 3);
+        }
+        {
+            // длинная цепочка вычисляется без глубокой рекурсии
+            auto sheet = CreateSheet();
+            const int length = 16000;
+            for (int row = length - 1; row > 0; --row)
+            {
+                sheet->SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+            }
+            sheet->SetCell("A1"_pos, "1");
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{length - 1, 0})->GetValue()), length);
+            sheet->SetCell("A1"_pos, "2");
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{length - 1, 0})->GetValue()), length + 1);
+        }
+        {
+            auto sheet = CreateSheet();
+            sheet->SetCell("A1"_pos, "=1");
+            sheet->SetCell("A2"_pos, "=2");
+            sheet->SetCell("A3"_pos, "=A1/A2");
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()), 0.5);
+            sheet->ClearCell("A2"_pos);
+            ASSERT(sheet->GetCell("A2"_pos) == nullptr);
+            ASSERT(std::get<FormulaError>(sheet->GetCell("A3"_pos)->GetValue()).GetCategory() == FormulaError::Category::Div0);
+            sheet->SetCell("A2"_pos, "4");
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()), 0.25);
+        }
+        {
+            // старая ссылка A1 -> B1 не должна давать ложный цикл
+            auto sheet = CreateSheet();
+            sheet->SetCell("A1"_pos, "=B1");
+            sheet->SetCell("A1"_pos, "=1");
+            sheet->SetCell("B1"_pos, "=A1");
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 1);
+        }
+        {
+            // ячейки, на которые только ссылаются, не печатаются
+            auto sheet = CreateSheet();
+            sheet->SetCell("A1"_pos, "=B1");
+            sheet->SetCell("C1"_pos, "x");
+            std::ostringstream texts;
+            sheet->PrintTexts(texts);
+            ASSERT_EQUAL(texts.str(), "=B1\t\tx\n");
+            ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+            sheet->ClearCell("C1"_pos);
+            ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+        }
+    }
+
+    void TestParallelRecalculation()
+    {
+        const int rows = 30;
+        const int cols = 300;
+        auto fill = [&](SheetInterface &sheet, int seed)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                sheet.SetCell(Position{0, col}, std::to_string((col * seed) % 17));
+            }
+            for (int row = 1; row < rows; ++row)
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    Position left{row - 1, col};
+                    Position right{row - 1, (col + 1) % cols};
+                    sheet.SetCell(Position{row, col}, "=" + left.ToString() + "/2+" + right.ToString() + "/3");
+                }
+            }
+        };
+
+        auto expected = CreateSheet();
+        auto actual = CreateSheet();
+        for (int seed : {3, 5})
+        {
+            fill(*expected, seed);
+            fill(*actual, seed);
+            dynamic_cast<Sheet &>(*actual).Recalculate(4);
+            std::ostringstream expected_values;
+            std::ostringstream actual_values;
+            expected->PrintValues(expected_values);
+            actual->PrintValues(actual_values);
+            ASSERT_EQUAL(actual_values.str(), expected_values.str());
+        }
+
+        actual->SetCell("A1"_pos, "text");
+        expected->SetCell("A1"_pos, "text");
+        dynamic_cast<Sheet &>(*actual).Recalculate(3);
+        ASSERT(std::get<FormulaError>(actual->GetCell(Position{rows - 1, 0})->GetValue()).GetCategory() == FormulaError::Category::Value);
+        ASSERT(std::holds_alternative<double>(actual->GetCell(Position{rows - 1, cols / 2})->GetValue()));
+    }
+
+    void TestParserConformance()
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1.5");
+        sheet->SetCell("Z9"_pos, "-4");
+        sheet->SetCell("E1"_pos, "text");
+
+        auto describe = [&sheet](auto parse, const std::string &text) -> std::string
+        {
+            try
+            {
+                FormulaAST ast = parse(text);
+                std::ostringstream out;
+                ast.PrintFormula(out);
+                out << " | ";
+                ast.Print(out);
+                out << " | ";
+                ast.PrintCells(out);
+                out << " | ";
+                try
+                {
+                    out << ast.Execute(*sheet);
+                }
+                catch (const FormulaError &error)
+                {
+                    out << error;
+                }
+                return out.str();
+            }
+            catch (const FormulaException &)
+            {
+                return "FormulaException";
+            }
+        };
+        auto check = [&describe](const std::string &text)
+        {
+            auto expected = describe([](const std::string &in)
+                                     { return ParseFormulaASTWithAntlr(in); },
+                                     text);
+            auto actual = describe([](const std::string &in)
+                                   { return ParseFormulaAST(in); },
+                                   text);
+            ASSERT_EQUAL("\"" + text + "\": " + actual, "\"" + text + "\": " + expected);
+        };
+
+        for (const char *text : {"1", "A1", "A01", "XFD16384", "XFD16385", "AAAA1", "A0", "1+2*3", "(1+2)*3", "-A1*-Z9",
+                                 "2--3", "+-+-1", " 1 +\t2\n", "1.5e3", ".5", "1.", "1.e5", "1e", "1E+", "1e-400", "1e400",
+                                 "1/0", "E1+1", "a1", "A", "()", "(1", "1)", "1 2", "A1B2", "", "*1", "1+", "--", "1..2", "0.5.5",
+                                 "SUM(A1:Z9)", "SUM(Z9:A1,2)", "-MAX(A1, -Z9:A1)*2", "SUM(MIN(A1:A2),B1:B2,MAX(C1:C3))",
+                                 "AVERAGE(E1:E1)", "COUNT(A1:A3,E1)", "PRODUCT(A1:A1,4)", "AVERAGE(Q1:Q3)", "SUM1", "SUM",
+                                 "SUM()", "SUM(A1:)", "SUM(A1:B2+1)", "SUM(-A1:B2)", "SUM((A1:B2))", "A1:B2", "SUMX(1)",
+                                 "SUMSUM(1)", "SUM(1,)", "SUM(,1)", "SUM 1", "sum(1)", "MAX(A1:XFD16385)"})
+        {
+            check(text);
+        }
+
+        const std::string alphabet = "A1Z9E.e+-*/()  ";
+        unsigned seed = 17;
+        for (int i = 0; i < 20000; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            std::string text;
+            for (unsigned length = 1 + (seed >> 16) % 12; length > 0; --length)
+            {
+                seed = seed * 1103515245 + 12345;
+                text += alphabet[(seed >> 16) % alphabet.size()];
+            }
+            check(text);
+        }
+
+        // вызовы функций из случайных лексем
+        const char *tokens[] = {"SUM(", "MIN(", "AVERAGE(", "A1", "Z9", ":", ",", ")", "(", "1", "-", "*"};
+        for (int i = 0; i < 20000; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            std::string text;
+            for (unsigned length = 1 + (seed >> 16) % 10; length > 0; --length)
+            {
+                seed = seed * 1103515245 + 12345;
+                text += tokens[(seed >> 16) % std::size(tokens)];
+            }
+            check(text);
+        }
+    }
+
+    void TestSharedFormulas()
+    {
+        auto sheet_holder = CreateSheet();
+        auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+        const int rows = 1000;
+        for (int row = 0; row < rows; ++row)
+        {
+            sheet.SetCell(Position{row, 0}, std::to_string(row));
+            sheet.SetCell(Position{row, 1}, "2");
+            sheet.SetCell(Position{row, 2}, "=" + Position{row, 0}.ToString() + "*" + Position{row, 1}.ToString() + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetFormulaShapes().GetSize(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetText(), "=A500*B500+1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C500"_pos)->GetValue()), 999);
+        ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetReferencedCells(), (std::vector<Position>{"A500"_pos, "B500"_pos}));
+
+        // та же запись в другой ячейке — другая форма
+        sheet.SetCell("D1"_pos, "=A1*B1+1");
+        sheet.SetCell("D2"_pos, "=A2*B2+2");
+        ASSERT_EQUAL(sheet.GetFormulaShapes().GetSize(), 3u);
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 11);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 11);
+
+        for (int row = 0; row < rows; ++row)
+        {
+            sheet.ClearCell(Position{row, 2});
+        }
+        ASSERT_EQUAL(sheet.GetFormulaShapes().GetSize(), 2u);
+    }
+
+    void TestBatchSetCells()
+    {
+        auto sheet_holder = CreateSheet();
+        auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+
+        // ячейки пакета могут ссылаться друг на друга в любом порядке
+        sheet.SetCells({{"C1"_pos, "=B1+A2"}, {"A2"_pos, "=A1*10"}, {"A3"_pos, "=C1"}, {"A3"_pos, "=C1*2"}});
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 24);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 3}));
+
+        auto texts = [&sheet]
+        {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        const std::string before = texts();
+
+        // ошибка в любой правке откатывает весь пакет
+        try
+        {
+            sheet.SetCells({{"A1"_pos, "5"}, {"D1"_pos, "=A3"}, {"A1"_pos, "=D1"}});
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException &)
+        {
+        }
+        try
+        {
+            sheet.SetCells({{"A1"_pos, "5"}, {"D1"_pos, "=1+"}});
+            ASSERT(false);
+        }
+        catch (const FormulaException &)
+        {
+        }
+        try
+        {
+            sheet.SetCells({{"A1"_pos, "5"}, {Position{-1, 0}, "1"}});
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException &)
+        {
+        }
+        ASSERT_EQUAL(texts(), before);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 24);
+
+        // цикл, разорванный в том же пакете, допустим
+        sheet.SetCells({{"A1"_pos, "=B1"}, {"B1"_pos, "2"}});
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 44);
+    }
+
+    void TestTopologicalOrder()
+    {
+        auto sheet_holder = CreateSheet();
+        auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+        const int size = 6;
+        // формулы модели: ячейка -> ячейки, на которые она ссылается
+        std::map<Position, std::vector<Position>> model;
+        auto has_cycle = [&model]
+        {
+            std::map<Position, int> state;
+            std::function<bool(Position)> visit = [&](Position pos)
+            {
+                if (state[pos] == 1)
+                {
+                    return true;
+                }
+                if (state[pos] == 2 || !model.count(pos))
+                {
+                    return false;
+                }
+                state[pos] = 1;
+                for (auto ref : model[pos])
+                {
+                    if (visit(ref))
+                    {
+                        return true;
+                    }
+                }
+                state[pos] = 2;
+                return false;
+            };
+            for (const auto &[pos, refs] : model)
+            {
+                if (visit(pos))
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        unsigned seed = 7;
+        auto random = [&seed](int bound)
+        {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        for (int step = 0; step < 3000; ++step)
+        {
+            std::vector<std::pair<Position, std::string>> edits;
+            auto saved = model;
+            for (int edit = 1 + random(2); edit > 0; --edit)
+            {
+                Position pos{random(size), random(size)};
+                std::string text = "=1";
+                model.erase(pos);
+                for (int ref = random(3); ref > 0; --ref)
+                {
+                    Position referenced{random(size), random(size)};
+                    text += "+" + referenced.ToString();
+                    model[pos].push_back(referenced);
+                }
+                edits.emplace_back(pos, text);
+            }
+            bool expected_cycle = has_cycle();
+            bool cycle = false;
+            try
+            {
+                sheet.SetCells(edits);
+            }
+            catch (const CircularDependencyException &)
+            {
+                cycle = true;
+                model = saved;
+            }
+            ASSERT_EQUAL(cycle, expected_cycle);
+
+            // каждая ячейка стоит в порядке после ячеек, на которые ссылается
+            for (const auto &[pos, refs] : model)
+            {
+                const auto *cell = dynamic_cast<const Cell *>(sheet.GetCell(pos));
+                for (auto ref : refs)
+                {
+                    const auto *referenced = dynamic_cast<const Cell *>(sheet.GetCell(ref));
+                    ASSERT(referenced == nullptr || referenced->GetOrder() < cell->GetOrder());
+                }
+            }
+        }
+    }
+
+    void TestStreamingPrint()
+    {
+        auto sheet = CreateSheet();
+        const std::vector<std::string> numbers = {"1/3", "1e20", "123456789", "0.0001", "1e-5", "-2.5", "1e300*1e300", "0-0", "100000", "1000000"};
+        const std::string long_text(20000, 'x');
+        sheet->SetCell(Position{0, 2}, long_text);
+        sheet->SetCell(Position{1, 1}, "=1/0");
+        std::string expected;
+        for (size_t i = 0; i < numbers.size(); ++i)
+        {
+            Position pos{static_cast<int>(i), 0};
+            sheet->SetCell(pos, "=" + numbers[i]);
+            std::ostringstream row;
+            row << std::get<double>(sheet->GetCell(pos)->GetValue()) << '\t';
+            row << (i == 1 ? "#DIV/0!" : "") << '\t';
+            row << (i == 0 ? long_text : "");
+            expected += row.str() + (i + 1 == numbers.size() ? "\n" : "\t\n");
+        }
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        ASSERT_EQUAL(values.str(), expected);
+
+        // строка шире буфера вывода
+        auto wide = CreateSheet();
+        wide->SetCell(Position{0, Position::MAX_COLS - 1}, "=1/4");
+        std::ostringstream wide_values;
+        wide->PrintValues(wide_values);
+        ASSERT_EQUAL(wide_values.str(), std::string(Position::MAX_COLS - 1, '\t') + "0.25\n");
+    }
+
+    void TestSnapshot()
+    {
+        auto sheet_holder = CreateSheet();
+        auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "'=text");
+        sheet.SetCell("A3"_pos, "");
+        sheet.SetCell("B1"_pos, "=A1*10");
+        sheet.SetCell("B2"_pos, "=A2*10");
+        sheet.SetCell("B3"_pos, "=A3*10+Z100");
+        sheet.SetCell("C1"_pos, "=B1/B3");
+        sheet.SetCell("C2"_pos, "=(1.5+B1)/-4");
+        auto texts = [](const SheetInterface &sheet)
+        {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        auto values = [](const SheetInterface &sheet)
+        {
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            return out.str();
+        };
+        const std::string expected_values = values(sheet);
+
+        for (bool with_values : {true, false})
+        {
+            std::ostringstream snapshot;
+            sheet.Save(snapshot, with_values);
+            auto loaded = Sheet::Load(snapshot.str());
+            ASSERT_EQUAL(loaded->GetFormulaShapes().GetSize(), sheet.GetFormulaShapes().GetSize());
+            ASSERT_EQUAL(dynamic_cast<const Cell *>(loaded->GetCell("B2"_pos))->IsCached(), with_values);
+            ASSERT_EQUAL(texts(*loaded), texts(sheet));
+            ASSERT_EQUAL(values(*loaded), expected_values);
+            ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+
+            // связи восстановлены: правки пересчитывают зависимые ячейки и
+            // находят циклы
+            loaded->SetCell("Z100"_pos, "4");
+            ASSERT_EQUAL(std::get<double>(loaded->GetCell("C1"_pos)->GetValue()), 5);
+            try
+            {
+                loaded->SetCell("A1"_pos, "=C1");
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+        }
+
+        std::ostringstream snapshot;
+        sheet.Save(snapshot);
+        const std::string data = snapshot.str();
+        for (std::size_t size : {std::size_t{0}, std::size_t{10}, data.size() - 1})
+        {
+            try
+            {
+                Sheet::Load(std::string_view(data).substr(0, size));
+                ASSERT(false);
+            }
+            catch (const SnapshotException &)
+            {
+            }
+        }
+        {
+            // снимок машины с другим порядком байт не загружается
+            std::string swapped = data;
+            std::reverse(swapped.begin() + offsetof(SnapshotHeader, byte_order),
+                         swapped.begin() + offsetof(SnapshotHeader, byte_order) + sizeof(std::uint32_t));
+            try
+            {
+                Sheet::Load(swapped);
+                ASSERT(false);
+            }
+            catch (const SnapshotException &error)
+            {
+                ASSERT(std::string_view(error.what()).find("byte order") != std::string_view::npos);
+            }
+        }
+        for (std::size_t byte = 0; byte < data.size(); ++byte)
+        {
+            // любое повреждение либо обнаруживается, либо даёт корректную таблицу
+            std::string damaged = data;
+            damaged[byte] ^= 0x5a;
+            try
+            {
+                auto loaded = Sheet::Load(damaged);
+                values(*loaded);
+            }
+            catch (const SnapshotException &)
+            {
+            }
+        }
+
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin").string();
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << data;
+        }
+        auto from_file = Sheet::LoadFile(path);
+        std::filesystem::remove(path);
+        ASSERT_EQUAL(values(*from_file), expected_values);
+    }
+
+    void TestImport()
+    {
+        auto texts = [](const SheetInterface &sheet)
+        {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        auto values = [](const SheetInterface &sheet)
+        {
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        // формулы ссылаются и вверх, и вниз по таблице
+        auto source = CreateSheet();
+        const int rows = 3000;
+        for (int row = rows - 1; row >= 0; --row)
+        {
+            source->SetCell(Position{row, 0}, std::to_string(row % 7));
+            source->SetCell(Position{row, 1}, "'=escaped " + std::to_string(row));
+            source->SetCell(Position{row, 3}, std::string(64, 'a' + row % 26));
+            if (row + 1 < rows)
+            {
+                source->SetCell(Position{row, 2}, "=" + Position{row + 1, 2}.ToString() + "+" + Position{row, 0}.ToString());
+            }
+            if (row > 0)
+            {
+                source->SetCell(Position{row, 4}, "=" + Position{row - 1, 4}.ToString() + "/2+" + Position{row, 2}.ToString());
+            }
+        }
+        source->SetCell(Position{rows - 1, 2}, "1");
+        const std::string data = texts(*source);
+        ASSERT(data.size() > 4 * 64 * 1024);
+
+        for (unsigned threads : {1u, 4u})
+        {
+            auto sheet_holder = CreateSheet();
+            auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+            sheet.Import(data, '\t', threads);
+            ASSERT_EQUAL(texts(sheet), data);
+            ASSERT_EQUAL(values(sheet), values(*source));
+            sheet.SetCell(Position{rows - 1, 2}, "2");
+            source->SetCell(Position{rows - 1, 2}, "2");
+            ASSERT_EQUAL(values(sheet), values(*source));
+            source->SetCell(Position{rows - 1, 2}, "1");
+        }
+
+        auto sheet_holder = CreateSheet();
+        auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+        sheet.Import("1,=A1+1\r\n,,x\r\n", ',');
+        ASSERT_EQUAL(texts(sheet), "1\t=A1+1\t\t\n\t\tx\n");
+
+        // импорт поверх таблицы: ошибка оставляет её прежней
+        const std::string before = texts(sheet);
+        for (const char *bad : {"=C1\t\t=A1\n", "1\t=1+\n", "=B1\t=A1\n"})
+        {
+            try
+            {
+                sheet.Import(bad);
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+            catch (const FormulaException &)
+            {
+            }
+            ASSERT_EQUAL(texts(sheet), before);
+        }
+        sheet.Import("5\n=B1*2");
+        ASSERT_EQUAL(texts(sheet), "5\t=A1+1\t\t\n=B1*2\t\tx\n");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 12);
+    }
+
+    void TestJournal()
+    {
+        auto texts = [](const SheetInterface &sheet)
+        {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        const auto directory = std::filesystem::temp_directory_path();
+        const std::string snapshot_path = (directory / "spreadsheet_journal_test.bin").string();
+        const std::string journal_path = (directory / "spreadsheet_journal_test.wal").string();
+        std::filesystem::remove(snapshot_path);
+        std::filesystem::remove(journal_path);
+
+        Sheet sheet;
+        std::string expected;
+        {
+            Journal journal(journal_path, 3);
+            sheet.SetJournal(&journal);
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCells({{"B1"_pos, "=A1+1"}, {"C1"_pos, "=B1*2"}, {"A2"_pos, "text"}});
+            try
+            {
+                sheet.SetCell("A1"_pos, "=C1");
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+            sheet.ClearCell("A2"_pos);
+            sheet.ClearCell("D4"_pos);
+            sheet.Import("\t\t\t=A1+B1+C1\n");
+            sheet.SetCell("A1"_pos, "5");
+            expected = texts(sheet);
+            sheet.SetJournal(nullptr);
+        }
+        ASSERT_EQUAL(texts(*Sheet::Recover(snapshot_path, journal_path)), expected);
+
+        // недописанная запись отбрасывается, новые пишутся после целых
+        const auto size = std::filesystem::file_size(journal_path);
+        std::filesystem::resize_file(journal_path, size - 3);
+        {
+            auto recovered = Sheet::Recover(snapshot_path, journal_path);
+            ASSERT_EQUAL(std::get<double>(recovered->GetCell("D1"_pos)->GetValue()), 7);
+            ASSERT_EQUAL(recovered->GetCell("A1"_pos)->GetText(), "1");
+
+            Journal journal(journal_path, 1);
+            ASSERT(std::filesystem::file_size(journal_path) < size - 3);
+            recovered->SetJournal(&journal);
+            recovered->SetCell("A1"_pos, "7");
+            recovered->SetJournal(nullptr);
+        }
+        ASSERT_EQUAL(Sheet::Recover(snapshot_path, journal_path)->GetCell("A1"_pos)->GetText(), "7");
+
+        // сжатие: снимок плюс записи, сделанные после него
+        {
+            auto recovered = Sheet::Recover(snapshot_path, journal_path);
+            Journal journal(journal_path, 2);
+            recovered->SetJournal(&journal);
+            for (int i = 0; i < 50; ++i)
+            {
+                recovered->SetCell(Position{i, 5}, "=A1*" + std::to_string(i));
+            }
+            recovered->Compact(snapshot_path);
+            for (int i = 0; i < 10; ++i)
+            {
+                recovered->SetCell(Position{i, 6}, std::to_string(i));
+            }
+            journal.WaitForCompaction();
+            recovered->ClearCell("F3"_pos);
+            journal.Flush();
+            const auto journal_size = std::filesystem::file_size(journal_path);
+            ASSERT(journal_size < 1024);
+            ASSERT_EQUAL(texts(*Sheet::Recover(snapshot_path, journal_path)), texts(*recovered));
+            recovered->SetJournal(nullptr);
+        }
+        {
+            // журнал машины с другим порядком байт не читается
+            std::fstream file(journal_path, std::ios::in | std::ios::out | std::ios::binary);
+            char byte_order[sizeof(std::uint32_t)];
+            file.seekg(sizeof(JOURNAL_MAGIC));
+            file.read(byte_order, sizeof(byte_order));
+            std::reverse(std::begin(byte_order), std::end(byte_order));
+            file.seekp(sizeof(JOURNAL_MAGIC));
+            file.write(byte_order, sizeof(byte_order));
+            file.close();
+            const auto size = std::filesystem::file_size(journal_path);
+            for (bool open : {false, true})
+            {
+                try
+                {
+                    if (open)
+                    {
+                        Journal journal(journal_path, 1);
+                    }
+                    else
+                    {
+                        Sheet::Recover(snapshot_path, journal_path);
+                    }
+                    ASSERT(false);
+                }
+                catch (const JournalException &error)
+                {
+                    ASSERT(std::string_view(error.what()).find("byte order") != std::string_view::npos);
+                }
+            }
+            ASSERT_EQUAL(std::filesystem::file_size(journal_path), size);
+        }
+
+        std::filesystem::remove(snapshot_path);
+        std::filesystem::remove(journal_path);
+    }
+
+    void TestMappedSheet()
+    {
+        auto texts = [](const SheetInterface &sheet)
+        {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        auto values = [](const SheetInterface &sheet)
+        {
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B2"_pos, "'=text");
+        sheet.SetCell("C3"_pos, "=1/0");
+        for (int row = 1; row < 2000; ++row)
+        {
+            sheet.SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+        }
+        sheet.SetCell("E1"_pos, "=A2000*2");
+
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_mapped_test.bin").string();
+        for (bool with_values : {false, true})
+        {
+            {
+                std::ofstream file(path, std::ios::binary);
+                sheet.Save(file, with_values);
+            }
+            auto mapped = Sheet::Map(path);
+            ASSERT_EQUAL(mapped->GetPrintableSize(), sheet.GetPrintableSize());
+            ASSERT_EQUAL(mapped->GetFormulaShapes().GetSize(), 0u);
+            ASSERT(mapped->GetCell("D4"_pos) == nullptr);
+            ASSERT_EQUAL(mapped->GetCell("B2"_pos)->GetText(), "'=text");
+            ASSERT_EQUAL(mapped->GetFormulaShapes().GetSize(), 0u);
+
+            // формулы загружаются по мере обращения, цепочка — без рекурсии
+            ASSERT_EQUAL(std::get<double>(mapped->GetCell("E1"_pos)->GetValue()), 4000);
+            ASSERT_EQUAL(std::get<FormulaError>(mapped->GetCell("C3"_pos)->GetValue()).GetCategory(),
+                         FormulaError::Category::Div0);
+            std::ostringstream mapped_window;
+            mapped->PrintValues(mapped_window, Range::FromString("A1990:E2000"));
+            std::ostringstream window;
+            sheet.PrintValues(window, Range::FromString("A1990:E2000"));
+            ASSERT_EQUAL(mapped_window.str(), window.str());
+            ASSERT_EQUAL(texts(*mapped), texts(sheet));
+            ASSERT_EQUAL(values(*mapped), values(sheet));
+
+            try
+            {
+                mapped->SetCell("A1"_pos, "2");
+                ASSERT(false);
+            }
+            catch (const ReadOnlySheetException &)
+            {
+            }
+            try
+            {
+                mapped->ClearCell("A1"_pos);
+                ASSERT(false);
+            }
+            catch (const ReadOnlySheetException &)
+            {
+            }
+
+            std::ostringstream resaved;
+            mapped->Save(resaved, with_values);
+            ASSERT_EQUAL(texts(*Sheet::Load(resaved.str())), texts(sheet));
+        }
+
+        // ссылка на ячейку не раньше себя в порядке обнаруживается при обращении
+        {
+            Sheet small;
+            small.SetCell("A1"_pos, "1");
+            small.SetCell("B1"_pos, "=A1");
+            std::ostringstream snapshot;
+            small.Save(snapshot, false);
+            std::string data = snapshot.str();
+            SnapshotCell first;
+            std::memcpy(&first, data.data() + sizeof(SnapshotHeader), sizeof(first));
+            first.order = 100;
+            std::memcpy(data.data() + sizeof(SnapshotHeader), &first, sizeof(first));
+            {
+                std::ofstream file(path, std::ios::binary);
+                file << data;
+            }
+            auto mapped = Sheet::Map(path);
+            ASSERT_EQUAL(mapped->GetCell("A1"_pos)->GetText(), "1");
+            try
+            {
+                mapped->GetCell("B1"_pos);
+                ASSERT(false);
+            }
+            catch (const SnapshotException &)
+            {
+            }
+        }
+        std::filesystem::remove(path);
+    }
+
+    void TestRangeRendering()
+    {
+        ASSERT_EQUAL(Range::FromString("B2:C10"), (Range{"B2"_pos, "C10"_pos}));
+        ASSERT_EQUAL(Range::FromString("B2").ToString(), "B2");
+        ASSERT_EQUAL(Range::FromString("A1:ZZ100").ToString(), "A1:ZZ100");
+        ASSERT(!Range::FromString("C1:B2").IsValid());
+        ASSERT(!Range::FromString("A1:").IsValid());
+
+        Sheet sheet;
+        for (int row = 0; row < 300; row += 3)
+        {
+            for (int col = 0; col < 200; col += 7)
+            {
+                sheet.SetCell(Position{row, col}, std::to_string(row * 1000 + col));
+            }
+        }
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C2"_pos, "=1/0");
+
+        // окно печатается так же, как таблица из тех же ячеек
+        auto window = [&sheet](Range range, bool values)
+        {
+            Sheet copy;
+            for (int row = range.from.row; row <= range.to.row; ++row)
+            {
+                for (int col = range.from.col; col <= range.to.col; ++col)
+                {
+                    const CellInterface *cell = sheet.GetCell(Position{row, col});
+                    if (cell != nullptr)
+                    {
+                        std::string text;
+                        if (values)
+                        {
+                            std::ostringstream out;
+                            std::visit([&out](const auto &value)
+                                       { out << value; }, cell->GetValue());
+                            text = out.str();
+                        }
+                        else
+                        {
+                            text = cell->GetText();
+                        }
+                        copy.SetCell(Position{row - range.from.row, col - range.from.col}, "'" + text);
+                    }
+                }
+            }
+            const Position corner{range.to.row - range.from.row, range.to.col - range.from.col};
+            if (copy.GetCell(corner) == nullptr)
+            {
+                copy.SetCell(corner, "'");
+            }
+            std::ostringstream out;
+            copy.PrintValues(out);
+            return out.str();
+        };
+        for (auto range : {Range::FromString("A1:D3"), Range::FromString("B2:AZ200"), Range::FromString("H4:H4"),
+                           Range::FromString("GP290:ZZ400")})
+        {
+            std::ostringstream values;
+            sheet.PrintValues(values, range);
+            ASSERT_EQUAL(values.str(), window(range, true));
+            std::ostringstream texts;
+            sheet.PrintTexts(texts, range);
+            ASSERT_EQUAL(texts.str(), window(range, false));
+        }
+        std::ostringstream whole;
+        sheet.PrintTexts(whole);
+        std::ostringstream whole_range;
+        sheet.PrintTexts(whole_range, Range{"A1"_pos, Position{sheet.GetPrintableSize().rows - 1, sheet.GetPrintableSize().cols - 1}});
+        ASSERT_EQUAL(whole_range.str(), whole.str());
+
+        std::vector<std::pair<Position, CellInterface::ValueRef>> visited;
+        sheet.ForEachValue(Range::FromString("A1:H4"), [&visited](Position pos, CellInterface::ValueRef value)
+                           { visited.emplace_back(pos, value); });
+        ASSERT_EQUAL(visited.size(), 6u);
+        ASSERT_EQUAL(visited[0].first, "A1"_pos);
+        ASSERT_EQUAL(std::get<double>(visited[1].second), 1);
+        ASSERT_EQUAL(visited[3].first, "C2"_pos);
+        ASSERT_EQUAL(std::get<FormulaError>(visited[3].second).GetCategory(), FormulaError::Category::Div0);
+        ASSERT_EQUAL(visited[5].first, "H4"_pos);
+        ASSERT_EQUAL(std::get<std::string_view>(visited[5].second), "3007");
+
+        try
+        {
+            std::ostringstream out;
+            sheet.PrintValues(out, Range{"B2"_pos, "A1"_pos});
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException &)
+        {
+        }
+    }
+
+    void TestValueRef()
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "'=escaped");
+        sheet.SetCell("A2"_pos, "12abc");
+        sheet.SetCell("A3"_pos, " 3");
+        sheet.SetCell("A4"_pos, "abc");
+        sheet.SetCell("A5"_pos, std::string(70, '0') + "5");
+        sheet.SetCell("A6"_pos, "1e999");
+        sheet.SetCell("A7"_pos, "'");
+        sheet.SetCell("B1"_pos, "=A2+A3+A5");
+        sheet.SetCell("B2"_pos, "=1/0");
+
+        ASSERT_EQUAL(std::get<std::string_view>(sheet.GetCell("A1"_pos)->GetValueRef()), "=escaped");
+        ASSERT_EQUAL(std::get<std::string_view>(sheet.GetCell("A7"_pos)->GetValueRef()), "");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValueRef()), 20);
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B2"_pos)->GetValueRef()).GetCategory(),
+                     FormulaError::Category::Div0);
+        ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A1"_pos)->GetValue()), "=escaped");
+
+        // GetNumber читает ячейки так же, как формулы
+        ASSERT_EQUAL(sheet.GetNumber("C1"_pos), 0);
+        ASSERT_EQUAL(sheet.GetNumber("A7"_pos), 0);
+        ASSERT_EQUAL(sheet.GetNumber("A2"_pos), 12);
+        ASSERT_EQUAL(sheet.GetNumber("A3"_pos), 3);
+        ASSERT_EQUAL(sheet.GetNumber("A5"_pos), 5);
+        ASSERT_EQUAL(sheet.GetNumber("B1"_pos), 20);
+        for (auto pos : {"A1"_pos, "A4"_pos, "A6"_pos, "B2"_pos})
+        {
+            try
+            {
+                sheet.GetNumber(pos);
+                ASSERT(false);
+            }
+            catch (const FormulaError &error)
+            {
+                ASSERT_EQUAL(error.GetCategory(), FormulaError::Category::Value);
+            }
+            sheet.SetCell("C2"_pos, "=" + pos.ToString());
+            ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("C2"_pos)->GetValue()).GetCategory(),
+                         FormulaError::Category::Value);
+        }
+        try
+        {
+            sheet.GetNumber(Position{-1, 0});
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException &)
+        {
+        }
+    }
+
+    void TestPrintableSizeTracking()
+    {
+        // случайные правки сравниваются с ограничивающим прямоугольником
+        unsigned seed = 17;
+        auto random = [&seed](int bound)
+        {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        Sheet sheet;
+        std::map<Position, bool> model;
+        auto expected_size = [&model]()
+        {
+            Size size;
+            for (const auto &[pos, occupied] : model)
+            {
+                size.rows = std::max(size.rows, pos.row + 1);
+                size.cols = std::max(size.cols, pos.col + 1);
+            }
+            return size;
+        };
+        for (int step = 0; step < 3000; ++step)
+        {
+            Position pos{random(40), random(30)};
+            switch (random(3))
+            {
+            case 0:
+                sheet.ClearCell(pos);
+                model.erase(pos);
+                break;
+            case 1:
+                // ссылки на пустые ячейки не расширяют печатную область
+                sheet.SetCell(pos, "=" + Position{pos.row + 50, pos.col + 50}.ToString());
+                model[pos] = true;
+                break;
+            default:
+                sheet.SetCells({{pos, "x"}, {Position{pos.col, pos.row}, "y"}});
+                model[pos] = true;
+                model[Position{pos.col, pos.row}] = true;
+                break;
+            }
+            ASSERT_EQUAL(sheet.GetPrintableSize(), expected_size());
+        }
+
+        // очистка с края большой таблицы не сканирует её
+        Sheet tall;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < Position::MAX_ROWS; ++row)
+        {
+            cells.emplace_back(Position{row, row % 3}, "1");
+        }
+        tall.SetCells(std::move(cells));
+        ASSERT_EQUAL(tall.GetPrintableSize(), (Size{Position::MAX_ROWS, 3}));
+        for (int row = Position::MAX_ROWS - 1; row > 0; --row)
+        {
+            tall.ClearCell(Position{row, row % 3});
+        }
+        ASSERT_EQUAL(tall.GetPrintableSize(), (Size{1, 1}));
+        tall.ClearCell("A1"_pos);
+        ASSERT_EQUAL(tall.GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestSparseIteration()
+    {
+        unsigned seed = 29;
+        auto random = [&seed](int bound)
+        {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        Sheet sheet;
+        std::map<Position, std::string> model;
+        for (int i = 0; i < 400; ++i)
+        {
+            Position pos{random(300), random(200)};
+            if (random(4) == 0)
+            {
+                sheet.ClearCell(pos);
+                model.erase(pos);
+                continue;
+            }
+            // ссылки создают пустые ячейки, которые обход пропускает
+            std::string text = random(2) == 0 ? std::to_string(i) : "=" + Position{random(400), random(400)}.ToString();
+            try
+            {
+                sheet.SetCell(pos, text);
+                model[pos] = sheet.GetCell(pos)->GetText();
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+        }
+
+        auto collect = [](const Sheet &sheet, CellOrder order)
+        {
+            std::vector<std::pair<Position, std::string>> cells;
+            sheet.ForEachCell(order, [&cells](Position pos, const CellInterface &cell)
+                              { cells.emplace_back(pos, cell.GetText()); });
+            return cells;
+        };
+        std::vector<std::pair<Position, std::string>> by_rows(model.begin(), model.end());
+        auto by_cols = by_rows;
+        std::stable_sort(by_cols.begin(), by_cols.end(), [](const auto &lhs, const auto &rhs)
+                         { return lhs.first.col < rhs.first.col; });
+        ASSERT(collect(sheet, CellOrder::RowMajor) == by_rows);
+        ASSERT(collect(sheet, CellOrder::ColumnMajor) == by_cols);
+
+        // область поперёк границ блоков
+        const Range range = Range::FromString("BJ60:GR130");
+        std::vector<Position> visited;
+        sheet.ForEachValue(range, [&visited](Position pos, CellInterface::ValueRef)
+                           { visited.push_back(pos); });
+        std::vector<Position> expected;
+        for (const auto &[pos, text] : model)
+        {
+            if (pos.row >= range.from.row && pos.row <= range.to.row && pos.col >= range.from.col && pos.col <= range.to.col)
+            {
+                expected.push_back(pos);
+            }
+        }
+        ASSERT(visited == expected);
+
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_sparse_test.bin").string();
+        {
+            std::ofstream file(path, std::ios::binary);
+            sheet.Save(file);
+        }
+        auto mapped = Sheet::Map(path);
+        ASSERT(collect(*mapped, CellOrder::RowMajor) == by_rows);
+        ASSERT(collect(*mapped, CellOrder::ColumnMajor) == by_cols);
+        std::filesystem::remove(path);
+
+        Sheet empty;
+        ASSERT(collect(empty, CellOrder::RowMajor).empty());
+        std::ostringstream out;
+        empty.PrintValues(out);
+        ASSERT_EQUAL(out.str(), "");
+    }
+
+    void TestAggregateFunctions()
+    {
+        Sheet sheet;
+        const int rows = 1000;
+        for (int row = 0; row < rows; ++row)
+        {
+            sheet.SetCell(Position{row, 0}, std::to_string(row + 1));
+        }
+        auto value = [&sheet](std::string_view pos)
+        {
+            return sheet.GetCell(Position::FromString(pos))->GetValue();
+        };
+        auto number = [&value](std::string_view pos)
+        {
+            return std::get<double>(value(pos));
+        };
+
+        // больше одного блока GatherNumbers
+        sheet.SetCell("B1"_pos, "=SUM(A1:A1000)");
+        sheet.SetCell("B2"_pos, "=AVERAGE(A1:A1000)");
+        sheet.SetCell("B3"_pos, "=MIN(A1:A1000)");
+        sheet.SetCell("B4"_pos, "=MAX(A1:A1000)");
+        sheet.SetCell("B5"_pos, "=COUNT(A1:A1000)");
+        sheet.SetCell("B6"_pos, "=PRODUCT(A1:A7)");
+        ASSERT_EQUAL(number("B1"), 500500);
+        ASSERT_EQUAL(number("B2"), 500.5);
+        ASSERT_EQUAL(number("B3"), 1);
+        ASSERT_EQUAL(number("B4"), 1000);
+        ASSERT_EQUAL(number("B5"), 1000);
+        ASSERT_EQUAL(number("B6"), 5040);
+
+        // значения и диапазоны вперемешку, вложенные вызовы
+        sheet.SetCell("C1"_pos, "= SUM ( A1 : A3 , 10 , A1*2 )");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(A1:A3,10,A1*2)");
+        ASSERT_EQUAL(number("C1"), 18);
+        sheet.SetCell("C2"_pos, "=-MAX(A1:A3,MIN(A2:A3)+5,SUM(A1:A2))*2");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=-MAX(A1:A3,MIN(A2:A3)+5,SUM(A1:A2))*2");
+        ASSERT_EQUAL(number("C2"), -14);
+        // концы диапазона упорядочиваются
+        sheet.SetCell("C3"_pos, "=SUM(B1:A3)");
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=SUM(A1:B3)");
+        ASSERT_EQUAL(number("C3"), 6 + 500500 + 500.5 + 1);
+        sheet.SetCell("C4"_pos, "=COUNT(A5:A5)");
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=COUNT(A5:A5)");
+        ASSERT_EQUAL(number("C4"), 1);
+
+        // пустые ячейки пропускаются, текст читается как у ссылок
+        sheet.SetCell("D2"_pos, "4");
+        sheet.SetCell("D5"_pos, " 8");
+        sheet.SetCell("E1"_pos, "=COUNT(D1:D10)");
+        sheet.SetCell("E2"_pos, "=AVERAGE(D1:D10)");
+        sheet.SetCell("E3"_pos, "=MIN(F1:F10)");
+        sheet.SetCell("E4"_pos, "=AVERAGE(F1:F10)");
+        sheet.SetCell("E5"_pos, "=PRODUCT(F1:F10)+COUNT(F1:F10)");
+        ASSERT_EQUAL(number("E1"), 2);
+        ASSERT_EQUAL(number("E2"), 6);
+        ASSERT_EQUAL(number("E3"), 0);
+        ASSERT_EQUAL(std::get<FormulaError>(value("E4")).GetCategory(), FormulaError::Category::Div0);
+        ASSERT_EQUAL(number("E5"), 0);
+
+        // изменения внутри диапазона, в том числе в пустых ячейках,
+        // пересчитывают формулу
+        sheet.SetCell("D7"_pos, "-12");
+        ASSERT_EQUAL(number("E1"), 3);
+        ASSERT_EQUAL(number("E2"), 0);
+        sheet.SetCell("F3"_pos, "7");
+        ASSERT_EQUAL(number("E3"), 7);
+        ASSERT_EQUAL(number("E4"), 7);
+        sheet.SetCell("D3"_pos, "text");
+        ASSERT_EQUAL(std::get<FormulaError>(value("E2")).GetCategory(), FormulaError::Category::Value);
+        sheet.SetCell("D3"_pos, "=1/0");
+        ASSERT_EQUAL(std::get<FormulaError>(value("E1")).GetCategory(), FormulaError::Category::Value);
+        sheet.ClearCell("D3"_pos);
+        ASSERT_EQUAL(number("E1"), 3);
+        sheet.SetCell("A500"_pos, "0");
+        ASSERT_EQUAL(number("B1"), 500000);
+        ASSERT_EQUAL(number("B3"), 0);
+        try
+        {
+            sheet.SetCell("A10"_pos, "=SUM(A1:A1000)");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException &)
+        {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetText(), "10");
+
+        for (const char *text : {"=SUM()", "=SUM(A1:)", "=SUM(A1:B2+1)", "=SUM(-A1:B2)", "=A1:B2", "=FOO(1)", "=SUM 1",
+                                 "=SUM(A1:A16385)"})
+        {
+            try
+            {
+                sheet.SetCell("G1"_pos, text);
+                ASSERT(false);
+            }
+            catch (const FormulaException &)
+            {
+            }
+        }
+
+        // скользящие суммы одной формы
+        for (int row = 0; row < 100; ++row)
+        {
+            sheet.SetCell(Position{row, 7}, "=SUM(" + Position{row, 0}.ToString() + ":" + Position{row + 9, 0}.ToString() + ")");
+        }
+        const std::size_t shapes = sheet.GetFormulaShapes().GetSize();
+        sheet.SetCell("H101"_pos, "=SUM(A101:A110)");
+        ASSERT_EQUAL(sheet.GetFormulaShapes().GetSize(), shapes);
+        ASSERT_EQUAL(number("H1"), 55);
+        ASSERT_EQUAL(number("H100"), 1045);
+        ASSERT_EQUAL(sheet.GetCell("H100"_pos)->GetText(), "=SUM(A100:A109)");
+
+        // снимок сохраняет диапазоны
+        std::ostringstream texts;
+        std::ostringstream values;
+        sheet.PrintTexts(texts);
+        sheet.PrintValues(values);
+        for (bool with_values : {true, false})
+        {
+            std::ostringstream snapshot;
+            sheet.Save(snapshot, with_values);
+            auto loaded = Sheet::Load(snapshot.str());
+            std::ostringstream loaded_texts;
+            std::ostringstream loaded_values;
+            loaded->PrintTexts(loaded_texts);
+            loaded->PrintValues(loaded_values);
+            ASSERT_EQUAL(loaded_texts.str(), texts.str());
+            ASSERT_EQUAL(loaded_values.str(), values.str());
+            loaded->SetCell("A1"_pos, "1001");
+            ASSERT_EQUAL(std::get<double>(loaded->GetCell("B1"_pos)->GetValue()), 501000);
+        }
+    }
+
+    void TestRangeDependencies()
+    {
+        unsigned seed = 11;
+        auto random = [&seed](int bound)
+        {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        auto random_range = [&random](int size)
+        {
+            Position first{random(size), random(size)};
+            Position second{random(size), random(size)};
+            return Range{{std::min(first.row, second.row), std::min(first.col, second.col)},
+                         {std::max(first.row, second.row), std::max(first.col, second.col)}};
+        };
+        auto contains = [](Range range, Position pos)
+        {
+            return range.from.row <= pos.row && pos.row <= range.to.row && range.from.col <= pos.col && pos.col <= range.to.col;
+        };
+
+        {
+            // индекс против перебора всех ссылок
+            DependencyIndex index;
+            std::vector<std::pair<Range, Position>> model;
+            for (int step = 0; step < 20000; ++step)
+            {
+                const int size = step % 2 == 0 ? 64 : Position::MAX_ROWS;
+                if (model.empty() || random(3) != 0)
+                {
+                    model.emplace_back(random_range(size), Position{random(size), random(size)});
+                    index.Add(model.back().first, model.back().second);
+                }
+                else
+                {
+                    std::swap(model[random(static_cast<int>(model.size()))], model.back());
+                    index.Remove(model.back().first, model.back().second);
+                    model.pop_back();
+                }
+                // на большом поле случайная позиция почти всегда пуста
+                const Position pos = step % 2 == 0 || model.empty() ? Position{random(size), random(size)}
+                                                                    : model[random(static_cast<int>(model.size()))].first.from;
+                std::multiset<Position> expected;
+                for (const auto &[range, watcher] : model)
+                {
+                    if (contains(range, pos))
+                    {
+                        expected.insert(watcher);
+                    }
+                }
+                std::multiset<Position> watchers;
+                index.ForEachWatcher(pos, [&watchers](Position watcher)
+                                     { watchers.insert(watcher); });
+                ASSERT(watchers == expected);
+            }
+            while (!model.empty())
+            {
+                index.Remove(model.back().first, model.back().second);
+                model.pop_back();
+            }
+            ASSERT_EQUAL(index.GetSize(), 0u);
+
+            // диапазон любого размера занимает не больше четырёх записей
+            index.Add(Range{{0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}}, Position{0, 0});
+            ASSERT_EQUAL(index.GetSize(), 1u);
+            index.Add(Range{{8191, 8191}, {8192, 8192}}, Position{0, 0});
+            ASSERT_EQUAL(index.GetSize(), 5u);
+        }
+
+        {
+            // циклы и порядок со ссылками на диапазоны
+            auto sheet_holder = CreateSheet();
+            auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+            const int size = 6;
+            std::map<Position, std::vector<Range>> model;
+            auto has_cycle = [&model, &contains]
+            {
+                std::map<Position, int> state;
+                std::function<bool(Position)> visit = [&](Position pos)
+                {
+                    if (state[pos] == 1)
+                    {
+                        return true;
+                    }
+                    if (state[pos] == 2)
+                    {
+                        return false;
+                    }
+                    state[pos] = 1;
+                    for (const auto &range : model[pos])
+                    {
+                        for (const auto &[referenced, ranges] : model)
+                        {
+                            if (contains(range, referenced) && visit(referenced))
+                            {
+                                return true;
+                            }
+                        }
+                    }
+                    state[pos] = 2;
+                    return false;
+                };
+                for (const auto &[pos, ranges] : model)
+                {
+                    if (visit(pos))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            for (int step = 0; step < 3000; ++step)
+            {
+                std::vector<std::pair<Position, std::string>> edits;
+                auto saved = model;
+                for (int edit = 1 + random(2); edit > 0; --edit)
+                {
+                    Position pos{random(size), random(size)};
+                    if (random(4) == 0)
+                    {
+                        model.erase(pos);
+                        edits.emplace_back(pos, "1");
+                        continue;
+                    }
+                    std::string text = "=1";
+                    auto &ranges = model[pos];
+                    ranges.clear();
+                    for (int ref = random(3); ref > 0; --ref)
+                    {
+                        const Range range = random_range(size);
+                        text += "+SUM(" + range.from.ToString() + ":" + range.to.ToString() + ")";
+                        ranges.push_back(range);
+                    }
+                    edits.emplace_back(pos, text);
+                }
+                const bool expected_cycle = has_cycle();
+                bool cycle = false;
+                try
+                {
+                    sheet.SetCells(edits);
+                }
+                catch (const CircularDependencyException &)
+                {
+                    cycle = true;
+                    model = saved;
+                }
+                ASSERT_EQUAL(cycle, expected_cycle);
+
+                for (const auto &[pos, ranges] : model)
+                {
+                    const auto *cell = dynamic_cast<const Cell *>(sheet.GetCell(pos));
+                    for (const auto &range : ranges)
+                    {
+                        sheet.ForEachCell(CellOrder::RowMajor, [&](Position referenced, const CellInterface &referenced_cell)
+                                          {
+                                              if (contains(range, referenced))
+                                              {
+                                                  ASSERT(dynamic_cast<const Cell &>(referenced_cell).GetOrder() < cell->GetOrder());
+                                              } });
+                    }
+                }
+            }
+        }
+
+        {
+            // правка внутри большого диапазона инвалидирует следящие формулы,
+            // а пустые ячейки диапазона не создаются
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "=SUM(B1:B16384)");
+            sheet.SetCell("C1"_pos, "=A1*2+B9000");
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 0);
+            sheet.SetCell("B9000"_pos, "5");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 15);
+            sheet.SetCell("B16384"_pos, "=B9000+1");
+            sheet.Recalculate();
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 11);
+            sheet.ClearCell("B9000"_pos);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2);
+            try
+            {
+                sheet.SetCell("B2"_pos, "=C1");
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+            ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{16384, 3}));
+        }
+    }
+
+    void TestConstantFolding()
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "3");
+        sheet->SetCell("A2"_pos, "=-0");
+        sheet->SetCell("B1"_pos, "text");
+        sheet->SetCell("B2"_pos, "=1e300*1e300");
+
+        auto executed_size = [](const std::string &text)
+        {
+            return ParseFormulaAST(text).GetExecutedProgram().size();
+        };
+        ASSERT_EQUAL(executed_size("2*3+A1*1"), 3u);
+        ASSERT_EQUAL(executed_size("--A1"), 1u);
+        ASSERT_EQUAL(executed_size("+(-(+(-A1)))"), 1u);
+        ASSERT_EQUAL(executed_size("1*A1/1-0"), 1u);
+        ASSERT_EQUAL(executed_size("SUM(1,2,3)*A1"), 3u);
+        ASSERT_EQUAL(executed_size("SUM(1,A1:A2)"), 3u);
+        ASSERT_EQUAL(executed_size("A1+0"), 3u);
+        ASSERT_EQUAL(executed_size("1/(2-2)"), 3u);
+        ASSERT_EQUAL(executed_size("A1+B1"), 3u);
+
+        // выражение печатается так, как записано
+        auto formula = ParseFormula("2*3+A1*1");
+        ASSERT_EQUAL(formula->GetExpression(), "2*3+A1*1");
+        ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 9);
+        ASSERT_EQUAL(ParseFormula("--A1+(+1)")->GetExpression(), "--A1++1");
+        ASSERT(std::get<FormulaError>(ParseFormula("A1/(1-1)")->Evaluate(*sheet)).GetCategory() == FormulaError::Category::Div0);
+        ASSERT(std::get<FormulaError>(ParseFormula("B1*1")->Evaluate(*sheet)).GetCategory() == FormulaError::Category::Value);
+        ASSERT(std::signbit(std::get<double>(ParseFormula("A2*1")->Evaluate(*sheet))));
+        ASSERT(!std::signbit(std::get<double>(ParseFormula("A2+0")->Evaluate(*sheet))));
+
+        // упрощённая программа даёт те же значения и ошибки, что и записанная
+        unsigned seed = 5;
+        auto random = [&seed](int bound)
+        {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        const std::string atoms[] = {"0", "1", "2", "0.5", "1e300", "A1", "A2", "B1", "B2", "C1", "A1:B2"};
+        std::function<std::string(int)> generate = [&](int depth) -> std::string
+        {
+            const int kind = depth == 0 ? 0 : random(6);
+            if (kind == 0)
+            {
+                std::string atom = atoms[random(static_cast<int>(std::size(atoms)) - 1)];
+                return atom;
+            }
+            if (kind == 1)
+            {
+                return std::string(random(2) == 0 ? "-" : "+") + "(" + generate(depth - 1) + ")";
+            }
+            if (kind == 2)
+            {
+                std::string call = random(2) == 0 ? "SUM(" : "PRODUCT(";
+                for (int arg = 1 + random(3); arg > 0; --arg)
+                {
+                    call += (random(4) == 0 ? atoms[std::size(atoms) - 1] : generate(depth - 1)) + (arg == 1 ? ")" : ",");
+                }
+                return call;
+            }
+            return "(" + generate(depth - 1) + ")" + "+-*/"[random(4)] + "(" + generate(depth - 1) + ")";
+        };
+        int simplified = 0;
+        for (int i = 0; i < 5000; ++i)
+        {
+            const std::string text = generate(1 + random(4));
+            const FormulaAST optimized = ParseFormulaAST(text);
+            const FormulaAST written(std::pmr::vector<ASTImpl::Instruction>(optimized.GetProgram()),
+                                     std::pmr::vector<double>(optimized.GetNumbers()),
+                                     std::pmr::vector<Position>(optimized.GetCells()),
+                                     std::pmr::vector<Range>(optimized.GetRanges()),
+                                     optimized.GetStackDepth());
+            if (optimized.GetExecutedProgram().size() < written.GetExecutedProgram().size())
+            {
+                ++simplified;
+            }
+            auto execute = [&sheet](const FormulaAST &ast) -> std::string
+            {
+                try
+                {
+                    const double value = ast.Execute(*sheet);
+                    std::uint64_t bits;
+                    std::memcpy(&bits, &value, sizeof(bits));
+                    return std::to_string(bits);
+                }
+                catch (const FormulaError &error)
+                {
+                    std::ostringstream out;
+                    out << error;
+                    return out.str();
+                }
+            };
+            ASSERT_EQUAL(execute(optimized), execute(written));
+        }
+        ASSERT(simplified > 1000);
+    }
+
+    void TestSharedSubexpressions()
+    {
+        {
+            // значение, сохранённое удалённой формулой, не переживает правку
+            // ячеек, пока остальные её пользователи не посчитаны
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("B1"_pos, "2");
+            sheet.SetCell("C1"_pos, "1");
+            sheet.SetCell("D1"_pos, "=(A1+B1)/C1+1");
+            sheet.SetCell("E1"_pos, "=(A1+B1)/C1+2");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("E1"_pos)->GetValue()), 5);
+            sheet.ClearCell("E1"_pos);
+            sheet.SetCell("A1"_pos, "10");
+            sheet.SetCell("F1"_pos, "=(A1+B1)/C1+3");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 13);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("F1"_pos)->GetValue()), 15);
+
+            // то же, когда непосчитанных пользователей остаётся несколько
+            sheet.SetCell("G1"_pos, "=(A1+B1)/C1+4");
+            sheet.SetCell("E1"_pos, "=(A1+B1)/C1+2");
+            sheet.SetCell("A1"_pos, "20");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("E1"_pos)->GetValue()), 24);
+            sheet.SetCell("E1"_pos, "0");
+            sheet.SetCell("B1"_pos, "5");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 26);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("G1"_pos)->GetValue()), 29);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("F1"_pos)->GetValue()), 28);
+        }
+
+        {
+            // значение, сохранённое одной формулой, берётся другой без вычисления
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("B1"_pos, "3");
+            sheet.SetCell("C1"_pos, "2");
+            const FormulaAST first = ParseFormulaAST("(A1+B1)/C1+1");
+            const FormulaAST second = ParseFormulaAST("10*((A1+B1)/C1)");
+            ASSERT_EQUAL(first.GetSubexpressions().size(), 1u);
+            ASSERT_EQUAL(second.GetSubexpressions().size(), 1u);
+            std::string first_key;
+            std::string second_key;
+            first.AppendSubexpressionKey(0, Position{0, 0}, first_key);
+            second.AppendSubexpressionKey(0, Position{0, 0}, second_key);
+            ASSERT_EQUAL(first_key, second_key);
+
+            SubexpressionTable table;
+            SharedValue *shared[] = {table.Acquire(first_key)};
+            ASSERT_EQUAL(first.Execute(sheet, Position{0, 0}, shared), 3);
+            double stored;
+            ASSERT(!shared[0]->TryGet(stored));
+            table.Acquire(second_key);
+            ASSERT_EQUAL(table.GetSize(), 1u);
+            ASSERT_EQUAL(first.Execute(sheet, Position{0, 0}, shared), 3);
+            ASSERT(shared[0]->TryGet(stored) && stored == 2);
+            sheet.SetCell("C1"_pos, "4");
+            ASSERT_EQUAL(second.Execute(sheet, Position{0, 0}, shared), 20);
+            shared[0]->Invalidate();
+            ASSERT_EQUAL(second.Execute(sheet, Position{0, 0}, shared), 10);
+            table.Release(shared[0]);
+            table.Release(shared[0]);
+            ASSERT_EQUAL(table.GetSize(), 0u);
+
+            // другие ячейки или другое выражение — другой ключ
+            std::string other_key;
+            ParseFormulaAST("(A1+B1)/C1+1").AppendSubexpressionKey(0, Position{1, 0}, other_key);
+            ASSERT(other_key != first_key);
+            other_key.clear();
+            ParseFormulaAST("(A1-B1)/C1+1").AppendSubexpressionKey(0, Position{0, 0}, other_key);
+            ASSERT(other_key != first_key);
+            ASSERT(ParseFormulaAST("(A1+B1)/C1").GetSubexpressions().empty());
+            ASSERT(ParseFormulaAST("A1+B1*2").GetSubexpressions().empty());
+            ASSERT_EQUAL(ParseFormulaAST("SUM(A1:A3)/SUM(B1:B3)").GetSubexpressions().size(), 2u);
+        }
+
+        {
+            // формулы таблицы с общими подвыражениями против вычисления без них
+            auto sheet_holder = CreateSheet();
+            auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+            unsigned seed = 3;
+            auto random = [&seed](int bound)
+            {
+                seed = seed * 1103515245 + 12345;
+                return static_cast<int>((seed >> 16) % bound);
+            };
+            auto check_cell = [&sheet](Position pos)
+            {
+                const auto *cell = sheet.GetCell(pos);
+                const auto expected = ParseFormula(cell->GetText().substr(1))->Evaluate(sheet);
+                const auto value = cell->GetValue();
+                if (std::holds_alternative<double>(expected))
+                {
+                    ASSERT_EQUAL(std::get<double>(value), std::get<double>(expected));
+                }
+                else
+                {
+                    ASSERT(std::get<FormulaError>(value) == std::get<FormulaError>(expected));
+                }
+            };
+            const std::string parts[] = {"(A1+B1)/C1", "SUM(A1:C3)", "(A2*B2-C2)*(A1+1)", "MAX(A1:A3,B2)*C3"};
+            for (int row = 3; row < 200; ++row)
+            {
+                for (int col = 0; col < 3; ++col)
+                {
+                    std::string text = "=" + parts[random(4)] + "+" + parts[random(4)] + "*" + std::to_string(row);
+                    if (row > 3 && random(3) == 0)
+                    {
+                        text += "+" + Position{row - 1, random(3)}.ToString();
+                    }
+                    sheet.SetCell(Position{row, col}, text);
+                }
+            }
+            for (int row = 0; row < 100; ++row)
+            {
+                sheet.SetCell(Position{row, 5}, "=(A1+B1)/C1+" + std::to_string(row));
+            }
+            const std::size_t shared_size = sheet.GetSubexpressions().GetSize();
+            for (int row = 100; row < 200; ++row)
+            {
+                sheet.SetCell(Position{row, 5}, "=(A1+B1)/C1+" + std::to_string(row));
+            }
+            ASSERT_EQUAL(sheet.GetSubexpressions().GetSize(), shared_size);
+            for (int step = 0; step < 300; ++step)
+            {
+                const Position pos{random(3), random(3)};
+                const int kind = random(5);
+                if (kind == 0)
+                {
+                    sheet.ClearCell(pos);
+                }
+                else if (kind == 1)
+                {
+                    sheet.SetCell(pos, "text");
+                }
+                else
+                {
+                    sheet.SetCell(pos, std::to_string(random(7)));
+                }
+                if (step % 3 == 0)
+                {
+                    sheet.Recalculate(step % 2 == 0 ? 4 : 1);
+                }
+                for (int check = 0; check < 20; ++check)
+                {
+                    const Position cell_pos{3 + random(197), random(3)};
+                    check_cell(cell_pos);
+                }
+            }
+            for (int row = 3; row < 200; ++row)
+            {
+                for (int col = 0; col < 3; ++col)
+                {
+                    sheet.ClearCell(Position{row, col});
+                }
+            }
+            ASSERT_EQUAL(sheet.GetSubexpressions().GetSize(), 1u);
+            for (int row = 0; row < 200; ++row)
+            {
+                check_cell(Position{row, 5});
+                sheet.ClearCell(Position{row, 5});
+            }
+            ASSERT_EQUAL(sheet.GetSubexpressions().GetSize(), 0u);
+        }
+    }
+
+    void TestColumnEvaluation()
+    {
+        unsigned seed = 17;
+        auto random = [&seed](int bound)
+        {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        const std::string contents[] = {"", "0", "3", "-2.5", "'7", "text", "=1/0", "1e308", "4", "0.1"};
+        auto random_content = [&]
+        {
+            // числа — чаще всего
+            return random(3) != 0 ? std::to_string(random(20) - 5) : contents[random(static_cast<int>(std::size(contents)))];
+        };
+        auto set_content = [](SheetInterface &sheet, Position pos, const std::string &content)
+        {
+            if (content.empty())
+            {
+                sheet.ClearCell(pos);
+            }
+            else
+            {
+                sheet.SetCell(pos, content);
+            }
+        };
+
+        {
+            // столбец против вычисления по одной строке, в том числе у краёв таблицы
+            auto sheet = CreateSheet();
+            for (int row = 0; row < 40; ++row)
+            {
+                for (int col = 0; col < 3; ++col)
+                {
+                    set_content(*sheet, Position{row, col}, random_content());
+                    set_content(*sheet, Position{Position::MAX_ROWS - 1 - row, col}, random_content());
+                }
+            }
+            for (const char *text : {"A1*B1+C1", "A1/B2-3", "-(A1-C3)*2", "A1", "1/0+A1", "+B1*(C1/A2)/4"})
+            {
+                const FormulaAST ast = ParseFormulaAST(text);
+                ASSERT(ast.CanExecuteColumn());
+                for (const Position from : {Position{0, 0}, Position{-5, 0}, Position{Position::MAX_ROWS - 30, 0},
+                                            Position{3, -1}, Position{7, Position::MAX_COLS - 1}})
+                {
+                    const std::size_t count = 300;
+                    std::vector<double> results(count);
+                    std::unique_ptr<bool[]> failed(new bool[count]);
+                    ast.ExecuteColumn(*sheet, from, count, results.data(), failed.get());
+                    for (std::size_t i = 0; i < count; ++i)
+                    {
+                        const Position anchor{from.row + static_cast<int>(i), from.col};
+                        try
+                        {
+                            const double value = ast.Execute(*sheet, anchor);
+                            ASSERT(!failed[i]);
+                            ASSERT_EQUAL(std::memcmp(&value, &results[i], sizeof(value)), 0);
+                        }
+                        catch (const FormulaError &)
+                        {
+                            ASSERT(failed[i]);
+                        }
+                    }
+                }
+            }
+            ASSERT(!ParseFormulaAST("SUM(A1:A3)*2").CanExecuteColumn());
+            ASSERT(!ParseFormulaAST("MAX(A1,B1)").CanExecuteColumn());
+        }
+
+        {
+            // пересчёт серий формул против вычисления каждой формулы заново
+            auto sheet_holder = CreateSheet();
+            auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+            static const int ROWS = 500;
+            for (int row = 0; row < ROWS; ++row)
+            {
+                const std::string r = std::to_string(row + 1);
+                for (int col = 0; col < 3; ++col)
+                {
+                    set_content(sheet, Position{row, col}, random_content());
+                }
+                sheet.SetCell(Position{row, 3}, "=A" + r + "*B" + r + "+C" + r);
+                // зависит от серии в столбце D
+                sheet.SetCell(Position{row, 4}, "=D" + r + "/B" + r);
+                // ссылается на свою же серию
+                sheet.SetCell(Position{row, 5}, row == 0 ? "=A1" : "=F" + std::to_string(row) + "+E" + r);
+                // серия в G прерывается другой формой
+                sheet.SetCell(Position{row, 6}, row % 100 == 50 ? "=H" + r + "-1" : "=-E" + r + "*2");
+                // на серию в G ссылаются формулы другой формы выше неё
+                sheet.SetCell(Position{row, 7}, row % 3 == 0 ? "=SUM(A" + r + ":C" + r + ")" : "=G" + std::to_string(row + 2) + "+A" + r);
+            }
+            auto check = [&sheet]
+            {
+                for (int row = 0; row < ROWS; ++row)
+                {
+                    for (int col = 3; col < 8; ++col)
+                    {
+                        const auto *cell = sheet.GetCell(Position{row, col});
+                        ASSERT(dynamic_cast<const Cell *>(cell)->IsCached());
+                        const auto expected = ParseFormula(cell->GetText().substr(1))->Evaluate(sheet);
+                        const auto value = cell->GetValue();
+                        if (std::holds_alternative<double>(expected))
+                        {
+                            ASSERT(std::holds_alternative<double>(value));
+                            const double actual = std::get<double>(value);
+                            ASSERT_EQUAL(std::memcmp(&actual, &std::get<double>(expected), sizeof(actual)), 0);
+                        }
+                        else
+                        {
+                            ASSERT(std::get<FormulaError>(value) == std::get<FormulaError>(expected));
+                        }
+                    }
+                }
+            };
+            for (int step = 0; step < 40; ++step)
+            {
+                sheet.Recalculate(step % 2 == 0 ? 1 : 4);
+                check();
+                for (int edit = random(4 * ROWS); edit >= 0; --edit)
+                {
+                    set_content(sheet, Position{random(ROWS), random(3)}, random_content());
+                }
+            }
+        }
+    }
+
+    void TestFillAndCopy()
+    {
+        {
+            // протягивание сдвигает ссылки и не создаёт новых форм
+            auto sheet_holder = CreateSheet();
+            auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+            for (int row = 0; row < 5; ++row)
+            {
+                sheet.SetCell(Position{row, 0}, std::to_string(row + 1));
+            }
+            sheet.SetCell("B1"_pos, "=A1*2+SUM(A1:A2)");
+            const std::size_t shapes = sheet.GetFormulaShapes().GetSize();
+            sheet.FillRange("B1"_pos, Range::FromString("B1:C4"));
+            ASSERT_EQUAL(sheet.GetFormulaShapes().GetSize(), shapes);
+            ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3*2+SUM(A3:A4)");
+            ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=B4*2+SUM(B4:B5)");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 4 * 2 + 4 + 5);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 5 * 2 + 5 + 9);
+            // копии следят за своими ячейками
+            sheet.SetCell("A4"_pos, "10");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 10 * 2 + 10 + 5);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 3 * 2 + 3 + 10);
+
+            // текст копируется как есть, пустой источник ничего не меняет
+            sheet.SetCell("E1"_pos, "'=A1");
+            sheet.FillRange("E1"_pos, Range::FromString("E2:E3"));
+            ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "'=A1");
+            sheet.FillRange("F1"_pos, Range::FromString("E1:E3"));
+            ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "'=A1");
+        }
+
+        {
+            // протягивание цепочки на весь столбец
+            auto sheet_holder = CreateSheet();
+            auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("A2"_pos, "=A1+1");
+            sheet.FillRange("A2"_pos, Range{{1, 0}, {Position::MAX_ROWS - 1, 0}});
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{Position::MAX_ROWS - 1, 0})->GetValue()),
+                         double{Position::MAX_ROWS});
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{Position::MAX_ROWS, 1}));
+            sheet.SetCell("A1"_pos, "-1");
+            sheet.Recalculate(4);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{Position::MAX_ROWS - 1, 0})->GetValue()),
+                         Position::MAX_ROWS - 2);
+        }
+
+        {
+            // пересекающиеся области копируются по прежнему содержимому
+            auto sheet_holder = CreateSheet();
+            auto &sheet = dynamic_cast<Sheet &>(*sheet_holder);
+            for (int row = 0; row < 3; ++row)
+            {
+                const std::string r = std::to_string(row + 1);
+                sheet.SetCell(Position{row, 0}, r);
+                sheet.SetCell(Position{row, 1}, "=A" + r + "*10");
+            }
+            sheet.CopyRange(Range::FromString("A1:B3"), "A2"_pos);
+            const char *texts[][2] = {{"1", "=A1*10"}, {"1", "=A2*10"}, {"2", "=A3*10"}, {"3", "=A4*10"}};
+            for (int row = 0; row < 4; ++row)
+            {
+                ASSERT_EQUAL(sheet.GetCell(Position{row, 0})->GetText(), texts[row][0]);
+                ASSERT_EQUAL(sheet.GetCell(Position{row, 1})->GetText(), texts[row][1]);
+            }
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 30);
+
+            // ошибки оставляют таблицу прежней
+            std::ostringstream before;
+            sheet.PrintTexts(before);
+            sheet.SetCell("P1"_pos, "=Q1");
+            sheet.SetCell("D1"_pos, "=C1");
+            try
+            {
+                sheet.CopyRange(Range::FromString("C1:D1"), "P1"_pos);
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+            ASSERT_EQUAL(sheet.GetCell("Q1"_pos), nullptr);
+            ASSERT_EQUAL(sheet.GetCell("P1"_pos)->GetText(), "=Q1");
+            sheet.ClearCell("P1"_pos);
+            sheet.ClearCell("D1"_pos);
+            // ссылка копии ушла бы за пределы таблицы
+            try
+            {
+                sheet.FillRange("B2"_pos, Range::FromString("A5:B5"));
+                ASSERT(false);
+            }
+            catch (const InvalidPositionException &)
+            {
+            }
+            try
+            {
+                sheet.CopyRange(Range::FromString("A1:B4"), Position{Position::MAX_ROWS - 2, 0});
+                ASSERT(false);
+            }
+            catch (const InvalidPositionException &)
+            {
+            }
+            std::ostringstream after;
+            sheet.PrintTexts(after);
+            ASSERT_EQUAL(after.str(), before.str());
+        }
+    }
+
+    // The same formula executed by the stack machine, as written.
+    FormulaAST MakeUnoptimized(const FormulaAST &ast)
+    {
+        return FormulaAST(std::pmr::vector<ASTImpl::Instruction>(ast.GetProgram()),
+                          std::pmr::vector<double>(ast.GetNumbers()),
+                          std::pmr::vector<Position>(ast.GetCells()),
+                          std::pmr::vector<Range>(ast.GetRanges()),
+                          ast.GetStackDepth());
+    }
+
+    void TestSpecializedEvaluators()
+    {
+        const std::pair<std::string, bool> shapes[] = {
+            {"A1+B1", true},
+            {"A1-B2", true},
+            {"C1*A2", true},
+            {"B1/A1", true},
+            {"A1*3", true},
+            {"A1-0.5", true},
+            {"2/A1", true},
+            {"10-B2", true},
+            {"-A1", true},
+            {"A1", true},
+            {"7", true},
+            {"+A1", true},
+            {"--B1", true},
+            {"A1*1", true},
+            {"-A1*2", false},
+            {"A1+B1+C1", false},
+            {"SUM(A1:B2)", false},
+            {"MAX(A1,B1)", false},
+            {"1/0", false},
+        };
+        auto sheet = CreateSheet();
+        unsigned seed = 11;
+        auto random = [&seed](int bound)
+        {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        auto execute = [&sheet](const FormulaAST &ast, Position anchor) -> std::string
+        {
+            try
+            {
+                const double value = ast.Execute(*sheet, anchor);
+                std::uint64_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                return std::to_string(bits);
+            }
+            catch (const FormulaError &error)
+            {
+                std::ostringstream out;
+                out << error;
+                return out.str();
+            }
+        };
+        for (const auto &[text, specialized] : shapes)
+        {
+            const FormulaAST ast = ParseFormulaAST(text);
+            ASSERT_EQUAL(ast.IsSpecialized(), specialized);
+            const FormulaAST generic = MakeUnoptimized(ast);
+            ASSERT(!generic.IsSpecialized());
+            ASSERT_EQUAL(ast.Rebase(Position{1, 1}, std::pmr::get_default_resource()).IsSpecialized(), specialized);
+        }
+        const std::string contents[] = {"", "0", "-0", "3", "-2.5", "'4", "text", "=1/0", "=D4+1", "1e308"};
+        for (int round = 0; round < 200; ++round)
+        {
+            for (int row = 0; row < 3; ++row)
+            {
+                for (int col = 0; col < 3; ++col)
+                {
+                    const auto &content = contents[random(static_cast<int>(std::size(contents)))];
+                    if (content.empty())
+                    {
+                        sheet->ClearCell(Position{row, col});
+                    }
+                    else
+                    {
+                        sheet->SetCell(Position{row, col}, content);
+                    }
+                }
+            }
+            for (const auto &[text, specialized] : shapes)
+            {
+                const FormulaAST ast = ParseFormulaAST(text);
+                const FormulaAST generic = MakeUnoptimized(ast);
+                // a negative anchor moves references off the sheet
+                for (const Position anchor : {Position{0, 0}, Position{1, 0}, Position{0, -1}})
+                {
+                    ASSERT_EQUAL(execute(ast, anchor), execute(generic, anchor));
+                }
+            }
+        }
+    }
+
+    // Compares specialized evaluators of small shapes with the stack machine
+    // running the same programs over a column of numbers.
+    void BenchmarkSmallShapes()
+    {
+        using Clock = std::chrono::steady_clock;
+        static const int ROWS = 1000;
+        static const int PASSES = 2000;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row)
+        {
+            sheet->SetCell(Position{row, 0}, std::to_string(row + 1));
+            sheet->SetCell(Position{row, 1}, std::to_string(row % 7 + 1) + ".5");
+        }
+        auto measure = [&sheet](const FormulaAST &ast, double &sum)
+        {
+            const auto start = Clock::now();
+            for (int pass = 0; pass < PASSES; ++pass)
+            {
+                for (int row = 0; row < ROWS; ++row)
+                {
+                    sum += ast.Execute(*sheet, Position{row, 0});
+                }
+            }
+            return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (PASSES * ROWS);
+        };
+        for (const char *text : {"A1+B1", "A1-B1", "A1*B1", "A1/B1", "A1*3", "2/B1", "-A1", "A1"})
+        {
+            const FormulaAST ast = ParseFormulaAST(text);
+            const FormulaAST generic = MakeUnoptimized(ast);
+            double generic_sum = 0;
+            double specialized_sum = 0;
+            const double generic_time = measure(generic, generic_sum);
+            const double specialized_time = measure(ast, specialized_sum);
+            std::cout << '=' << text << "\tgeneric " << generic_time << " ns\tspecialized " << specialized_time
+                      << " ns\tspeedup " << generic_time / specialized_time << (generic_sum == specialized_sum ? "" : "\tMISMATCH")
+                      << std::endl;
+        }
+    }
+
+    // Compares a column of =A1*B1+C1 copied down the whole sheet computed
+    // one row at a time and as one column.
+    void BenchmarkColumnEvaluation()
+    {
+        using Clock = std::chrono::steady_clock;
+        static const int ROWS = Position::MAX_ROWS;
+        static const int PASSES = 20;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row)
+        {
+            sheet->SetCell(Position{row, 0}, std::to_string(row + 1));
+            sheet->SetCell(Position{row, 1}, std::to_string(row % 7 + 1) + ".5");
+            sheet->SetCell(Position{row, 2}, std::to_string(row % 3));
+        }
+        const FormulaAST ast = ParseFormulaAST("A1*B1+C1");
+        std::vector<double> results(ROWS);
+        std::unique_ptr<bool[]> failed(new bool[ROWS]);
+
+        auto start = Clock::now();
+        for (int pass = 0; pass < PASSES; ++pass)
+        {
+            for (int row = 0; row < ROWS; ++row)
+            {
+                results[row] = ast.Execute(*sheet, Position{row, 0});
+            }
+        }
+        const double row_time = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (PASSES * ROWS);
+        const double row_sum = std::accumulate(results.begin(), results.end(), 0.0);
+
+        start = Clock::now();
+        for (int pass = 0; pass < PASSES; ++pass)
+        {
+            ast.ExecuteColumn(*sheet, Position{0, 0}, ROWS, results.data(), failed.get());
+        }
+        const double column_time = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (PASSES * ROWS);
+        const double column_sum = std::accumulate(results.begin(), results.end(), 0.0);
+
+        std::cout << "=A1*B1+C1 x " << ROWS << " rows\tby row " << row_time << " ns\tcolumn " << column_time
+                  << " ns\tspeedup " << row_time / column_time << (row_sum == column_sum ? "" : "\tMISMATCH") << std::endl;
+    }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && std::string_view(argv[1]) == "--benchmark")
+    {
+        BenchmarkSmallShapes();
+        BenchmarkColumnEvaluation();
+        return 0;
+    }
 
-int main()
-{
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -516,5 +2727,30 @@ int main()
     RUN_TEST(tr, TestExceptions);
     RUN_TEST(tr, TestCircularDependency);
     RUN_TEST(tr, TestCache);
+    RUN_TEST(tr, TestStorageBlocks);
+    RUN_TEST(tr, TestPoolAllocation);
+    RUN_TEST(tr, TestFormulaProgram);
+    RUN_TEST(tr, TestRecalculation);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestParserConformance);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestBatchSetCells);
+    RUN_TEST(tr, TestTopologicalOrder);
+    RUN_TEST(tr, TestStreamingPrint);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestImport);
+    RUN_TEST(tr, TestJournal);
+    RUN_TEST(tr, TestMappedSheet);
+    RUN_TEST(tr, TestRangeRendering);
+    RUN_TEST(tr, TestValueRef);
+    RUN_TEST(tr, TestPrintableSizeTracking);
+    RUN_TEST(tr, TestSparseIteration);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestSharedSubexpressions);
+    RUN_TEST(tr, TestSpecializedEvaluators);
+    RUN_TEST(tr, TestColumnEvaluation);
+    RUN_TEST(tr, TestFillAndCopy);
     return 0;
 }
@@ -4,59 +4,333 @@
 #include "common.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <optional>
-#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
 using namespace std::literals;
 
+namespace
+{
+    // Пишет в поток через буфер фиксированного размера: печать таблицы не
+    // собирает весь текст в памяти.
+    class BufferedWriter
+    {
+    public:
+        explicit BufferedWriter(std::ostream &output)
+            : output_(output)
+        {
+        }
+
+        void Write(char c)
+        {
+            if (size_ == BUFFER_SIZE)
+            {
+                Flush();
+            }
+            buffer_[size_++] = c;
+        }
+
+        void Write(std::string_view text)
+        {
+            if (text.size() > BUFFER_SIZE - size_)
+            {
+                Flush();
+                if (text.size() > BUFFER_SIZE)
+                {
+                    output_.write(text.data(), text.size());
+                    return;
+                }
+            }
+            std::copy(text.begin(), text.end(), buffer_.begin() + size_);
+            size_ += text.size();
+        }
+
+        void Write(char c, std::size_t count)
+        {
+            while (count > 0)
+            {
+                if (size_ == BUFFER_SIZE)
+                {
+                    Flush();
+                }
+                const std::size_t chunk = std::min(count, BUFFER_SIZE - size_);
+                std::fill_n(buffer_.begin() + size_, chunk, c);
+                size_ += chunk;
+                count -= chunk;
+            }
+        }
+
+        // Тот же вид, что у operator<< для double в потоке с настройками
+        // по умолчанию (%g, 6 значащих цифр).
+        void Write(double value)
+        {
+            char text[32];
+            auto result = std::to_chars(std::begin(text), std::end(text), value, std::chars_format::general, 6);
+            Write(std::string_view(text, result.ptr - text));
+        }
+
+        void Flush()
+        {
+            output_.write(buffer_.data(), size_);
+            size_ = 0;
+        }
+
+    private:
+        static const std::size_t BUFFER_SIZE = 8192;
+
+        std::ostream &output_;
+        std::array<char, BUFFER_SIZE> buffer_;
+        std::size_t size_ = 0;
+    };
+
+    void WriteValue(BufferedWriter &writer, const Cell &cell)
+    {
+        auto value = cell.GetValueRef();
+        if (std::holds_alternative<std::string_view>(value))
+        {
+            writer.Write(std::get<std::string_view>(value));
+        }
+        else if (std::holds_alternative<double>(value))
+        {
+            writer.Write(std::get<double>(value));
+        }
+        else
+        {
+            writer.Write(std::get<FormulaError>(value).ToString());
+        }
+    }
+
+    void WriteText(BufferedWriter &writer, const Cell &cell)
+    {
+        writer.Write(cell.GetText());
+    }
+} // namespace
+
+Sheet::Sheet()
+    : formula_shapes_(&pool_), cells_(&pool_), occupied_rows_(&pool_), occupied_cols_(&pool_),
+      dependencies_(&pool_)
+{
+}
+
 Sheet::~Sheet()
 {
 }
 
 void Sheet::SetCell(Position pos, std::string text)
 {
-    if (pos.IsValid())
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.emplace_back(pos, std::move(text));
+    SetCells(std::move(cells));
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells)
+{
+    CheckWritable();
+    for (const auto &[pos, text] : cells)
     {
-        Cell cell(*this);
-        cell.Set(text);
-        std::set<Position> visited_cells;
-        CheckCyclicalDependence(cell.GetReferenced(), pos, visited_cells);
-        std::unordered_set<Position, Cell::PositionHasher> old_referenced_cells;
-        if (GetCell(pos) == nullptr)
+        if (!pos.IsValid())
         {
-            EnlargeSheet(pos);
-            sheet_[pos.row][pos.col] = std::make_unique<Cell>(*this);
+            throw InvalidPositionException("Invalid Position Exception"s);
         }
-        else
+    }
+
+    // Все формулы разбираются во временные ячейки до изменения таблицы,
+    // поэтому ошибка в любой правке оставляет таблицу прежней.
+    std::deque<Cell> staged_cells;
+    std::unordered_map<Position, Cell *, Cell::PositionHasher> staged;
+    std::vector<Position> edited;
+    for (auto &[pos, text] : cells)
+    {
+        Cell &cell = staged_cells.emplace_back(*this, &pool_);
+        cell.Set(std::move(text), pos);
+        if (staged.insert_or_assign(pos, &cell).second)
         {
-            old_referenced_cells = sheet_.at(pos.row).at(pos.col)->GetReferenced();
-            sheet_.at(pos.row).at(pos.col)->Clear();
+            edited.push_back(pos);
         }
-        sheet_.at(pos.row).at(pos.col)->Set(text);
-        RemoveOldDependences(old_referenced_cells, pos);
-        AddNewDependences(sheet_.at(pos.row).at(pos.col)->GetReferenced(), pos);
-        ClearCache(sheet_.at(pos.row).at(pos.col)->GetCellsThatRefer());
     }
-    else
+
+    ApplyEdits(staged, edited, {}, false);
+}
+
+void Sheet::FillRange(Position src, Range dest)
+{
+    if (!src.IsValid() || !dest.IsValid())
     {
         throw InvalidPositionException("Invalid Position Exception"s);
     }
+    std::vector<std::pair<Position, Position>> copies;
+    copies.reserve(static_cast<std::size_t>(dest.to.row - dest.from.row + 1) * (dest.to.col - dest.from.col + 1));
+    for (int row = dest.from.row; row <= dest.to.row; ++row)
+    {
+        for (int col = dest.from.col; col <= dest.to.col; ++col)
+        {
+            copies.emplace_back(src, Position{row, col});
+        }
+    }
+    CopyCells(copies);
 }
 
-const CellInterface *Sheet::GetCell(Position pos) const
+void Sheet::CopyRange(Range src, Position dest)
 {
-    if (pos.IsValid())
+    const Position dest_to{dest.row + src.to.row - src.from.row, dest.col + src.to.col - src.from.col};
+    if (!src.IsValid() || !dest.IsValid() || !dest_to.IsValid())
+    {
+        throw InvalidPositionException("Invalid Position Exception"s);
+    }
+    std::vector<std::pair<Position, Position>> copies;
+    ForEachInRange(src, CellOrder::RowMajor, [&](Position pos, const Cell *)
+                   { copies.emplace_back(pos, Position{dest.row + pos.row - src.from.row, dest.col + pos.col - src.from.col}); });
+    CopyCells(copies);
+}
+
+void Sheet::CopyCells(const std::vector<std::pair<Position, Position>> &copies)
+{
+    CheckWritable();
+    // Копии готовятся во временных ячейках по прежнему содержимому таблицы,
+    // как в SetCells.
+    std::deque<Cell> staged_cells;
+    std::unordered_map<Position, Cell *, Cell::PositionHasher> staged;
+    std::vector<Position> edited;
+    for (const auto &[from, to] : copies)
+    {
+        const Cell *source = cells_.Get(from);
+        if (source == nullptr || source->IsEmpty() || from == to)
+        {
+            continue;
+        }
+        Cell &cell = staged_cells.emplace_back(*this, &pool_);
+        if (const FormulaInterface *formula = source->GetFormula())
+        {
+            const auto &shape = formula->GetShape();
+            const bool in_sheet = std::all_of(shape->GetCells().begin(), shape->GetCells().end(), [to](Position offset)
+                                              { return Position{to.row + offset.row, to.col + offset.col}.IsValid(); })
+                                  && std::all_of(shape->GetRanges().begin(), shape->GetRanges().end(), [to](Range offset)
+                                                 { return Range{{to.row + offset.from.row, to.col + offset.from.col},
+                                                                {to.row + offset.to.row, to.col + offset.to.col}}
+                                                       .IsValid(); });
+            if (!in_sheet)
+            {
+                throw InvalidPositionException("Invalid Position Exception"s);
+            }
+            cell.SetFormula(MakeFormula(shape, to, &pool_));
+        }
+        else
+        {
+            cell.Set(source->GetText(), to);
+        }
+        staged.emplace(to, &cell);
+        edited.push_back(to);
+    }
+    if (!edited.empty())
+    {
+        ApplyEdits(staged, edited, {}, false);
+    }
+}
+
+void Sheet::ApplyEdits(const std::unordered_map<Position, Cell *, Cell::PositionHasher> &staged,
+                       const std::vector<Position> &edited, std::vector<Position> created, bool rebuild_order)
+{
+    // Новые ячейки создаются до проверки: им нужно место в топологическом
+    // порядке. При ошибке они удаляются. Ячейка, не ссылающаяся ни на одну
+    // ячейку таблицы, встаёт в начало порядка, раньше формул, которые уже
+    // ссылаются на её позицию; остальные — в конец.
+    const std::size_t first_created = created.size();
+    for (const auto &pos : edited)
     {
-        if (sheet_.count(pos.row) && sheet_.at(pos.row).count(pos.col))
+        if (cells_.Get(pos) == nullptr)
         {
-            return sheet_.at(pos.row).at(pos.col).get();
+            cells_.Emplace(pos, *this, &pool_);
+            created.push_back(pos);
+        }
+    }
+    for (std::size_t i = first_created; i < created.size(); ++i)
+    {
+        bool has_precedents = false;
+        ForEachPrecedent(*staged.at(created[i]), [&has_precedents](Position, const Cell *)
+                         { has_precedents = true; });
+        cells_.Get(created[i])->SetOrder(has_precedents ? next_order_++ : --first_order_);
+    }
+    std::vector<std::pair<Cell *, std::int64_t>> old_orders;
+    try
+    {
+        if (rebuild_order)
+        {
+            RebuildOrder(staged);
         }
         else
+        {
+            CheckCyclicalDependence(edited, created, staged, old_orders);
+        }
+    }
+    catch (const CircularDependencyException &)
+    {
+        for (auto it = old_orders.rbegin(); it != old_orders.rend(); ++it)
+        {
+            it->first->SetOrder(it->second);
+        }
+        for (const auto &pos : created)
+        {
+            cells_.Erase(pos);
+        }
+        throw;
+    }
+
+    // После обмена staged хранят старое содержимое ячеек.
+    for (const auto &pos : edited)
+    {
+        Cell *target = cells_.Get(pos);
+        Cell *old = staged.at(pos);
+        if (target != old)
+        {
+            target->Swap(*old);
+        }
+        if (target == old || old->IsEmpty())
+        {
+            AddOccupied(pos);
+        }
+    }
+    for (const auto &pos : edited)
+    {
+        if (cells_.Get(pos) != staged.at(pos))
+        {
+            RemoveDependences(*staged.at(pos), pos);
+        }
+    }
+    for (const auto &pos : edited)
+    {
+        AddDependences(*cells_.Get(pos), pos);
+    }
+    for (const auto &pos : edited)
+    {
+        ClearCache(pos);
+        if (!cells_.Get(pos)->IsCached())
+        {
+            dirty_.insert(pos);
+        }
+    }
+    LogEdit(edited, false);
+}
+
+const CellInterface *Sheet::GetCell(Position pos) const
+{
+    if (pos.IsValid())
+    {
+        Cell *cell = FindCell(pos);
+        if (cell == nullptr || cell->IsEmpty())
         {
             return nullptr;
         }
+        return cell;
     }
     else
     {
@@ -68,14 +342,12 @@ CellInterface *Sheet::GetCell(Position pos)
 {
     if (pos.IsValid())
     {
-        if (sheet_.count(pos.row) && sheet_.at(pos.row).count(pos.col))
-        {
-            return sheet_.at(pos.row).at(pos.col).get();
-        }
-        else
+        Cell *cell = FindCell(pos);
+        if (cell == nullptr || cell->IsEmpty())
         {
             return nullptr;
         }
+        return cell;
     }
     else
     {
@@ -85,12 +357,17 @@ CellInterface *Sheet::GetCell(Position pos)
 
 void Sheet::ClearCell(Position pos)
 {
+    CheckWritable();
     if (pos.IsValid())
     {
-        if (sheet_.count(pos.row) && sheet_.at(pos.row).count(pos.col))
+        Cell *cell = cells_.Get(pos);
+        if (cell != nullptr && !cell->IsEmpty())
         {
-            sheet_.at(pos.row).at(pos.col) = nullptr;
-            ReduceSheet(pos);
+            RemoveDependences(*cell, pos);
+            cells_.Erase(pos);
+            ClearCache(pos);
+            RemoveOccupied(pos);
+            LogEdit({pos}, true);
         }
     }
     else
@@ -99,193 +376,813 @@ void Sheet::ClearCell(Position pos)
     }
 }
 
+double Sheet::GetNumber(Position pos) const
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid Position Exception"s);
+    }
+    const Cell *cell = FindCell(pos);
+    if (cell == nullptr || cell->IsEmpty())
+    {
+        return 0.0;
+    }
+    return cell->GetNumber();
+}
+
+void Sheet::GatherNumbers(Range range, const std::function<void(const double *numbers, std::size_t count)> &consume) const
+{
+    if (!range.IsValid())
+    {
+        throw InvalidPositionException("Invalid Position Exception"s);
+    }
+    double numbers[NUMBER_BLOCK_SIZE];
+    std::size_t count = 0;
+    ForEachInRange(range, CellOrder::RowMajor, [&](Position, const Cell *cell)
+                   {
+                       numbers[count++] = cell->GetNumber();
+                       if (count == NUMBER_BLOCK_SIZE)
+                       {
+                           consume(numbers, count);
+                           count = 0;
+                       } });
+    if (count != 0)
+    {
+        consume(numbers, count);
+    }
+}
+
+void Sheet::ReadColumn(Position from, std::size_t count, double *numbers, bool *failed) const
+{
+    if (count == 0)
+    {
+        return;
+    }
+    const Range range{from, {from.row + static_cast<int>(count) - 1, from.col}};
+    if (!range.IsValid())
+    {
+        throw InvalidPositionException("Invalid Position Exception"s);
+    }
+    std::fill(numbers, numbers + count, 0.0);
+    ForEachInRange(range, CellOrder::ColumnMajor, [&](Position pos, const Cell *cell)
+                   {
+                       const std::size_t index = pos.row - from.row;
+                       try
+                       {
+                           numbers[index] = cell->GetNumber();
+                       }
+                       catch (const FormulaError &)
+                       {
+                           failed[index] = true;
+                       } });
+}
+
+Cell *Sheet::FindCell(Position pos) const
+{
+    Cell *cell = cells_.Get(pos);
+    if (cell == nullptr && snapshot_ != nullptr)
+    {
+        // Ячейки снимка — кэш над неизменным файлом, поэтому они создаются
+        // и при чтении константной таблицы.
+        cell = const_cast<Sheet *>(this)->Materialize(pos);
+    }
+    return cell;
+}
+
+void Sheet::CheckWritable() const
+{
+    if (snapshot_ != nullptr)
+    {
+        throw ReadOnlySheetException("Sheet is read-only"s);
+    }
+}
+
 Size Sheet::GetPrintableSize() const
 {
     return printable_size_;
 }
 
-std::string Sheet::GetStringFromValue(const CellInterface::Value &value) const
+template <typename PrintCell>
+void Sheet::PrintTable(std::ostream &output, Range range, PrintCell print_cell) const
 {
-    std::ostringstream text;
-    if (std::holds_alternative<std::string>(value))
+    if (!range.IsValid())
     {
-        text << std::get<std::string>(value);
+        return;
     }
-    else if (std::holds_alternative<double>(value))
+    // Ячейки разделяются табуляцией, после каждой строки, кроме
+    // последней, табуляция стоит и перед переводом строки. Обходятся
+    // только непустые ячейки, разделители пустых пишутся сериями.
+    BufferedWriter writer(output);
+    auto separators = [&writer, range](int row, int first_col, int last_col)
     {
-        text << std::get<double>(value);
-    }
-    else
+        if (first_col > last_col)
+        {
+            return;
+        }
+        std::size_t tabs = last_col - first_col + 1;
+        if (last_col == range.to.col && row == range.to.row)
+        {
+            --tabs;
+        }
+        writer.Write('\t', tabs);
+        if (last_col == range.to.col)
+        {
+            writer.Write('\n');
+        }
+    };
+    // next — первая позиция, разделитель после которой ещё не записан
+    Position next = range.from;
+    auto skip_to = [&](Position pos)
     {
-        text << std::get<FormulaError>(value);
+        for (; next.row < pos.row; ++next.row, next.col = range.from.col)
+        {
+            separators(next.row, next.col, range.to.col);
+        }
+        separators(next.row, next.col, pos.col - 1);
+        next.col = pos.col;
+    };
+    ForEachInRange(range, CellOrder::RowMajor, [&](Position pos, const Cell *cell)
+                   {
+                       skip_to(pos);
+                       print_cell(writer, *cell);
+                       separators(pos.row, pos.col, pos.col);
+                       ++next.col; });
+    skip_to(Position{range.to.row, range.to.col + 1});
+    writer.Flush();
+}
+
+Range Sheet::GetPrintableRange() const
+{
+    if (printable_size_.cols == 0 || printable_size_.rows == 0)
+    {
+        return Range::NONE;
     }
-    return text.str();
+    return Range{Position{0, 0}, Position{printable_size_.rows - 1, printable_size_.cols - 1}};
 }
 
 void Sheet::PrintValues(std::ostream &output) const
 {
-    if (printable_size_.cols != 0 && printable_size_.rows != 0)
+    PrintTable(output, GetPrintableRange(), WriteValue);
+}
+
+void Sheet::PrintTexts(std::ostream &output) const
+{
+    PrintTable(output, GetPrintableRange(), WriteText);
+}
+
+void Sheet::PrintValues(std::ostream &output, Range range) const
+{
+    if (!range.IsValid())
+    {
+        throw InvalidPositionException("Invalid Position Exception"s);
+    }
+    PrintTable(output, range, WriteValue);
+}
+
+void Sheet::PrintTexts(std::ostream &output, Range range) const
+{
+    if (!range.IsValid())
+    {
+        throw InvalidPositionException("Invalid Position Exception"s);
+    }
+    PrintTable(output, range, WriteText);
+}
+
+void Sheet::ForEachValue(Range range, const std::function<void(Position, CellInterface::ValueRef)> &callback) const
+{
+    if (!range.IsValid())
+    {
+        throw InvalidPositionException("Invalid Position Exception"s);
+    }
+    ForEachInRange(range, CellOrder::RowMajor, [&callback](Position pos, const Cell *cell)
+                   { callback(pos, cell->GetValueRef()); });
+}
+
+void Sheet::ForEachCell(CellOrder order, const std::function<void(Position, const CellInterface &)> &callback) const
+{
+    ForEachInRange(GetPrintableRange(), order, [&callback](Position pos, const Cell *cell)
+                   { callback(pos, *cell); });
+}
+
+void Sheet::AddOccupied(Position pos)
+{
+    ++occupied_rows_[pos.row];
+    ++occupied_cols_[pos.col];
+    UpdatePrintableSize();
+}
+
+void Sheet::RemoveOccupied(Position pos)
+{
+    if (--occupied_rows_[pos.row] == 0)
+    {
+        occupied_rows_.erase(pos.row);
+    }
+    if (--occupied_cols_[pos.col] == 0)
+    {
+        occupied_cols_.erase(pos.col);
+    }
+    UpdatePrintableSize();
+}
+
+void Sheet::UpdatePrintableSize()
+{
+    printable_size_.rows = occupied_rows_.empty() ? 0 : occupied_rows_.rbegin()->first + 1;
+    printable_size_.cols = occupied_cols_.empty() ? 0 : occupied_cols_.rbegin()->first + 1;
+}
+
+void Sheet::CheckCyclicalDependence(const std::vector<Position> &edited, const std::vector<Position> &created,
+                                    const std::unordered_map<Position, Cell *, Cell::PositionHasher> &staged,
+                                    std::vector<std::pair<Cell *, std::int64_t>> &old_orders)
+{
+    // Проверка идёт по графу, в котором у изменённых ячеек старые ссылки
+    // уже удалены (порядок от этого не нарушается), а новые добавляются по
+    // одной. Ссылки формул таблицы на новые ячейки тоже добавляются по
+    // одной: до этого новая ячейка в графе ни с чем не связана. Граф
+    // таблицы при этом не меняется.
+    std::unordered_map<Position, std::vector<Position>, Cell::PositionHasher> inserted_referenced;
+    std::unordered_map<Position, std::vector<Position>, Cell::PositionHasher> inserted_dependents;
+    const std::unordered_set<Position, Cell::PositionHasher> new_cells(created.begin(), created.end());
+    std::unordered_set<Position, Cell::PositionHasher> unlinked = new_cells;
+
+    auto for_each_referenced = [&](const Position &pos, auto func)
     {
-        std::string result;
-        for (int i = 0; i < printable_size_.rows; ++i)
+        if (staged.count(pos))
         {
-            for (int j = 0; j < printable_size_.cols; ++j)
+            if (auto it = inserted_referenced.find(pos); it != inserted_referenced.end())
             {
-                if (sheet_.count(i) && sheet_.at(i).count(j) && sheet_.at(i).at(j) != nullptr)
+                std::for_each(it->second.begin(), it->second.end(), func);
+            }
+        }
+        else if (const Cell *cell = cells_.Get(pos); cell != nullptr)
+        {
+            ForEachPrecedent(*cell, [&](Position referenced, const Cell *)
+                             {
+                                 if (!unlinked.count(referenced))
+                                 {
+                                     func(referenced);
+                                 } });
+        }
+    };
+    auto for_each_dependent = [&](const Position &pos, auto func)
+    {
+        if (!new_cells.count(pos))
+        {
+            dependencies_.ForEachWatcher(pos, [&](Position dependent)
+                                         {
+                                             if (!staged.count(dependent))
+                                             {
+                                                 func(dependent);
+                                             } });
+        }
+        if (auto it = inserted_dependents.find(pos); it != inserted_dependents.end())
+        {
+            std::for_each(it->second.begin(), it->second.end(), func);
+        }
+    };
+    auto by_order = [this](const Position &lhs, const Position &rhs)
+    {
+        return cells_.Get(lhs)->GetOrder() < cells_.Get(rhs)->GetOrder();
+    };
+
+    std::unordered_set<Position, Cell::PositionHasher> visited;
+    std::vector<Position> stack;
+    std::vector<Position> forward;
+    std::vector<Position> backward;
+    std::vector<std::int64_t> orders;
+    // Добавляет в граф ребро referenced -> pos, исправляя порядок.
+    auto insert_edge = [&](const Position &referenced, const Position &pos)
+    {
+        if (referenced == pos)
+        {
+            throw CircularDependencyException("Circular Dependency"s);
+        }
+        const Cell *target = cells_.Get(pos);
+        const Cell *source = cells_.Get(referenced);
+        if (source->GetOrder() > target->GetOrder())
+        {
+            // Ребро referenced -> pos нарушает порядок. Ищем ячейки,
+            // зависящие от pos, между их позициями в порядке (цикл, если
+            // среди них referenced), и ячейки, от которых зависит
+            // referenced, в том же промежутке; затем переставляем
+            // найденные, не трогая остальные.
+            std::int64_t lower = target->GetOrder();
+            std::int64_t upper = source->GetOrder();
+            visited.clear();
+            forward.clear();
+            backward.clear();
+
+            stack.push_back(pos);
+            visited.insert(pos);
+            while (!stack.empty())
+            {
+                Position cell = stack.back();
+                stack.pop_back();
+                forward.push_back(cell);
+                for_each_dependent(cell, [&](const Position &dependent)
+                                   {
+                    if (dependent == referenced)
+                    {
+                        throw CircularDependencyException("Circular Dependency"s);
+                    }
+                    if (cells_.Get(dependent)->GetOrder() < upper && visited.insert(dependent).second)
+                    {
+                        stack.push_back(dependent);
+                    } });
+            }
+
+            stack.push_back(referenced);
+            visited.insert(referenced);
+            while (!stack.empty())
+            {
+                Position cell = stack.back();
+                stack.pop_back();
+                backward.push_back(cell);
+                for_each_referenced(cell, [&](const Position &dependence)
+                                    {
+                    const Cell *dependence_cell = cells_.Get(dependence);
+                    if (dependence_cell->GetOrder() > lower && visited.insert(dependence).second)
+                    {
+                        stack.push_back(dependence);
+                    } });
+            }
+
+            std::sort(forward.begin(), forward.end(), by_order);
+            std::sort(backward.begin(), backward.end(), by_order);
+            orders.clear();
+            for (const auto &cell : backward)
+            {
+                orders.push_back(cells_.Get(cell)->GetOrder());
+            }
+            for (const auto &cell : forward)
+            {
+                orders.push_back(cells_.Get(cell)->GetOrder());
+            }
+            std::sort(orders.begin(), orders.end());
+            auto order = orders.begin();
+            for (const auto *part : {&backward, &forward})
+            {
+                for (const auto &cell_pos : *part)
                 {
-                    result += GetStringFromValue(sheet_.at(i).at(j)->GetValue());
+                    Cell *cell = cells_.Get(cell_pos);
+                    if (cell->GetOrder() != *order)
+                    {
+                        old_orders.emplace_back(cell, cell->GetOrder());
+                        cell->SetOrder(*order);
+                    }
+                    ++order;
                 }
-                result += '\t';
             }
-            result += '\n';
         }
-        result.erase(result.size() - 2, 2);
-        output << result;
-        output << '\n';
+    };
+
+    for (const auto &pos : created)
+    {
+        std::vector<Position> watchers;
+        dependencies_.ForEachWatcher(pos, [&](Position watcher)
+                                     {
+                                         if (!staged.count(watcher))
+                                         {
+                                             watchers.push_back(watcher);
+                                         } });
+        for (const auto &watcher : watchers)
+        {
+            insert_edge(pos, watcher);
+            inserted_dependents[pos].push_back(watcher);
+        }
+        unlinked.erase(pos);
+    }
+    for (const auto &pos : edited)
+    {
+        std::vector<Position> precedents;
+        ForEachPrecedent(*staged.at(pos), [&precedents](Position referenced, const Cell *)
+                         { precedents.push_back(referenced); });
+        for (const auto &referenced : precedents)
+        {
+            insert_edge(referenced, pos);
+            inserted_referenced[pos].push_back(referenced);
+            inserted_dependents[referenced].push_back(pos);
+        }
     }
 }
 
-void Sheet::PrintTexts(std::ostream &output) const
+void Sheet::RebuildOrder(const std::unordered_map<Position, Cell *, Cell::PositionHasher> &staged)
 {
-    if (printable_size_.cols != 0 && printable_size_.rows != 0)
+    // Обход в глубину по ссылкам: ячейка попадает в порядок после всех
+    // ячеек, на которые ссылается. on_stack — ячейка ещё не обработана.
+    // Ещё не пройденные ссылки ячеек стека лежат в pending подряд, начиная
+    // с first своей ячейки.
+    std::vector<Cell *> order;
+    std::unordered_map<Position, bool, Cell::PositionHasher> on_stack;
+    struct Frame
+    {
+        Position pos;
+        std::size_t first;
+    };
+    std::vector<Frame> stack;
+    std::vector<Position> pending;
+    auto push = [&](Position pos)
     {
-        std::string result;
-        for (int i = 0; i < printable_size_.rows; ++i)
+        auto it = staged.find(pos);
+        const Cell &cell = it != staged.end() ? *it->second : *cells_.Get(pos);
+        stack.push_back({pos, pending.size()});
+        ForEachPrecedent(cell, [&pending](Position referenced, const Cell *)
+                         { pending.push_back(referenced); });
+    };
+    cells_.ForEach([&](Position root, Cell * /* cell */)
+                   {
+        if (!on_stack.emplace(root, true).second)
         {
-            for (int j = 0; j < printable_size_.cols; ++j)
+            return;
+        }
+        push(root);
+        while (!stack.empty())
+        {
+            const Frame &frame = stack.back();
+            if (pending.size() == frame.first)
+            {
+                on_stack[frame.pos] = false;
+                order.push_back(cells_.Get(frame.pos));
+                stack.pop_back();
+                continue;
+            }
+            Position pos = pending.back();
+            pending.pop_back();
+            auto [it, inserted] = on_stack.emplace(pos, true);
+            if (!inserted)
             {
-                if (sheet_.count(i) && sheet_.at(i).count(j) && sheet_.at(i).at(j) != nullptr)
+                if (it->second)
                 {
-                    result += sheet_.at(i).at(j)->GetText();
+                    throw CircularDependencyException("Circular Dependency"s);
                 }
-                result += '\t';
+                continue;
             }
-            result += '\n';
+            push(pos);
+        } });
+
+    for (std::size_t i = 0; i < order.size(); ++i)
+    {
+        order[i]->SetOrder(static_cast<std::int64_t>(i));
+    }
+    first_order_ = 0;
+    next_order_ = static_cast<std::int64_t>(order.size());
+}
+
+void Sheet::ClearCache(const Position &pos)
+{
+    // Устаревшая формула сама попадает в dirty_ только вместе со всеми
+    // зависящими от неё ячейками, поэтому обход останавливается на уже
+    // устаревших ячейках и каждая ячейка обрабатывается не больше одного раза.
+    std::vector<Position> stack;
+    auto push = [&stack](Position dependent)
+    {
+        stack.push_back(dependent);
+    };
+    dependencies_.ForEachWatcher(pos, push);
+    while (!stack.empty())
+    {
+        Position cell_pos = stack.back();
+        stack.pop_back();
+        Cell *cell = cells_.Get(cell_pos);
+        if (cell == nullptr || !cell->IsCached())
+        {
+            continue;
         }
-        result.erase(result.size() - 2, 2);
-        output << result;
-        output << '\n';
+        cell->ClearCache();
+        dirty_.insert(cell_pos);
+        dependencies_.ForEachWatcher(cell_pos, push);
     }
 }
 
-void Sheet::EnlargeSheet(const Position &pos)
+void Sheet::Recalculate(unsigned threads)
 {
-    if (printable_size_.rows <= pos.row)
+    std::vector<const Cell *> roots;
+    roots.reserve(dirty_.size());
+    for (const auto &pos : dirty_)
+    {
+        const Cell *cell = cells_.Get(pos);
+        if (cell != nullptr && !cell->IsCached())
+        {
+            roots.push_back(cell);
+        }
+    }
+    dirty_.clear();
+    ComputeRuns(roots);
+    roots.erase(std::remove_if(roots.begin(), roots.end(), [](const Cell *cell)
+                               { return cell->IsCached(); }),
+                roots.end());
+    if (threads <= 1)
     {
-        printable_size_.rows = pos.row + 1;
+        ComputeDirty(std::move(roots));
+        return;
     }
-    if (printable_size_.cols <= pos.col)
+    for (const auto &level : SplitIntoLevels(roots))
     {
-        printable_size_.cols = pos.col + 1;
+        ComputeLevel(level, threads);
     }
 }
 
-void Sheet::ReduceSheet(const Position &pos)
+std::vector<std::vector<const Cell *>> Sheet::SplitIntoLevels(const std::vector<const Cell *> &cells) const
 {
-    if (pos.col == printable_size_.cols - 1)
+    // Каждая непосчитанная формула есть в dirty_, поэтому cells содержит
+    // все устаревшие ячейки, и рёбра достаточно искать внутри этого набора.
+    std::unordered_map<const Cell *, size_t> index;
+    index.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i)
     {
-        bool need_decrease = true;
-        for (int i = 0; i < printable_size_.rows; ++i)
+        index[cells[i]] = i;
+    }
+
+    std::vector<int> remaining(cells.size(), 0);
+    std::vector<std::vector<size_t>> dependents(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        ForEachPrecedent(*cells[i], [&](Position, const Cell *referenced)
+                         {
+                             auto it = index.find(referenced);
+                             if (it != index.end())
+                             {
+                                 ++remaining[i];
+                                 dependents[it->second].push_back(i);
+                             } });
+    }
+
+    std::vector<std::vector<const Cell *>> levels;
+    std::vector<size_t> current;
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        if (remaining[i] == 0)
         {
-            if (sheet_.count(i) && sheet_.at(i).count(pos.col) && sheet_.at(i).at(pos.col) != nullptr)
-            {
-                need_decrease = false;
-                break;
-            }
+            current.push_back(i);
         }
-        if (need_decrease)
+    }
+    while (!current.empty())
+    {
+        std::vector<size_t> next;
+        auto &level = levels.emplace_back();
+        level.reserve(current.size());
+        for (size_t i : current)
         {
-            printable_size_.cols -= 1;
-            if (pos.col > 0)
+            level.push_back(cells[i]);
+            for (size_t dependent : dependents[i])
             {
-                Position p{pos.row, pos.col - 1};
-                ReduceSheet(p);
+                if (--remaining[dependent] == 0)
+                {
+                    next.push_back(dependent);
+                }
             }
         }
+        current = std::move(next);
     }
-    if (pos.row == printable_size_.rows - 1)
+    return levels;
+}
+
+void Sheet::ComputeLevel(const std::vector<const Cell *> &level, unsigned threads)
+{
+    // На маленьком уровне запуск потоков дороже самих вычислений.
+    static const size_t MIN_CELLS_PER_THREAD = 64;
+    threads = static_cast<unsigned>(std::min<size_t>(threads, level.size() / MIN_CELLS_PER_THREAD));
+    if (threads <= 1)
     {
-        bool need_decrease = true;
-        for (int i = 0; i < printable_size_.cols; ++i)
+        for (const Cell *cell : level)
         {
-            if (sheet_.count(pos.row) && sheet_.at(pos.row).count(i) && sheet_.at(pos.row).at(i) != nullptr)
-            {
-                need_decrease = false;
-                break;
-            }
+            cell->UpdateCache();
         }
-        if (need_decrease)
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    auto worker = [&level, &next]()
+    {
+        for (size_t i = next++; i < level.size(); i = next++)
         {
-            printable_size_.rows -= 1;
-            if (pos.row > 0)
-            {
-                Position p{pos.row - 1, pos.col};
-                ReduceSheet(p);
-            }
+            level[i]->UpdateCache();
         }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (unsigned i = 1; i < threads; ++i)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : workers)
+    {
+        thread.join();
     }
 }
 
-void Sheet::CheckCyclicalDependence(const std::unordered_set<Position, Cell::PositionHasher> &referenced_cells, const Position &root, std::set<Position> &visited_cells) const
+void Sheet::ComputeRuns(const std::vector<const Cell *> &cells) const
 {
-    for (const auto &cell : referenced_cells)
+    // Более короткие серии выгоднее вычислять по одной формуле.
+    static const std::size_t MIN_RUN_SIZE = 16;
+
+    struct Formula
+    {
+        Position pos;
+        const Cell *cell;
+        const FormulaAST *shape;
+    };
+    std::vector<Formula> formulas;
+    for (const Cell *cell : cells)
     {
-        if (cell == root)
+        const FormulaInterface *formula = cell->GetFormula();
+        if (formula != nullptr && formula->GetShape()->CanExecuteColumn())
         {
-            throw CircularDependencyException("Circular Dependency"s);
+            formulas.push_back({formula->GetAnchor(), cell, formula->GetShape().get()});
         }
-        if (GetCell(cell) != nullptr && sheet_.at(cell.row).at(cell.col)->IsReferenced() && !visited_cells.count(cell))
+    }
+    if (formulas.size() < MIN_RUN_SIZE)
+    {
+        return;
+    }
+    auto column_major = [](Position lhs, Position rhs)
+    {
+        return std::pair{lhs.col, lhs.row} < std::pair{rhs.col, rhs.row};
+    };
+    std::sort(formulas.begin(), formulas.end(), [&column_major](const Formula &lhs, const Formula &rhs)
+              { return column_major(lhs.pos, rhs.pos); });
+
+    // серии — отрезки formulas [begin, end)
+    std::vector<std::pair<std::size_t, std::size_t>> runs;
+    for (std::size_t begin = 0, end = 0; begin < formulas.size(); begin = end)
+    {
+        for (end = begin + 1; end < formulas.size() && formulas[end].shape == formulas[begin].shape
+                              && formulas[end].pos == Position{formulas[end - 1].pos.row + 1, formulas[begin].pos.col};
+             ++end)
+        {
+        }
+        if (end - begin >= MIN_RUN_SIZE)
         {
-            CheckCyclicalDependence(sheet_.at(cell.row).at(cell.col)->GetReferenced(), root, visited_cells);
-            visited_cells.insert(cell);
+            runs.emplace_back(begin, end);
         }
     }
-}
+    // Номер серии, в которой стоит формула в позиции pos, или runs.size().
+    auto find_run = [&](Position pos)
+    {
+        auto it = std::upper_bound(runs.begin(), runs.end(), pos, [&](Position pos, const auto &run)
+                                   { return column_major(pos, formulas[run.first].pos); });
+        if (it == runs.begin())
+        {
+            return runs.size();
+        }
+        --it;
+        const Position last = formulas[it->second - 1].pos;
+        if (pos.col != last.col || pos.row > last.row)
+        {
+            return runs.size();
+        }
+        return static_cast<std::size_t>(it - runs.begin());
+    };
 
-void Sheet::ClearCache(const std::unordered_set<Position, Cell::PositionHasher> &cells_that_refer)
-{
-    for (const auto &cell : cells_that_refer)
+    // Обход серий в глубину: серия вычисляется, когда сняты со стека все
+    // серии, в которых стоят её непосчитанные зависимости. Серии, ещё не
+    // раскрытые, лежат на стеке, пока не будут раскрыты, и могут лежать
+    // несколько раз.
+    enum State : char
+    {
+        NEW,
+        OPEN,
+        DONE,
+    };
+    std::vector<State> states(runs.size(), NEW);
+    // непосчитанные зависимости раскрытой серии вне её самой
+    std::vector<std::vector<const Cell *>> precedents(runs.size());
+    std::vector<bool> refers_to_itself(runs.size(), false);
+    std::vector<std::size_t> stack;
+    std::vector<std::size_t> needed;
+    std::vector<double> results;
+    std::unique_ptr<bool[]> failed;
+    for (std::size_t root = 0; root < runs.size(); ++root)
     {
-        if (GetCell({cell.row, cell.col}) != nullptr)
+        stack.push_back(root);
+        while (!stack.empty())
         {
-            sheet_.at(cell.row).at(cell.col)->ClearCache();
-            const auto &cells_that_refer = sheet_.at(cell.row).at(cell.col)->GetCellsThatRefer();
-            if (!cells_that_refer.empty())
+            const std::size_t index = stack.back();
+            const auto [begin, end] = runs[index];
+            const Position first = formulas[begin].pos;
+            if (states[index] == NEW)
             {
-                ClearCache(cells_that_refer);
+                states[index] = OPEN;
+                needed.clear();
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    ForEachPrecedent(*formulas[i].cell, [&](Position pos, const Cell *precedent)
+                                     {
+                                         if (precedent->IsCached())
+                                         {
+                                             return;
+                                         }
+                                         const std::size_t other = find_run(pos);
+                                         if (other == index)
+                                         {
+                                             refers_to_itself[index] = true;
+                                             return;
+                                         }
+                                         precedents[index].push_back(precedent);
+                                         if (other != runs.size() && states[other] == NEW)
+                                         {
+                                             needed.push_back(other);
+                                         }
+                                     });
+                }
+                std::sort(needed.begin(), needed.end());
+                needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+                stack.insert(stack.end(), needed.begin(), needed.end());
+                continue;
+            }
+            stack.pop_back();
+            if (states[index] == DONE)
+            {
+                continue;
+            }
+            states[index] = DONE;
+            if (refers_to_itself[index])
+            {
+                continue;
+            }
+            ComputeDirty(std::move(precedents[index]));
+            const std::size_t size = end - begin;
+            results.resize(size);
+            failed.reset(new bool[size]);
+            formulas[begin].shape->ExecuteColumn(*this, first, size, results.data(), failed.get());
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                const Cell *cell = formulas[begin + i].cell;
+                if (cell->IsCached())
+                {
+                    continue;
+                }
+                if (failed[i])
+                {
+                    cell->UpdateCache();
+                }
+                else
+                {
+                    cell->SetCachedValue(results[i]);
+                }
             }
         }
     }
 }
 
-void Sheet::RemoveOldDependences(const std::unordered_set<Position, Cell::PositionHasher> &cells_that_refer, const Position &pos)
+void Sheet::ComputeDirty(std::vector<const Cell *> roots) const
 {
-    for (const auto &cell : cells_that_refer)
+    // Обход в глубину по ссылкам формул. Ячейка, снятая со стека впервые,
+    // возвращается на него с пометкой ready поверх всех своих непосчитанных
+    // зависимостей и вычисляется, когда они уже посчитаны. Ячейка может
+    // оказаться на стеке несколько раз, но раскрывается только однажды:
+    // повторные копии к моменту снятия уже посчитаны.
+    std::vector<std::pair<const Cell *, bool>> stack;
+    stack.reserve(roots.size());
+    for (const Cell *root : roots)
     {
-        if (GetCell({cell.row, cell.col}) != nullptr)
-        {
-            sheet_.at(cell.row).at(cell.col)->RemoveOldDependence(pos);
-        }
+        stack.emplace_back(root, false);
     }
-}
-
-void Sheet::AddNewDependences(const std::unordered_set<Position, Cell::PositionHasher> &cells_that_refer, const Position &pos)
-{
-    for (const auto &cell : cells_that_refer)
+    while (!stack.empty())
     {
-        if (GetCell({cell.row, cell.col}) != nullptr)
+        auto [cell, ready] = stack.back();
+        stack.pop_back();
+        if (ready)
         {
-            sheet_.at(cell.row).at(cell.col)->AddNewDependence(pos);
+            cell->UpdateCache();
+            continue;
         }
-        else
+        if (cell->IsCached())
         {
-            sheet_[cell.row][cell.col] = std::make_unique<Cell>(*this);
-            sheet_.at(cell.row).at(cell.col)->Set("0"s);
-            sheet_.at(cell.row).at(cell.col)->AddNewDependence(pos);
+            continue;
         }
+        stack.emplace_back(cell, true);
+        ForEachPrecedent(*cell, [&stack](Position, const Cell *referenced)
+                         {
+                             if (!referenced->IsCached())
+                             {
+                                 stack.emplace_back(referenced, false);
+                             } });
     }
 }
 
+FormulaShapeCache &Sheet::GetFormulaShapes()
+{
+    return formula_shapes_;
+}
+
+SubexpressionTable &Sheet::GetSubexpressions()
+{
+    return subexpressions_;
+}
+
+void Sheet::RemoveDependences(const Cell &cell, Position pos)
+{
+    ForEachReference(cell, [this, pos](Range range)
+                     { dependencies_.Remove(range, pos); });
+}
+
+void Sheet::AddDependences(const Cell &cell, Position pos)
+{
+    ForEachReference(cell, [this, pos](Range range)
+                     { dependencies_.Add(range, pos); });
+}
+
 std::unique_ptr<SheetInterface> CreateSheet()
 {
     return std::make_unique<Sheet>();
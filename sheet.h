@@ -1,23 +1,90 @@
 #pragma once
 
+#include "FormulaAST.h"
 #include "cell.h"
 #include "common.h"
+#include "dependencies.h"
+#include "snapshot.h"
+#include "storage.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
-#include <set>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class Journal;
+
+// Исключение, выбрасываемое при попытке изменить таблицу только для чтения
+// (см. Sheet::Map)
+class ReadOnlySheetException : public std::logic_error
+{
+public:
+    using std::logic_error::logic_error;
+};
 
 class Sheet : public SheetInterface
 {
 public:
+    Sheet();
+
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
 
+    // Задаёт содержимое нескольких ячеек как одну правку: все формулы
+    // разбираются, граф зависимостей проверяется на циклы один раз для всех
+    // изменённых ячеек, после чего зависимости обновляются и кэши
+    // инвалидируются разом. Если одна из правок некорректна (неверная
+    // позиция, синтаксическая ошибка, циклическая зависимость), бросается
+    // соответствующее исключение и таблица не меняется. При повторении
+    // позиции действует последняя правка.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Копирует ячейку src во все ячейки области dest (протягивание):
+    // относительные ссылки формулы сдвигаются вместе с ней. Копии
+    // разделяют скомпилированную программу src, поэтому формулы не
+    // разбираются заново, а граф зависимостей проверяется один раз для
+    // всей области, как в SetCells. Пустая src не меняет ячеек. Бросает
+    // InvalidPositionException, если позиция или область неверны либо
+    // ссылка какой-то копии уходит за пределы таблицы, и
+    // CircularDependencyException, если копии образуют цикл; таблица при
+    // этом не меняется.
+    void FillRange(Position src, Range dest);
+
+    // Копирует непустые ячейки области src так, что её левый верхний угол
+    // встаёт в dest, — так же, как FillRange. Области могут пересекаться:
+    // копируется прежнее содержимое src.
+    void CopyRange(Range src, Position dest);
+
+    // Загружает в таблицу текст в формате PrintTexts: строки разделены
+    // переводом строки, ячейки — символом delimiter, пустые поля не меняют
+    // ячеек. Поля и формулы разбираются в threads потоках, затем ячейки
+    // создаются прямо в хранилище, а порядок зависимостей строится заново
+    // одним обходом всей таблицы. Ошибки — как у SetCells, таблица при
+    // этом не меняется. Кавычки не поддерживаются: поле не может содержать
+    // delimiter или перевод строки.
+    void Import(std::string_view data, char delimiter = '\t', unsigned threads = 1);
+
     const CellInterface *GetCell(Position pos) const override;
 
     CellInterface *GetCell(Position pos) override;
 
+    double GetNumber(Position pos) const override;
+
+    void GatherNumbers(Range range,
+                       const std::function<void(const double *numbers, std::size_t count)> &consume) const override;
+
+    void ReadColumn(Position from, std::size_t count, double *numbers, bool *failed) const override;
+
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
@@ -26,21 +93,314 @@ public:
 
     void PrintTexts(std::ostream &output) const override;
 
+    // Печатает в том же виде только ячейки области range, которая может
+    // выходить за печатную область. Обходятся лишь ячейки области, поэтому
+    // время печати не зависит от размера таблицы. Бросает
+    // InvalidPositionException для некорректной области.
+    void PrintValues(std::ostream &output, Range range) const;
+
+    void PrintTexts(std::ostream &output, Range range) const;
+
+    // Вызывает callback(pos, value) для каждой непустой ячейки области
+    // range построчно.
+    // Значения передаются без копирования (см. CellInterface::ValueRef).
+    // Как и ForEachCell, обходит только непустые ячейки.
+    void ForEachValue(Range range, const std::function<void(Position, CellInterface::ValueRef)> &callback) const;
+
+    // Вызывает callback(pos, cell) для каждой непустой ячейки таблицы по
+    // строкам или по столбцам. Пустые позиции не перебираются, поэтому
+    // время обхода разреженной таблицы зависит от числа ячеек, а не от
+    // размера печатной области.
+    void ForEachCell(CellOrder order, const std::function<void(Position, const CellInterface &)> &callback) const;
+
+    // Вычисляет все формулы, значения которых устарели, в топологическом
+    // порядке зависимостей. При threads > 1 формулы разбиваются на уровни
+    // (уровень ячейки на единицу больше максимального уровня устаревших
+    // ячеек, от которых она зависит), и ячейки одного уровня вычисляются
+    // параллельно: они читают только уже посчитанные значения и пишут
+    // каждая в свой кэш.
+    void Recalculate(unsigned threads = 1);
+
+    // Вычисляет непосчитанные формулы из roots вместе со всеми непосчитанными
+    // ячейками, от которых они зависят. Каждая ячейка вычисляется после своих
+    // зависимостей, поэтому вычисление формулы не уходит в рекурсию.
+    void ComputeDirty(std::vector<const Cell *> roots) const;
+
+    // Записывает таблицу в бинарный снимок (см. snapshot.h). При with_values
+    // записываются и вычисленные значения формул, тогда после загрузки их не
+    // нужно пересчитывать.
+    void Save(std::ostream &output, bool with_values = true) const;
+
+    // Восстанавливает таблицу из снимка без разбора формул и проверки
+    // циклов. Бросает SnapshotException, если снимок повреждён.
+    static std::unique_ptr<Sheet> Load(std::string_view data);
+
+    // То же для файла, который отображается в память на время загрузки.
+    static std::unique_ptr<Sheet> LoadFile(const std::string &path);
+
+    // Открывает снимок path как таблицу только для чтения. Файл остаётся
+    // отображённым в память, и ячейка создаётся (а её формула загружается)
+    // лишь при первом обращении к ней, поэтому несколько процессов делят
+    // одну копию таблицы в страничном кэше. Размер печатной области берётся
+    // из заголовка снимка. Повреждение снимка обнаруживается при обращении
+    // к ячейке (SnapshotException), изменение таблицы бросает
+    // ReadOnlySheetException.
+    static std::unique_ptr<Sheet> Map(const std::string &path);
+
+    // Подключает журнал изменений (см. journal.h): каждая успешная правка
+    // таблицы записывается в него одной записью. nullptr отключает журнал.
+    // Журнал должен пережить таблицу или быть отключён раньше.
+    void SetJournal(Journal *journal);
+
+    // Записывает снимок таблицы в snapshot_path. Если подключён журнал,
+    // снимок пишется в фоновом потоке журнала, после чего из журнала
+    // удаляются вошедшие в снимок записи.
+    void Compact(const std::string &snapshot_path);
+
+    // Восстанавливает таблицу после сбоя или перезапуска: загружает снимок
+    // snapshot_path, если он есть, и повторяет записи журнала journal_path,
+    // сделанные после него. Журнал к таблице не подключается.
+    static std::unique_ptr<Sheet> Recover(const std::string &snapshot_path, const std::string &journal_path);
+
+    // Скомпилированные формулы ячеек таблицы, общие для формул одной формы.
+    FormulaShapeCache &GetFormulaShapes();
+
+    // Значения подвыражений, общих для формул таблицы.
+    SubexpressionTable &GetSubexpressions();
+
 private:
-    std::unordered_map<int, std::unordered_map<int, std::unique_ptr<Cell>>> sheet_;
+    // Размер блока чисел GatherNumbers.
+    static const std::size_t NUMBER_BLOCK_SIZE = 256;
+
+    // Пул, из которого выделяются ячейки, их реализации и деревья формул.
+    // Объявлен до cells_, чтобы пережить все ячейки; вся память пула
+    // освобождается разом при уничтожении таблицы.
+    std::pmr::unsynchronized_pool_resource pool_;
+    // Размещает скомпилированные формулы в pool_.
+    FormulaShapeCache formula_shapes_;
+    // Объявлена до cells_: формулы ячеек освобождают в ней подвыражения.
+    SubexpressionTable subexpressions_;
+    CellStorage cells_;
+    // Снимок таблицы только для чтения (см. Map), из которого ячейки
+    // создаются при обращении, и уже загруженные из него формулы.
+    std::unique_ptr<MappedFile> snapshot_file_;
+    std::unique_ptr<SnapshotReader> snapshot_;
+    std::vector<std::shared_ptr<const FormulaAST>> snapshot_shapes_;
     Size printable_size_;
+    // Число непустых ячеек в каждой занятой строке и в каждом занятом
+    // столбце: печатная область кончается на последних из них.
+    std::pmr::map<int, int> occupied_rows_;
+    std::pmr::map<int, int> occupied_cols_;
+    // Ссылки формул таблицы (ячейки — как диапазоны из одной ячейки).
+    DependencyIndex dependencies_;
+    // Формулы, значения которых могли устареть после последнего Recalculate.
+    std::unordered_set<Position, Cell::PositionHasher> dirty_;
+    // Позиции в топологическом порядке для новых ячеек: ячейки, не
+    // ссылающиеся на ячейки таблицы, встают в начало порядка и не нарушают
+    // его, остальные — в конец.
+    std::int64_t next_order_ = 0;
+    std::int64_t first_order_ = 0;
+    Journal *journal_ = nullptr;
+    // Номер последней правки таблицы; им помечаются записи журнала.
+    std::uint64_t journal_sequence_ = 0;
+
+    // Ячейка в позиции pos или nullptr; у таблицы только для чтения
+    // отсутствующая ячейка создаётся по снимку.
+    Cell *FindCell(Position pos) const;
+
+    Cell *Materialize(Position pos);
+
+    // Создаёт ячейку по записи снимка. Формулы, ещё не загруженные в
+    // shapes, загружаются из reader.
+    Cell *RestoreCell(const SnapshotReader &reader, const SnapshotCell &record,
+                      std::vector<std::shared_ptr<const FormulaAST>> &shapes);
+
+    // Вызывает func(pos, cell) для непустых ячеек области range в порядке
+    // order, не перебирая пустые позиции.
+    template <typename Func>
+    void ForEachInRange(Range range, CellOrder order, Func func) const;
+
+    // Вызывает func(range) для каждой ссылки формулы ячейки cell
+    // (отдельная ячейка — диапазон из одной ячейки). Ссылки за пределы
+    // таблицы пропускаются: они дают #REF! и ни от чего не зависят.
+    template <typename Func>
+    static void ForEachReference(const Cell &cell, Func func);
+
+    // Вызывает func(pos, referenced) для ячеек таблицы, на которые
+    // ссылается формула ячейки cell, включая пустые ячейки, только что
+    // созданные ApplyEdits. Ячейка может встретиться несколько раз.
+    template <typename Func>
+    void ForEachPrecedent(const Cell &cell, Func func) const;
+
+    void CheckWritable() const;
+
+    // Учитывают ячейку pos, ставшую непустой или пустой, в печатной
+    // области за O(log n).
+    void AddOccupied(Position pos);
+
+    void RemoveOccupied(Position pos);
 
-    void EnlargeSheet(const Position &pos);
+    void UpdatePrintableSize();
 
-    void ReduceSheet(const Position &pos);
+    // Записывает в журнал правку с новым содержимым ячеек positions или,
+    // при clear, их очистку.
+    void LogEdit(const std::vector<Position> &positions, bool clear);
 
-    std::string GetStringFromValue(const CellInterface::Value &value) const;
+    // Печатает область range потоком, выводя содержимое непустой ячейки
+    // через print_cell(writer, cell).
+    template <typename PrintCell>
+    void PrintTable(std::ostream &output, Range range, PrintCell print_cell) const;
 
-    void CheckCyclicalDependence(const std::unordered_set<Position, Cell::PositionHasher> &referenced_cells, const Position &root, std::set<Position> &visited_cells) const;
+    // Вся печатная область; Range::NONE для пустой таблицы.
+    Range GetPrintableRange() const;
 
-    void ClearCache(const std::unordered_set<Position, Cell::PositionHasher> &cells_that_refer);
+    // Копирует непустые ячейки из первых позиций пар во вторые одной
+    // правкой (см. FillRange).
+    void CopyCells(const std::vector<std::pair<Position, Position>> &copies);
 
-    void RemoveOldDependences(const std::unordered_set<Position, Cell::PositionHasher> &cells_that_refer, const Position &pos);
+    // Проверяет изменённые ячейки edited, содержимое которых подготовлено
+    // в staged, и применяет их к таблице. Ячейка из staged может быть уже
+    // размещена в хранилище: тогда её позиция должна быть в created, и при
+    // ошибке она удаляется. При rebuild_order порядок ячеек строится
+    // заново (дешевле для больших правок), иначе обновляется
+    // инкрементально.
+    void ApplyEdits(const std::unordered_map<Position, Cell *, Cell::PositionHasher> &staged,
+                    const std::vector<Position> &edited, std::vector<Position> created, bool rebuild_order);
 
-    void AddNewDependences(const std::unordered_set<Position, Cell::PositionHasher> &cells_that_refer, const Position &pos);
-};
\ No newline at end of file
+    // Строит топологический порядок всех ячеек таблицы так, будто ячейки
+    // staged уже заменены. Бросает CircularDependencyException при цикле,
+    // не меняя порядок.
+    void RebuildOrder(const std::unordered_map<Position, Cell *, Cell::PositionHasher> &staged);
+
+    // Добавляет в топологический порядок ячеек ссылки изменённых ячеек
+    // edited (их новое содержимое — в staged) и ссылки формул таблицы на
+    // созданные ячейки created по алгоритму Пирса—Келли: ребро, нарушающее
+    // порядок, исправляется перестановкой только тех ячеек, что лежат
+    // между его концами. Бросает CircularDependencyException, если ссылки
+    // образуют цикл; прежние позиции переставленных ячеек записываются в
+    // old_orders.
+    void CheckCyclicalDependence(const std::vector<Position> &edited, const std::vector<Position> &created,
+                                 const std::unordered_map<Position, Cell *, Cell::PositionHasher> &staged,
+                                 std::vector<std::pair<Cell *, std::int64_t>> &old_orders);
+    void ClearCache(const Position &pos);
+
+    std::vector<std::vector<const Cell *>> SplitIntoLevels(const std::vector<const Cell *> &cells) const;
+
+    static void ComputeLevel(const std::vector<const Cell *> &level, unsigned threads);
+
+    // Вычисляет серии непосчитанных формул одной формы из cells, идущие
+    // подряд в столбце (формулу, скопированную вниз), через
+    // FormulaAST::ExecuteColumn. Серия вычисляется после серий, от которых
+    // зависит, прочие непосчитанные ячейки, от которых она зависит, —
+    // через ComputeDirty. Строки, которые не вычисляются столбцом,
+    // вычисляются по одной; серия, формулы которой ссылаются друг на
+    // друга, остаётся непосчитанной.
+    void ComputeRuns(const std::vector<const Cell *> &cells) const;
+
+    // Убирают из индекса и добавляют в него ссылки ячейки cell, стоящей
+    // в позиции pos.
+    void RemoveDependences(const Cell &cell, Position pos);
+
+    void AddDependences(const Cell &cell, Position pos);
+};
+
+template <typename Func>
+void Sheet::ForEachInRange(Range range, CellOrder order, Func func) const
+{
+    if (!range.IsValid())
+    {
+        return;
+    }
+    if (snapshot_ == nullptr)
+    {
+        cells_.ForEachInRange(range, order, [&func](Position pos, const Cell *cell)
+                              {
+                                  if (!cell->IsEmpty())
+                                  {
+                                      func(pos, cell);
+                                  } });
+        return;
+    }
+    // Записи строки идут в снимке подряд, по возрастанию столбца; для
+    // обхода по столбцам позиции области сортируются.
+    std::vector<Position> positions;
+    const std::size_t count = snapshot_->GetHeader().cell_count;
+    for (int row = range.from.row; row <= range.to.row; ++row)
+    {
+        int last_col = -1;
+        for (std::size_t index = snapshot_->LowerBound(Position{row, range.from.col}); index < count; ++index)
+        {
+            const auto record = snapshot_->GetCell(index);
+            if (record.row != row || record.col > range.to.col || record.col <= last_col)
+            {
+                break;
+            }
+            last_col = record.col;
+            if (order == CellOrder::RowMajor)
+            {
+                func(Position{row, record.col}, FindCell(Position{row, record.col}));
+            }
+            else
+            {
+                positions.push_back(Position{row, record.col});
+            }
+        }
+    }
+    std::stable_sort(positions.begin(), positions.end(), [](Position lhs, Position rhs)
+                     { return lhs.col < rhs.col; });
+    for (const auto &pos : positions)
+    {
+        func(pos, FindCell(pos));
+    }
+}
+
+template <typename Func>
+void Sheet::ForEachReference(const Cell &cell, Func func)
+{
+    const FormulaInterface *formula = cell.GetFormula();
+    if (formula == nullptr)
+    {
+        return;
+    }
+    const Position anchor = formula->GetAnchor();
+    const auto &shape = *formula->GetShape();
+    for (const auto &offset : shape.GetCells())
+    {
+        const Position pos{anchor.row + offset.row, anchor.col + offset.col};
+        if (pos.IsValid())
+        {
+            func(Range{pos, pos});
+        }
+    }
+    for (const auto &offset : shape.GetRanges())
+    {
+        const Range range{{anchor.row + offset.from.row, anchor.col + offset.from.col},
+                          {anchor.row + offset.to.row, anchor.col + offset.to.col}};
+        if (range.IsValid())
+        {
+            func(range);
+        }
+    }
+}
+
+template <typename Func>
+void Sheet::ForEachPrecedent(const Cell &cell, Func func) const
+{
+    ForEachReference(cell, [this, &func](Range range)
+                     {
+                         if (range.from == range.to)
+                         {
+                             if (const Cell *referenced = FindCell(range.from))
+                             {
+                                 func(range.from, referenced);
+                             }
+                         }
+                         else if (snapshot_ == nullptr)
+                         {
+                             cells_.ForEachInRange(range, CellOrder::RowMajor, func);
+                         }
+                         else
+                         {
+                             ForEachInRange(range, CellOrder::RowMajor, func);
+                         } });
+}
@@ -0,0 +1,577 @@
+#include "snapshot.h"
+
+#include "FormulaAST.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_USE_MMAP
+#endif
+
+using namespace std::literals;
+
+namespace
+{
+    // SNAPSHOT_BYTE_ORDER, записанный машиной с другим порядком байт
+    const std::uint32_t SWAPPED_BYTE_ORDER = 0x04030201;
+
+    template <typename Record>
+    void WriteRecord(std::ostream &output, const Record &record)
+    {
+        output.write(reinterpret_cast<const char *>(&record), sizeof(record));
+    }
+
+    template <typename Record>
+    void WriteRecords(std::ostream &output, const Record *records, std::size_t count)
+    {
+        output.write(reinterpret_cast<const char *>(records), sizeof(Record) * count);
+    }
+
+    template <typename Record>
+    Record ReadRecord(std::string_view data, std::size_t offset)
+    {
+        Record record;
+        std::memcpy(&record, data.data() + offset, sizeof(record));
+        return record;
+    }
+
+    [[noreturn]] void Corrupted(const std::string &reason)
+    {
+        throw SnapshotException("Corrupted snapshot: "s + reason);
+    }
+
+    bool InRange(std::uint64_t first, std::uint64_t count, std::uint64_t total)
+    {
+        return first <= total && count <= total - first;
+    }
+} // namespace
+
+void Sheet::Save(std::ostream &output, bool with_values) const
+{
+    SnapshotHeader header{};
+    std::copy(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC), header.magic);
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.version = SNAPSHOT_VERSION;
+    header.flags = with_values ? SNAPSHOT_HAS_VALUES : 0;
+    header.rows = printable_size_.rows;
+    header.cols = printable_size_.cols;
+    header.journal_sequence = journal_sequence_;
+
+    std::vector<SnapshotCell> cells;
+    std::vector<const FormulaAST *> shapes;
+    std::unordered_map<const FormulaAST *, std::uint32_t> shape_indices;
+    ForEachInRange(GetPrintableRange(), CellOrder::RowMajor, [&](Position pos, const Cell *cell)
+                   {
+        SnapshotCell record{};
+        record.row = pos.row;
+        record.col = pos.col;
+        record.order = cell->GetOrder();
+        if (const FormulaInterface *formula = cell->GetFormula(); formula != nullptr)
+        {
+            // ссылки формулы ячейки записаны относительно неё самой
+            assert(formula->GetAnchor() == pos);
+            const FormulaAST *shape = formula->GetShape().get();
+            auto [it, inserted] = shape_indices.emplace(shape, static_cast<std::uint32_t>(shapes.size()));
+            if (inserted)
+            {
+                shapes.push_back(shape);
+            }
+            record.kind = SnapshotCell::FORMULA;
+            record.index = it->second;
+            if (with_values && cell->IsCached())
+            {
+                auto value = cell->GetValueRef();
+                if (std::holds_alternative<double>(value))
+                {
+                    record.kind = SnapshotCell::FORMULA_NUMBER;
+                    std::memcpy(&record.data, &std::get<double>(value), sizeof(record.data));
+                }
+                else
+                {
+                    record.kind = SnapshotCell::FORMULA_ERROR;
+                    record.data = static_cast<std::uint64_t>(std::get<FormulaError>(value).GetCategory());
+                }
+            }
+        }
+        else
+        {
+            record.kind = SnapshotCell::TEXT;
+            record.index = static_cast<std::uint32_t>(cell->GetText().size());
+            record.data = header.string_size;
+            header.string_size += record.index;
+        }
+        cells.push_back(record); });
+
+    std::vector<SnapshotShape> shape_records;
+    shape_records.reserve(shapes.size());
+    for (const FormulaAST *shape : shapes)
+    {
+        SnapshotShape record{};
+        record.first_instruction = header.instruction_count;
+        record.first_number = header.number_count;
+        record.first_reference = header.reference_count;
+        record.first_range = header.range_count;
+        record.instruction_count = static_cast<std::uint32_t>(shape->GetProgram().size());
+        record.number_count = static_cast<std::uint32_t>(shape->GetNumbers().size());
+        record.reference_count = static_cast<std::uint32_t>(shape->GetCells().size());
+        record.range_count = static_cast<std::uint32_t>(shape->GetRanges().size());
+        record.stack_depth = static_cast<std::uint32_t>(shape->GetStackDepth());
+        header.instruction_count += record.instruction_count;
+        header.number_count += record.number_count;
+        header.reference_count += record.reference_count;
+        header.range_count += record.range_count;
+        shape_records.push_back(record);
+    }
+    header.cell_count = cells.size();
+    header.shape_count = shapes.size();
+
+    WriteRecord(output, header);
+    WriteRecords(output, cells.data(), cells.size());
+    WriteRecords(output, shape_records.data(), shape_records.size());
+    for (const FormulaAST *shape : shapes)
+    {
+        for (const auto &instruction : shape->GetProgram())
+        {
+            SnapshotInstruction record{};
+            record.op = static_cast<std::uint8_t>(instruction.op);
+            record.arg = instruction.arg;
+            WriteRecord(output, record);
+        }
+    }
+    for (const FormulaAST *shape : shapes)
+    {
+        WriteRecords(output, shape->GetNumbers().data(), shape->GetNumbers().size());
+    }
+    for (const FormulaAST *shape : shapes)
+    {
+        for (const auto &cell : shape->GetCells())
+        {
+            WriteRecord(output, SnapshotReference{cell.row, cell.col});
+        }
+    }
+    for (const FormulaAST *shape : shapes)
+    {
+        for (const auto &range : shape->GetRanges())
+        {
+            WriteRecord(output, SnapshotRange{{range.from.row, range.from.col}, {range.to.row, range.to.col}});
+        }
+    }
+    for (const auto &record : cells)
+    {
+        if (record.kind == SnapshotCell::TEXT)
+        {
+            const std::string text = cells_.Get(Position{record.row, record.col})->GetText();
+            output.write(text.data(), text.size());
+        }
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::Load(std::string_view data)
+{
+    const SnapshotReader reader(data);
+    const auto &header = reader.GetHeader();
+
+    auto sheet = std::make_unique<Sheet>();
+    sheet->journal_sequence_ = header.journal_sequence;
+
+    std::vector<std::shared_ptr<const FormulaAST>> shapes(header.shape_count);
+    std::vector<Position> formulas;
+    std::vector<std::int64_t> orders;
+    orders.reserve(header.cell_count);
+    for (std::size_t i = 0; i < header.cell_count; ++i)
+    {
+        const auto record = reader.GetCell(i);
+        const Position pos{record.row, record.col};
+        if (sheet->RestoreCell(reader, record, shapes)->GetFormula() != nullptr)
+        {
+            formulas.push_back(pos);
+        }
+        orders.push_back(record.order);
+        sheet->AddOccupied(pos);
+    }
+    if (!(sheet->printable_size_ == Size{header.rows, header.cols}))
+    {
+        Corrupted("printable size mismatch");
+    }
+
+    // Порядок должен быть строгим и согласованным со ссылками: тогда граф
+    // зависимостей ацикличен и инкрементальная проверка циклов корректна.
+    std::sort(orders.begin(), orders.end());
+    if (std::adjacent_find(orders.begin(), orders.end()) != orders.end())
+    {
+        Corrupted("duplicate order");
+    }
+    if (!orders.empty())
+    {
+        sheet->first_order_ = orders.front();
+        sheet->next_order_ = orders.back() + 1;
+    }
+    for (const auto &pos : formulas)
+    {
+        const Cell *cell = sheet->cells_.Get(pos);
+        sheet->ForEachPrecedent(*cell, [cell](Position, const Cell *referenced)
+                                {
+                                    if (referenced->GetOrder() >= cell->GetOrder())
+                                    {
+                                        Corrupted("dependency order");
+                                    } });
+        sheet->AddDependences(*cell, pos);
+        if (!cell->IsCached())
+        {
+            sheet->dirty_.insert(pos);
+        }
+    }
+    return sheet;
+}
+
+std::unique_ptr<Sheet> Sheet::LoadFile(const std::string &path)
+{
+    MappedFile file(path);
+    return Load(file.GetData());
+}
+
+std::unique_ptr<Sheet> Sheet::Map(const std::string &path)
+{
+    auto file = std::make_unique<MappedFile>(path);
+    auto reader = std::make_unique<SnapshotReader>(file->GetData());
+    const auto &header = reader->GetHeader();
+    if (header.rows < 0 || header.rows > Position::MAX_ROWS || header.cols < 0 || header.cols > Position::MAX_COLS
+        || (header.rows == 0) != (header.cols == 0))
+    {
+        Corrupted("bad printable size");
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    sheet->printable_size_ = {header.rows, header.cols};
+    sheet->journal_sequence_ = header.journal_sequence;
+    sheet->snapshot_shapes_.resize(header.shape_count);
+    sheet->snapshot_file_ = std::move(file);
+    sheet->snapshot_ = std::move(reader);
+    return sheet;
+}
+
+Cell *Sheet::Materialize(Position pos)
+{
+    const auto record = snapshot_->FindCell(pos);
+    if (!record)
+    {
+        return nullptr;
+    }
+    if (pos.row >= printable_size_.rows || pos.col >= printable_size_.cols)
+    {
+        Corrupted("cell out of the printable area");
+    }
+    Cell *cell = RestoreCell(*snapshot_, *record, snapshot_shapes_);
+    // Весь порядок снимка не проверяется, но каждая формула ссылается лишь
+    // на ячейки раньше себя, поэтому при вычислении цикл не встретится.
+    // Записи ячеек диапазона ищутся в снимке построчно, сами ячейки не
+    // создаются.
+    const std::size_t count = snapshot_->GetHeader().cell_count;
+    ForEachReference(*cell, [&](Range range)
+                     {
+                         for (int row = range.from.row; row <= range.to.row; ++row)
+                         {
+                             for (std::size_t index = snapshot_->LowerBound(Position{row, range.from.col}); index < count; ++index)
+                             {
+                                 const auto referenced = snapshot_->GetCell(index);
+                                 if (referenced.row != row || referenced.col > range.to.col)
+                                 {
+                                     break;
+                                 }
+                                 if (referenced.order >= record->order)
+                                 {
+                                     cells_.Erase(pos);
+                                     Corrupted("dependency order");
+                                 }
+                             }
+                         } });
+    return cell;
+}
+
+Cell *Sheet::RestoreCell(const SnapshotReader &reader, const SnapshotCell &record,
+                         std::vector<std::shared_ptr<const FormulaAST>> &shapes)
+{
+    const Position pos{record.row, record.col};
+    if (!pos.IsValid() || cells_.Get(pos) != nullptr)
+    {
+        Corrupted("bad cell position");
+    }
+    if (record.kind == SnapshotCell::TEXT)
+    {
+        std::string text = reader.GetText(record);
+        Cell *cell = cells_.Emplace(pos, *this, &pool_);
+        cell->Set(std::move(text), pos);
+        cell->SetOrder(record.order);
+        return cell;
+    }
+    if (record.kind > SnapshotCell::FORMULA_ERROR || record.index >= shapes.size())
+    {
+        Corrupted("bad cell kind");
+    }
+    auto &shape = shapes[record.index];
+    if (shape == nullptr)
+    {
+        // Программа собирается во временной памяти; в пул таблицы попадает
+        // только копия, сделанная FormulaShapeCache.
+        std::pmr::monotonic_buffer_resource scratch;
+        shape = formula_shapes_.Intern(reader.GetShape(record.index, &scratch));
+    }
+    for (const auto &offset : shape->GetCells())
+    {
+        if (!Position{pos.row + offset.row, pos.col + offset.col}.IsValid())
+        {
+            Corrupted("reference out of the sheet");
+        }
+    }
+    for (const auto &offset : shape->GetRanges())
+    {
+        if (!Position{pos.row + offset.from.row, pos.col + offset.from.col}.IsValid()
+            || !Position{pos.row + offset.to.row, pos.col + offset.to.col}.IsValid())
+        {
+            Corrupted("reference out of the sheet");
+        }
+    }
+    auto value = reader.GetValue(record);
+    Cell *cell = cells_.Emplace(pos, *this, &pool_);
+    cell->SetFormula(MakeFormula(shape, pos, &pool_), std::move(value));
+    cell->SetOrder(record.order);
+    return cell;
+}
+
+SnapshotReader::SnapshotReader(std::string_view data)
+    : data_(data)
+{
+    if (data.size() < sizeof(SnapshotHeader))
+    {
+        Corrupted("too short");
+    }
+    header_ = ReadRecord<SnapshotHeader>(data, 0);
+    if (!std::equal(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC), header_.magic))
+    {
+        throw SnapshotException("Not a sheet snapshot"s);
+    }
+    if (header_.byte_order == SWAPPED_BYTE_ORDER)
+    {
+        throw SnapshotException("Snapshot was saved with a different byte order"s);
+    }
+    if (header_.byte_order != SNAPSHOT_BYTE_ORDER || header_.version != SNAPSHOT_VERSION
+        || (header_.flags & ~SNAPSHOT_HAS_VALUES) != 0)
+    {
+        throw SnapshotException("Unsupported snapshot version"s);
+    }
+
+    std::size_t offset = sizeof(SnapshotHeader);
+    auto section = [&offset, size = data.size()](std::uint64_t count, std::size_t record_size)
+    {
+        if (count > (size - offset) / record_size)
+        {
+            Corrupted("section out of bounds");
+        }
+        std::size_t start = offset;
+        offset += static_cast<std::size_t>(count) * record_size;
+        return start;
+    };
+    cells_ = section(header_.cell_count, sizeof(SnapshotCell));
+    shapes_ = section(header_.shape_count, sizeof(SnapshotShape));
+    instructions_ = section(header_.instruction_count, sizeof(SnapshotInstruction));
+    numbers_ = section(header_.number_count, sizeof(double));
+    references_ = section(header_.reference_count, sizeof(SnapshotReference));
+    ranges_ = section(header_.range_count, sizeof(SnapshotRange));
+    strings_ = section(header_.string_size, 1);
+    if (offset != data.size())
+    {
+        Corrupted("unexpected size");
+    }
+}
+
+const SnapshotHeader &SnapshotReader::GetHeader() const
+{
+    return header_;
+}
+
+SnapshotCell SnapshotReader::GetCell(std::size_t index) const
+{
+    return ReadRecord<SnapshotCell>(data_, cells_ + index * sizeof(SnapshotCell));
+}
+
+std::size_t SnapshotReader::LowerBound(Position pos) const
+{
+    std::size_t first = 0;
+    std::size_t count = header_.cell_count;
+    while (count > 0)
+    {
+        const std::size_t half = count / 2;
+        const auto record = GetCell(first + half);
+        if (Position{record.row, record.col} < pos)
+        {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else
+        {
+            count = half;
+        }
+    }
+    return first;
+}
+
+std::optional<SnapshotCell> SnapshotReader::FindCell(Position pos) const
+{
+    const std::size_t index = LowerBound(pos);
+    if (index == header_.cell_count)
+    {
+        return std::nullopt;
+    }
+    const auto record = GetCell(index);
+    if (!(Position{record.row, record.col} == pos))
+    {
+        return std::nullopt;
+    }
+    return record;
+}
+
+std::string SnapshotReader::GetText(const SnapshotCell &cell) const
+{
+    if (!InRange(cell.data, cell.index, header_.string_size))
+    {
+        Corrupted("text out of bounds");
+    }
+    std::string text(data_.substr(strings_ + cell.data, cell.index));
+    if (text.size() > 1 && text[0] == '=')
+    {
+        Corrupted("text looks like a formula");
+    }
+    return text;
+}
+
+FormulaAST SnapshotReader::GetShape(std::size_t index, std::pmr::memory_resource *resource) const
+{
+    const auto record = ReadRecord<SnapshotShape>(data_, shapes_ + index * sizeof(SnapshotShape));
+    if (!InRange(record.first_instruction, record.instruction_count, header_.instruction_count)
+        || !InRange(record.first_number, record.number_count, header_.number_count)
+        || !InRange(record.first_reference, record.reference_count, header_.reference_count)
+        || !InRange(record.first_range, record.range_count, header_.range_count))
+    {
+        Corrupted("formula out of bounds");
+    }
+    std::pmr::vector<ASTImpl::Instruction> program(record.instruction_count, resource);
+    for (std::size_t i = 0; i < program.size(); ++i)
+    {
+        const auto instruction = ReadRecord<SnapshotInstruction>(
+            data_, instructions_ + (record.first_instruction + i) * sizeof(SnapshotInstruction));
+        program[i] = {static_cast<ASTImpl::OpCode>(instruction.op), instruction.arg};
+    }
+    std::pmr::vector<double> numbers(record.number_count, resource);
+    if (!numbers.empty())
+    {
+        std::memcpy(numbers.data(), data_.data() + numbers_ + record.first_number * sizeof(double),
+                    numbers.size() * sizeof(double));
+    }
+    std::pmr::vector<Position> references(record.reference_count, resource);
+    for (std::size_t i = 0; i < references.size(); ++i)
+    {
+        const auto reference = ReadRecord<SnapshotReference>(
+            data_, references_ + (record.first_reference + i) * sizeof(SnapshotReference));
+        references[i] = {reference.row, reference.col};
+    }
+    std::pmr::vector<Range> ranges(record.range_count, resource);
+    for (std::size_t i = 0; i < ranges.size(); ++i)
+    {
+        const auto range = ReadRecord<SnapshotRange>(data_, ranges_ + (record.first_range + i) * sizeof(SnapshotRange));
+        ranges[i] = {{range.from.row, range.from.col}, {range.to.row, range.to.col}};
+    }
+    FormulaAST shape(std::move(program), std::move(numbers), std::move(references), std::move(ranges),
+                     record.stack_depth);
+    if (!shape.IsWellFormed())
+    {
+        Corrupted("malformed formula");
+    }
+    shape.Optimize();
+    return shape;
+}
+
+std::optional<CellInterface::Value> SnapshotReader::GetValue(const SnapshotCell &cell) const
+{
+    if (cell.kind == SnapshotCell::FORMULA_NUMBER)
+    {
+        double number;
+        std::memcpy(&number, &cell.data, sizeof(number));
+        return number;
+    }
+    if (cell.kind == SnapshotCell::FORMULA_ERROR)
+    {
+        if (cell.data > static_cast<std::uint64_t>(FormulaError::Category::Div0))
+        {
+            Corrupted("bad error category");
+        }
+        return FormulaError(static_cast<FormulaError::Category>(cell.data));
+    }
+    return std::nullopt;
+}
+
+MappedFile::MappedFile(const std::string &path)
+{
+#ifdef SNAPSHOT_USE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw SnapshotException("Cannot open "s + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        throw SnapshotException("Cannot open "s + path);
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    if (size_ != 0)
+    {
+        void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            throw SnapshotException("Cannot map "s + path);
+        }
+        data_ = static_cast<const char *>(data);
+    }
+    close(fd);
+#else
+    std::ifstream input(path, std::ios::binary);
+    if (!input)
+    {
+        throw SnapshotException("Cannot open "s + path);
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef SNAPSHOT_USE_MMAP
+    if (data_ != nullptr)
+    {
+        munmap(const_cast<char *>(data_), size_);
+    }
+#endif
+}
+
+std::string_view MappedFile::GetData() const
+{
+    return std::string_view(data_, size_);
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Бинарный снимок таблицы (Sheet::Save, Sheet::Load).
+//
+// Формат рассчитан на чтение прямо из отображённого в память файла: числа
+// записаны в порядке байт машины, сохранившей снимок (его отмечает
+// SNAPSHOT_BYTE_ORDER в заголовке, и снимок с другим порядком не
+// загружается), каждая запись имеет фиксированный размер, кратный 8, а
+// секции идут подряд сразу за заголовком:
+//
+//   SnapshotHeader
+//   SnapshotCell        [cell_count]         непустые ячейки построчно
+//   SnapshotShape       [shape_count]        скомпилированные формулы
+//   SnapshotInstruction [instruction_count]  программы формул
+//   double              [number_count]       константы формул
+//   SnapshotReference   [reference_count]    ссылки формул относительно ячейки
+//   SnapshotRange       [range_count]        диапазоны формул относительно ячейки
+//   char                [string_size]        тексты ячеек подряд
+//
+// Формулы одной формы хранятся один раз. Связи между ячейками
+// восстанавливаются по ссылкам формул, а записанный для каждой ячейки
+// топологический порядок позволяет не искать циклы при загрузке.
+
+static const char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+static const std::uint32_t SNAPSHOT_VERSION = 4;
+// Записывается в заголовок в порядке байт машины.
+static const std::uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+// В снимок записаны вычисленные значения формул.
+static const std::uint32_t SNAPSHOT_HAS_VALUES = 1;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    std::uint32_t byte_order;
+    std::uint32_t version;
+    std::uint32_t flags;
+    // выравнивание, записывается нулём
+    std::uint32_t reserved;
+    // печатная область таблицы
+    std::int32_t rows;
+    std::int32_t cols;
+    std::uint64_t cell_count;
+    std::uint64_t shape_count;
+    std::uint64_t instruction_count;
+    std::uint64_t number_count;
+    std::uint64_t reference_count;
+    std::uint64_t range_count;
+    std::uint64_t string_size;
+    // номер последней записи журнала, вошедшей в снимок (см. journal.h)
+    std::uint64_t journal_sequence;
+};
+
+struct SnapshotCell
+{
+    enum Kind : std::uint32_t
+    {
+        TEXT,
+        FORMULA,         // значение не записано
+        FORMULA_NUMBER,  // data — биты значения типа double
+        FORMULA_ERROR,   // data — FormulaError::Category
+    };
+
+    std::int32_t row;
+    std::int32_t col;
+    // позиция ячейки в топологическом порядке таблицы
+    std::int64_t order;
+    std::uint32_t kind;
+    // TEXT: длина текста; формула: номер её SnapshotShape
+    std::uint32_t index;
+    // TEXT: начало текста в секции строк; формула: значение
+    std::uint64_t data;
+};
+
+struct SnapshotShape
+{
+    std::uint64_t first_instruction;
+    std::uint64_t first_number;
+    std::uint64_t first_reference;
+    std::uint64_t first_range;
+    std::uint32_t instruction_count;
+    std::uint32_t number_count;
+    std::uint32_t reference_count;
+    std::uint32_t range_count;
+    std::uint32_t stack_depth;
+    std::uint32_t padding;
+};
+
+struct SnapshotInstruction
+{
+    std::uint8_t op;
+    std::uint8_t padding[3];
+    std::uint32_t arg;
+};
+
+struct SnapshotReference
+{
+    std::int32_t row;
+    std::int32_t col;
+};
+
+struct SnapshotRange
+{
+    SnapshotReference from;
+    SnapshotReference to;
+};
+
+static_assert(sizeof(SnapshotHeader) % 8 == 0);
+static_assert(sizeof(SnapshotCell) == 32);
+static_assert(sizeof(SnapshotShape) == 56);
+static_assert(sizeof(SnapshotInstruction) == 8);
+static_assert(sizeof(SnapshotReference) == 8);
+static_assert(sizeof(SnapshotRange) == 16);
+
+// Исключение, выбрасываемое при чтении повреждённого или несовместимого
+// снимка
+class SnapshotException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Читает снимок прямо из его байтов, ничего не копируя заранее: при
+// создании проверяются только заголовок и границы секций, а записи
+// проверяются по мере чтения.
+class SnapshotReader
+{
+public:
+    // Бросает SnapshotException, если data — не снимок, снимок другой
+    // версии или секции не совпадают с размером данных.
+    explicit SnapshotReader(std::string_view data);
+
+    const SnapshotHeader &GetHeader() const;
+
+    SnapshotCell GetCell(std::size_t index) const;
+
+    // Номер первой записи ячейки не раньше pos построчно: записи ячеек
+    // упорядочены по строкам, а в строке — по столбцам.
+    std::size_t LowerBound(Position pos) const;
+
+    std::optional<SnapshotCell> FindCell(Position pos) const;
+
+    // Текст ячейки вида TEXT.
+    std::string GetText(const SnapshotCell &cell) const;
+
+    // Формула с номером index; её программа размещается в resource.
+    FormulaAST GetShape(std::size_t index, std::pmr::memory_resource *resource) const;
+
+    // Записанное значение формулы, если оно есть.
+    std::optional<CellInterface::Value> GetValue(const SnapshotCell &cell) const;
+
+private:
+    std::string_view data_;
+    SnapshotHeader header_;
+    // смещения секций в data_
+    std::size_t cells_;
+    std::size_t shapes_;
+    std::size_t instructions_;
+    std::size_t numbers_;
+    std::size_t references_;
+    std::size_t ranges_;
+    std::size_t strings_;
+};
+
+// Файл, отображённый в память только для чтения. Там, где отображение
+// недоступно, файл читается в память целиком.
+class MappedFile
+{
+public:
+    // Бросает SnapshotException, если файл не удалось открыть.
+    explicit MappedFile(const std::string &path);
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    std::string_view GetData() const;
+
+private:
+    const char *data_ = nullptr;
+    std::size_t size_ = 0;
+    std::string buffer_;
+};
@@ -0,0 +1,134 @@
+#include "storage.h"
+
+CellStorage::CellStorage(std::pmr::memory_resource *resource)
+    : allocator_(resource), blocks_(BLOCK_ROWS)
+{
+}
+
+CellStorage::~CellStorage()
+{
+    Clear();
+}
+
+Cell *CellStorage::Get(Position pos) const
+{
+    const Block *block = FindBlock(pos.row, pos.col);
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+    return block->cells[IndexInBlock(pos)];
+}
+
+void CellStorage::Erase(Position pos)
+{
+    auto &block_row = blocks_[pos.row / BLOCK_SIZE];
+    if (block_row.empty())
+    {
+        return;
+    }
+    auto &block = block_row[pos.col / BLOCK_SIZE];
+    if (block == nullptr)
+    {
+        return;
+    }
+    auto &slot = block->cells[IndexInBlock(pos)];
+    if (slot != nullptr)
+    {
+        Destroy(slot);
+        slot = nullptr;
+        block->row_masks[pos.row % BLOCK_SIZE] &= ~(std::uint64_t{1} << (pos.col % BLOCK_SIZE));
+        block->col_masks[pos.col % BLOCK_SIZE] &= ~(std::uint64_t{1} << (pos.row % BLOCK_SIZE));
+        if (--block->count == 0)
+        {
+            block = nullptr;
+        }
+    }
+}
+
+void CellStorage::Clear()
+{
+    for (auto &block_row : blocks_)
+    {
+        for (auto &block : block_row)
+        {
+            if (block != nullptr)
+            {
+                for (Cell *cell : block->cells)
+                {
+                    Destroy(cell);
+                }
+            }
+        }
+        block_row.clear();
+    }
+}
+
+const CellStorage::Block *CellStorage::FindBlock(int row, int col) const
+{
+    const auto &block_row = blocks_[row / BLOCK_SIZE];
+    if (block_row.empty())
+    {
+        return nullptr;
+    }
+    return block_row[col / BLOCK_SIZE].get();
+}
+
+Cell *&CellStorage::Slot(Position pos)
+{
+    auto &block_row = blocks_[pos.row / BLOCK_SIZE];
+    if (block_row.empty())
+    {
+        block_row.resize(BLOCK_COLS);
+    }
+    auto &block = block_row[pos.col / BLOCK_SIZE];
+    if (block == nullptr)
+    {
+        block = std::make_unique<Block>();
+    }
+    auto &slot = block->cells[IndexInBlock(pos)];
+    if (slot == nullptr)
+    {
+        ++block->count;
+        block->row_masks[pos.row % BLOCK_SIZE] |= std::uint64_t{1} << (pos.col % BLOCK_SIZE);
+        block->col_masks[pos.col % BLOCK_SIZE] |= std::uint64_t{1} << (pos.row % BLOCK_SIZE);
+    }
+    return slot;
+}
+
+void CellStorage::Destroy(Cell *cell)
+{
+    if (cell != nullptr)
+    {
+        allocator_.destroy(cell);
+        allocator_.deallocate(cell, 1);
+    }
+}
+
+int CellStorage::IndexInBlock(Position pos)
+{
+    return (pos.row % BLOCK_SIZE) * BLOCK_SIZE + pos.col % BLOCK_SIZE;
+}
+
+std::uint64_t CellStorage::MaskInBlock(int index, int first, int last)
+{
+    const int from = std::max(first - index * BLOCK_SIZE, 0);
+    const int to = std::min(last - index * BLOCK_SIZE, BLOCK_SIZE - 1);
+    const std::uint64_t upto = to == BLOCK_SIZE - 1 ? ~std::uint64_t{0} : (std::uint64_t{1} << (to + 1)) - 1;
+    return upto & ~((std::uint64_t{1} << from) - 1);
+}
+
+int CellStorage::LowestBit(std::uint64_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#else
+    int bit = 0;
+    while ((mask & 1) == 0)
+    {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
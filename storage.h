@@ -0,0 +1,173 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+// Хранилище ячеек таблицы. Лист разбит на блоки BLOCK_SIZE x BLOCK_SIZE,
+// каждый блок выделяется при первой записи в него и освобождается, когда
+// в нём не остаётся ячеек. Внутри блока ячейки лежат построчно, поэтому
+// обход строки идёт по непрерывной памяти без хеширования, а битовые маски
+// занятых позиций каждой строки и столбца блока позволяют обходить только
+// существующие ячейки.
+// Сами ячейки размещаются в переданном memory_resource (пуле таблицы).
+class CellStorage
+{
+public:
+    static const int BLOCK_SIZE = 64;
+
+    explicit CellStorage(std::pmr::memory_resource *resource);
+
+    CellStorage(const CellStorage &) = delete;
+    CellStorage &operator=(const CellStorage &) = delete;
+
+    ~CellStorage();
+
+    Cell *Get(Position pos) const;
+
+    // Создаёт в позиции pos новую ячейку Cell(args...), заменяя прежнюю.
+    template <typename... Args>
+    Cell *Emplace(Position pos, Args &&...args);
+
+    void Erase(Position pos);
+
+    void Clear();
+
+    // Вызывает func(pos, cell) для каждой ячейки хранилища в порядке
+    // блоков. func не должна добавлять и удалять ячейки.
+    template <typename Func>
+    void ForEach(Func func) const;
+
+    // Вызывает func(pos, cell) для каждой ячейки области range в порядке
+    // order. Время обхода пропорционально числу блоков, пересекающих
+    // область, и числу ячеек в ней. func не должна добавлять и удалять
+    // ячейки.
+    template <typename Func>
+    void ForEachInRange(Range range, CellOrder order, Func func) const;
+
+private:
+    static const int BLOCK_ROWS = Position::MAX_ROWS / BLOCK_SIZE;
+    static const int BLOCK_COLS = Position::MAX_COLS / BLOCK_SIZE;
+
+    static_assert(BLOCK_SIZE == 64, "a block line must fit into a 64-bit mask");
+
+    struct Block
+    {
+        std::array<Cell *, BLOCK_SIZE * BLOCK_SIZE> cells{};
+        int count = 0;
+        // бит j в row_masks[i] и бит i в col_masks[j] — ячейка (i, j) блока
+        std::array<std::uint64_t, BLOCK_SIZE> row_masks{};
+        std::array<std::uint64_t, BLOCK_SIZE> col_masks{};
+    };
+
+    std::pmr::polymorphic_allocator<Cell> allocator_;
+
+    // Разреженный каталог блоков: строка каталога заводится при первой
+    // записи в соответствующую полосу строк листа.
+    std::vector<std::vector<std::unique_ptr<Block>>> blocks_;
+
+    const Block *FindBlock(int row, int col) const;
+
+    Cell *&Slot(Position pos);
+
+    void Destroy(Cell *cell);
+
+    static int IndexInBlock(Position pos);
+
+    // Биты позиций [first, last] листа внутри полосы блоков с номером index.
+    static std::uint64_t MaskInBlock(int index, int first, int last);
+
+    static int LowestBit(std::uint64_t mask);
+};
+
+template <typename... Args>
+Cell *CellStorage::Emplace(Position pos, Args &&...args)
+{
+    Cell *cell = allocator_.allocate(1);
+    try
+    {
+        allocator_.construct(cell, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        allocator_.deallocate(cell, 1);
+        throw;
+    }
+    Cell *&slot = Slot(pos);
+    Destroy(slot);
+    slot = cell;
+    return cell;
+}
+
+template <typename Func>
+void CellStorage::ForEach(Func func) const
+{
+    for (int block_row = 0; block_row < static_cast<int>(blocks_.size()); ++block_row)
+    {
+        for (int block_col = 0; block_col < static_cast<int>(blocks_[block_row].size()); ++block_col)
+        {
+            const Block *block = blocks_[block_row][block_col].get();
+            if (block == nullptr)
+            {
+                continue;
+            }
+            for (int index = 0; index < BLOCK_SIZE * BLOCK_SIZE; ++index)
+            {
+                if (block->cells[index] != nullptr)
+                {
+                    func(Position{block_row * BLOCK_SIZE + index / BLOCK_SIZE, block_col * BLOCK_SIZE + index % BLOCK_SIZE},
+                         block->cells[index]);
+                }
+            }
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEachInRange(Range range, CellOrder order, Func func) const
+{
+    const bool by_rows = order == CellOrder::RowMajor;
+    // внешняя полоса блоков идёт вдоль порядка обхода, внутренняя — поперёк
+    const int outer_first = by_rows ? range.from.row : range.from.col;
+    const int outer_last = by_rows ? range.to.row : range.to.col;
+    const int inner_first = by_rows ? range.from.col : range.from.row;
+    const int inner_last = by_rows ? range.to.col : range.to.row;
+
+    std::array<std::pair<int, const Block *>, std::max(int{BLOCK_ROWS}, int{BLOCK_COLS})> stripe;
+    for (int outer_block = outer_first / BLOCK_SIZE; outer_block <= outer_last / BLOCK_SIZE; ++outer_block)
+    {
+        std::size_t count = 0;
+        for (int inner_block = inner_first / BLOCK_SIZE; inner_block <= inner_last / BLOCK_SIZE; ++inner_block)
+        {
+            const Block *block = by_rows ? FindBlock(outer_block * BLOCK_SIZE, inner_block * BLOCK_SIZE)
+                                         : FindBlock(inner_block * BLOCK_SIZE, outer_block * BLOCK_SIZE);
+            if (block != nullptr)
+            {
+                stripe[count++] = {inner_block, block};
+            }
+        }
+        const int first = std::max(outer_first, outer_block * BLOCK_SIZE);
+        const int last = std::min(outer_last, outer_block * BLOCK_SIZE + BLOCK_SIZE - 1);
+        for (int line = first; count != 0 && line <= last; ++line)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                const auto [inner_block, block] = stripe[i];
+                const auto &masks = by_rows ? block->row_masks : block->col_masks;
+                for (std::uint64_t mask = masks[line % BLOCK_SIZE] & MaskInBlock(inner_block, inner_first, inner_last);
+                     mask != 0; mask &= mask - 1)
+                {
+                    const int inner = inner_block * BLOCK_SIZE + LowestBit(mask);
+                    const Position pos = by_rows ? Position{line, inner} : Position{inner, line};
+                    func(pos, static_cast<const Cell *>(block->cells[IndexInBlock(pos)]));
+                }
+            }
+        }
+    }
+}
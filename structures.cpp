@@ -67,11 +67,18 @@ Position Position::FromString(std::string_view str)
         return Position::NONE;
     }
 
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof())
+    int row = 0;
+    for (char ch : digits)
     {
-        return Position::NONE;
+        if (!std::isdigit(ch))
+        {
+            return Position::NONE;
+        }
+        row = row * 10 + (ch - '0');
+        if (row > MAX_ROWS)
+        {
+            return Position::NONE;
+        }
     }
 
     int col = 0;
@@ -87,4 +94,41 @@ Position Position::FromString(std::string_view str)
 bool Size::operator==(Size rhs) const
 {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
+
+const Range Range::NONE = {Position::NONE, Position::NONE};
+
+bool Range::operator==(Range rhs) const
+{
+    return from == rhs.from && to == rhs.to;
+}
+
+bool Range::IsValid() const
+{
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+std::string Range::ToString() const
+{
+    if (!IsValid())
+    {
+        return "";
+    }
+    if (from == to)
+    {
+        return from.ToString();
+    }
+    return from.ToString() + ":" + to.ToString();
+}
+
+Range Range::FromString(std::string_view str)
+{
+    auto colon = str.find(':');
+    if (colon == std::string_view::npos)
+    {
+        Position pos = Position::FromString(str);
+        return pos.IsValid() ? Range{pos, pos} : Range::NONE;
+    }
+    Range range{Position::FromString(str.substr(0, colon)), Position::FromString(str.substr(colon + 1))};
+    return range.IsValid() ? range : Range::NONE;
+}